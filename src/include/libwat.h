@@ -29,6 +29,15 @@
 
 #include "wat_declare.h"
 
+#ifdef __WINDOWS__
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
 /* Debugging */
 #define WAT_DEBUG_UART_RAW			(1 << 0) /* Show raw uart reads */
 #define WAT_DEBUG_UART_DUMP			(1 << 1) /* Show uart commands */
@@ -87,10 +96,11 @@ typedef enum {
 	WAT_ALARM_NO_SIGNAL,
 	WAT_ALARM_LO_SIGNAL,
 	WAT_ALARM_SIM_ACCESS_FAIL,
+	WAT_ALARM_DEVICE_FAIL,		/* The reactor lost the span device (hangup, end of file or read error) */
 	WAT_ALARM_INVALID,
 } wat_alarm_t;
 
-#define WAT_ALARM_STRINGS "Alarm Cleared", "No Signal", "Lo Signal", "SIM access failure", "Invalid"
+#define WAT_ALARM_STRINGS "Alarm Cleared", "No Signal", "Lo Signal", "SIM access failure", "Device failure", "Invalid"
 WAT_STR2ENUM_P(wat_str2wat_alarm, wat_alarm2str, wat_alarm_t);
 
 typedef enum {	
@@ -542,6 +552,35 @@ typedef enum {
 #define WAT_BAND_STRINGS "auto", "900-1800", "900-1900", "850-1800" , "850-1900", "Invalid"
 WAT_STR2ENUM_P(wat_str2wat_band, wat_band2str, wat_band_t);
 
+/* What to do with received data when the read buffer is full */
+typedef enum {
+	WAT_BUFFER_POLICY_DROP,				/* Discard the data */
+	WAT_BUFFER_POLICY_GROW,				/* Grow the buffer, up to rx_buffer_max_size */
+	WAT_BUFFER_POLICY_BACKPRESSURE,		/* Refuse the data, wat_span_process_read returns WAT_EBUSY and the
+										   caller should give it again after calling wat_span_run */
+	WAT_BUFFER_POLICY_INVALID,
+} wat_buffer_policy_t;
+
+#define WAT_BUFFER_POLICY_STRINGS "drop", "grow", "backpressure", "Invalid"
+WAT_STR2ENUM_P(wat_str2wat_buffer_policy, wat_buffer_policy2str, wat_buffer_policy_t);
+
+typedef struct {
+	uint32_t size;				/* Current size of the read buffer */
+	uint32_t high_watermark;	/* Largest amount of data ever waiting in the read buffer */
+	uint32_t grow_count;		/* Number of times the read buffer had to grow */
+	uint32_t refused_count;		/* Number of reads that did not fit in the read buffer */
+} wat_rx_stats_t;
+
+typedef struct {
+	uint32_t allocated;			/* Number of command objects allocated for the pool */
+	uint32_t reused;			/* Number of commands served from the pool without allocating */
+	uint32_t spilled;			/* Number of commands too long to be stored inline */
+	uint32_t coalesced;			/* Number of commands not queued because an identical one was already waiting */
+	uint32_t retried;			/* Number of times a command was sent again after a time out */
+	uint32_t dropped;			/* Number of commands cancelled or past their deadline before being sent */
+	uint32_t interval;			/* Current amount of time between 2 commands */
+} wat_cmd_stats_t;
+
 typedef struct _wat_span_config_t {
 	wat_moduletype_t moduletype;	
 
@@ -550,6 +589,8 @@ typedef struct _wat_span_config_t {
 	uint32_t timeout_command;	/* General timeout to for the chip to respond to a command */
 	uint32_t timeout_wait_sim; /* Timeout to wait for SIM to respond */
 	uint32_t cmd_interval;		/* Minimum amount of time between sending 2 commands to the chip */
+	wat_bool_t adaptive_cmd_interval; /* Shrink cmd_interval down to the module minimum while the chip keeps
+										 answering, go back to cmd_interval when a command times out */
 	uint32_t progress_poll_interval; /* How often to check for call status on outbound call */
 	uint32_t signal_poll_interval;	/* How often to check for signal quality */
 	uint8_t	signal_threshold; /* If the signal strength drops lower than this value in -dBM, we will report an alarm */
@@ -562,6 +603,13 @@ typedef struct _wat_span_config_t {
 	wat_sms_content_encoding_t incoming_sms_encoding; /* Encoding to use on received SMS when not in ASCII */
 	uint32_t debug_mask; /* Initial debug mask, should be set via wat_str2debug */
 	wat_bool_t hardware_dtmf; /* Enable hardware DTMF if available */
+	wat_bool_t lockfree_rx; /* Do not lock the read buffer. Only valid if wat_span_process_read is always called from
+							   the same thread, wat_span_run may be called from another one */
+	wat_buffer_policy_t rx_buffer_policy; /* What to do when the read buffer is full */
+	uint32_t rx_buffer_max_size; /* Maximum size of the read buffer with WAT_BUFFER_POLICY_GROW */
+	wat_bool_t shared_scheduler; /* Run the timers of all the spans with this option from a single schedule, so they
+									wake up together. These spans must all be run from the same thread (e.g the
+									reactor) and have no wakeup fd */
 } wat_span_config_t;
 
 typedef void (*wat_span_sts_func_t)(uint8_t span_id, wat_span_status_t *status);
@@ -578,6 +626,10 @@ typedef void (*wat_rel_cfm_func_t)(uint8_t span_id, uint8_t call_id);
 typedef void (*wat_sms_ind_func_t)(uint8_t span_id, wat_sms_event_t *sms_event);
 typedef void (*wat_sms_sts_func_t)(uint8_t span_id, uint8_t sms_id, wat_sms_status_t *sms_status);
 typedef void (*wat_cmd_sts_func_t)(uint8_t span_id, wat_cmd_status_t *status);
+/* Returns the number of bytes written. The device may accept only part of the data, or
+   nothing at all (negative with errno EAGAIN, EWOULDBLOCK or EINTR), the rest will be written
+   later. 0, or negative with any other errno or none, is a device error, the queued data is
+   dropped and the command being sent times out right away */
 typedef int (*wat_span_write_func_t)(uint8_t span_id, void *data, uint32_t len);
 typedef void (*wat_dtmf_ind_func_t)(uint8_t span_id, const char *dtmf);
 
@@ -621,9 +673,23 @@ WAT_DECLARE(wat_status_t) wat_span_config(uint8_t span_id, wat_span_config_t *sp
 WAT_DECLARE(wat_status_t) wat_span_unconfig(unsigned char span_id);
 WAT_DECLARE(wat_status_t) wat_span_start(uint8_t span_id);
 WAT_DECLARE(wat_status_t) wat_span_stop(uint8_t span_id);
-WAT_DECLARE(void) wat_span_process_read(uint8_t span_id, void *data, uint32_t len);
+WAT_DECLARE(wat_status_t) wat_span_process_read(uint8_t span_id, void *data, uint32_t len);
+WAT_DECLARE(wat_status_t) wat_span_process_readv(uint8_t span_id, const struct iovec *iov, int iovcnt);
+WAT_DECLARE(wat_bool_t) wat_span_want_write(uint8_t span_id);
+WAT_DECLARE(void) wat_span_process_write(uint8_t span_id);
 WAT_DECLARE(uint32_t) wat_span_schedule_next(uint8_t span_id);
 WAT_DECLARE(void) wat_span_run(uint8_t span_id);
+/* Descriptor that becomes readable whenever wat_span_run has work to do, a timer expired or requests are
+   pending. Poll it instead of calling wat_span_schedule_next before each poll. Valid from wat_span_start
+   until wat_span_stop closes it, -1 if not supported on this platform (Linux only) */
+WAT_DECLARE(int) wat_span_get_wakeup_fd(uint8_t span_id);
+
+/* Optional reactor mode (Linux only): libwat reads the span devices and runs the spans from a single thread.
+   A device that hangs up or fails is no longer polled and the span reports WAT_ALARM_DEVICE_FAIL, it is
+   polled again once the span is restarted or added back */
+WAT_DECLARE(wat_status_t) wat_reactor_add_span(uint8_t span_id, int fd);
+WAT_DECLARE(wat_status_t) wat_reactor_remove_span(uint8_t span_id);
+WAT_DECLARE(wat_status_t) wat_reactor_run(int32_t timeout_ms);
 
 WAT_DECLARE(const wat_chip_info_t*) wat_span_get_chip_info(uint8_t span_id);
 WAT_DECLARE(const wat_sim_info_t*) wat_span_get_sim_info(uint8_t span_id);
@@ -632,6 +698,8 @@ WAT_DECLARE(const wat_sig_info_t*) wat_span_get_sig_info(uint8_t span_id);
 WAT_DECLARE(const wat_pin_stat_t*) wat_span_get_pin_info(uint8_t span_id);
 WAT_DECLARE(wat_alarm_t) wat_span_get_alarms(uint8_t span_id);
 WAT_DECLARE(const char *) wat_span_get_last_error(uint8_t span_id);
+WAT_DECLARE(wat_status_t) wat_span_get_rx_stats(uint8_t span_id, wat_rx_stats_t *stats);
+WAT_DECLARE(wat_status_t) wat_span_get_cmd_stats(uint8_t span_id, wat_cmd_stats_t *stats);
 
 WAT_DECLARE(char*) wat_decode_rssi(char *dest, unsigned rssi);
 WAT_DECLARE(const char*) wat_decode_alarm(unsigned alarm);
@@ -649,12 +717,24 @@ WAT_DECLARE(const char*) wat_decode_timezone(char *dest, int timezone);
 #define WAT_AT_CMD_RESPONSE_FUNC(name) static int (name)  WAT_AT_CMD_RESPONSE_ARGS
 typedef int (*wat_at_cmd_response_func) WAT_AT_CMD_RESPONSE_ARGS;
 
+/* Identifies a command queued with wat_cmd_req_deadline */
+typedef uint32_t wat_cmd_handle_t;
+#define WAT_CMD_HANDLE_INVALID 0
+
 WAT_DECLARE(wat_status_t) wat_con_cfm(uint8_t span_id, uint8_t call_id);
 WAT_DECLARE(wat_status_t) wat_con_req(uint8_t span_id, uint8_t call_id, wat_con_event_t *con_event);
 WAT_DECLARE(wat_status_t) wat_rel_req(uint8_t span_id, uint8_t call_id);
 WAT_DECLARE(wat_status_t) wat_rel_cfm(uint8_t span_id, uint8_t call_id);
 WAT_DECLARE(wat_status_t) wat_sms_req(uint8_t span_id, uint8_t sms_id, wat_sms_event_t *sms_event);
 WAT_DECLARE(wat_status_t) wat_cmd_req(uint8_t span_id, const char *at_cmd, wat_at_cmd_response_func cb, void *obj);
+/* Same as wat_cmd_req, but the command is dropped if it could not be sent to the module within deadline_ms
+   (0 for no deadline). If handle is not NULL, it is set to a handle that can be passed to wat_cmd_cancel.
+   A dropped command has its response function called with success set to WAT_FALSE, no tokens (tokens[0] is NULL)
+   and error set to the reason ("deadline expired" or "cancelled"), from the span thread when the command is dequeued */
+WAT_DECLARE(wat_status_t) wat_cmd_req_deadline(uint8_t span_id, const char *at_cmd, wat_at_cmd_response_func cb, void *obj, uint32_t deadline_ms, wat_cmd_handle_t *handle);
+/* Cancels a command that was not sent to the module yet, its response function is called as for a dropped command.
+   Returns WAT_EBUSY if the module is already executing it, WAT_FAIL if it completed */
+WAT_DECLARE(wat_status_t) wat_cmd_cancel(uint8_t span_id, wat_cmd_handle_t handle);
 WAT_DECLARE(wat_status_t) wat_send_dtmf(uint8_t span_id, uint8_t call_id, const char *dtmf, wat_at_cmd_response_func cb, void *obj);
 WAT_DECLARE(wat_status_t) wat_span_set_dtmf_duration(uint8_t span_id, int duration_ms);
 WAT_DECLARE(wat_status_t) wat_span_set_codec(uint8_t span_id, wat_codec_t codec_mask);
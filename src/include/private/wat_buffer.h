@@ -25,21 +25,47 @@
 #define _WAT_BUFFER_H
 
 
+#define WAT_CACHE_LINE_SZ	64
+
 typedef struct {
 	unsigned rindex;
 	unsigned windex;
 	wat_size_t capacity;
 	wat_size_t size;
 	wat_mutex_t *mutex;
-	uint8_t new_data:1;
+	uint8_t new_data;
+	uint8_t mirrored:1;		/* Every byte is also written capacity bytes further, so the data is always contiguous */
+	uint8_t lockfree:1;		/* Single producer/single consumer mode, head and tail are used instead of the mutex */
 	void **data;
+
+	wat_size_t max_capacity;	/* The buffer grows up to this size when it is full. Not supported in lock-free mode */
+	void **retired_data;		/* Previous data area, the consumer may still be looking at it until its next view or flush */
+	wat_size_t high_watermark;	/* Largest amount of data ever stored */
+	uint32_t grow_count;		/* Number of times the buffer had to grow */
+
+	/* Lock-free mode only. head and tail are free running counters, kept on
+	   separate cache lines so that the producer and the consumer do not keep
+	   invalidating each other's cache line. The capacity is rounded up to a
+	   power of two so they can wrap around */
+	uint8_t pad_head[WAT_CACHE_LINE_SZ];
+	wat_size_t head;		/* Total number of bytes written, only modified by the producer */
+	uint8_t pad_tail[WAT_CACHE_LINE_SZ - sizeof(wat_size_t)];
+	wat_size_t tail;		/* Total number of bytes consumed, only modified by the consumer */
+	uint8_t pad_end[WAT_CACHE_LINE_SZ - sizeof(wat_size_t)];
 } wat_buffer_t;
 
 wat_status_t wat_buffer_create(wat_buffer_t **buffer, wat_size_t capacity);
+wat_status_t wat_buffer_create_mirrored(wat_buffer_t **buffer, wat_size_t capacity);
+wat_status_t wat_buffer_create_lockfree(wat_buffer_t **buffer, wat_size_t capacity);
 wat_status_t wat_buffer_destroy(wat_buffer_t **buffer);
+wat_status_t wat_buffer_set_max_capacity(wat_buffer_t *buffer, wat_size_t max_capacity);
 
 wat_status_t wat_buffer_enqueue(wat_buffer_t *buffer, void *data, wat_size_t len);
+wat_status_t wat_buffer_enqueuev(wat_buffer_t *buffer, const struct iovec *iov, int iovcnt);
+wat_status_t wat_buffer_reserve(wat_buffer_t *buffer, uint8_t **data, wat_size_t *len);
+wat_status_t wat_buffer_commit(wat_buffer_t *buffer, wat_size_t len);
 wat_status_t wat_buffer_peep(wat_buffer_t *buffer, void *data, wat_size_t *len);
+wat_status_t wat_buffer_view(wat_buffer_t *buffer, const uint8_t **data, wat_size_t *len);
 wat_status_t wat_buffer_dequeue(wat_buffer_t *buffer, void *data, wat_size_t len);
 wat_status_t wat_buffer_flush(wat_buffer_t *buffer, wat_size_t len);
 wat_status_t wat_buffer_reset(wat_buffer_t *buffer);
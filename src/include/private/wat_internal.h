@@ -29,6 +29,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 
 #include "wat_config.h"
 #include "wat_mutex.h"
@@ -50,10 +51,10 @@
 #define WAT_EVENT_QUEUE_SZ				20
 #define WAT_CMD_QUEUE_SZ				100
 #define WAT_BUFFER_SZ					10000
+#define WAT_TX_BUFFER_SZ				(2 * WAT_MAX_CMD_SZ)
 #define WAT_TOKENS_SZ					20
 #define WAT_TIMEOUTS_SZ					30
 #define WAT_ERROR_SZ					50
-#define WAT_MAX_NOTIFYS_PER_SPAN		100
 
 #define WAT_DEFAULT_TIMEOUT_CID_NUM		500
 #define WAT_DEFAULT_TIMEOUT_COMMAND		20000
@@ -65,8 +66,11 @@
 #define WAT_DEFAULT_CNUM_POLL			6000
 #define WAT_DEFAULT_CNUM_RETRIES		5
 #define WAT_DEFAULT_CALL_RELEASE_DELAY	1000
+#define WAT_PERIODIC_TIMER_SLACK		1000	/* Periodic polls of all the spans are batched on this grid */
+#define WAT_DEFAULT_RX_BUFFER_MAX_SIZE	(4 * WAT_BUFFER_SZ)
 
-#define WAT_MAX_CMD_RETRIES 1
+#define WAT_MAX_CMD_RETRIES 3
+#define WAT_CMD_RETRY_BACKOFF			50		/* Pause before the first retry, doubled on every retry */
 
 #define wat_log_span(span, level, a, ...) if (g_interface.wat_log_span) g_interface.wat_log_span(span->id, level,a, ##__VA_ARGS__)
 
@@ -137,6 +141,7 @@ typedef wat_status_t (*wat_module_handle_sig_status)(wat_span_t *span, wat_bool_
 typedef enum {
 	WAT_MODFLAG_NONE,
 	WAT_MODFLAG_IS_CDMA,
+	WAT_MODFLAG_CALL_PROGRESS_URC,	/* Module reports outbound call progress by itself, no need to poll with CLCC */
 } wat_module_flags_t;
 
 struct wat_module {
@@ -149,6 +154,7 @@ struct wat_module {
 	int32_t model;
 	const char *name;
 	wat_module_flags_t flags;
+	uint32_t min_cmd_interval;	/* Smallest gap between commands the module tolerates, used with adaptive_cmd_interval */
 };
 
 wat_status_t wat_module_register(wat_span_t *, wat_module_t *module);
@@ -265,10 +271,11 @@ typedef struct wat_event_handler {
 void *wat_calloc(wat_size_t nmemb, wat_size_t size);
 void *wat_malloc(wat_size_t size);
 void wat_free(void *ptr);
-void wat_free_tokens(char *tokens[]);
+void wat_mem_get_counters(uint64_t *allocs, uint64_t *frees);
+void wat_tokenizer_reset(wat_span_t *span);
 char *wat_strdup(const char *str);
 
-char* format_at_data(char *dest, void *indata, wat_size_t len);
+char* format_at_data(char *dest, const void *indata, wat_size_t len);
 
 wat_status_t wat_event_enqueue(wat_span_t *span, wat_event_t *event);
 wat_event_t *wat_event_dequeue(wat_span_t *span);
@@ -284,7 +291,9 @@ typedef int (wat_cmd_notify_func) WAT_NOTIFY_ARGS;
 
 #define WAT_SCHEDULED_FUNC(name) void (name) (void *data)
 
+void wat_cmd_init(void);
 wat_status_t wat_cmd_register(wat_span_t *span, const char *prefix, wat_cmd_notify_func *func);
+void wat_cmd_unregister_all(wat_span_t *span);
 wat_status_t wat_cmd_enqueue(wat_span_t *span, const char *cmd, wat_cmd_response_func *cb, void *obj, uint32_t timeout_ms);
 wat_status_t wat_cmd_send(wat_span_t *span, const char *cmd, wat_cmd_response_func *cb, void *obj, uint32_t timeout_ms);
 
@@ -293,18 +302,122 @@ typedef struct _wat_user_cmd_t {
 	void *obj;
 } wat_user_cmd_t;
 
+/* Command dispatch lanes, highest priority first */
+typedef enum {
+	WAT_CMD_PRIO_NEXT,			/* Continuation of the previous command (i.e SMS terminator), see wat_cmd_send */
+	WAT_CMD_PRIO_CALL,			/* Call control: dial, answer, hangup and call progress */
+	WAT_CMD_PRIO_NORMAL,		/* Configuration, SMS and user commands */
+	WAT_CMD_PRIO_POLL,			/* Periodic polling */
+	WAT_CMD_PRIO_SZ,
+} wat_cmd_prio_t;
+
+#define WAT_CMD_PRIO_STRINGS "next", "call", "normal", "poll", "invalid"
+WAT_STR2ENUM_P(wat_str2wat_cmd_prio, wat_cmd_prio2str, wat_cmd_prio_t);
+
+/* Commands up to this length are stored inside the wat_cmd_t, longer ones (i.e SMS PDU's) go on the heap */
+#define WAT_CMD_INLINE_SZ				64
+
 typedef struct wat_cmd {
-	char *cmd;
+	char *cmd;					/* Points to inline_cmd, or to heap memory for long commands */
 	wat_cmd_response_func *cb;
 	void *obj;
 	uint32_t timeout;
-	uint8_t retries;
+	uint8_t retries;			/* Number of times the command was sent again after a time out */
+	wat_bool_t idempotent;		/* Read-only query sent again on time out, see wat_cmd_enqueue_query */
+	wat_bool_t cancelled;		/* Dropped instead of sent when dequeued, see wat_cmd_cancel_handle */
+	wat_bool_t answered;		/* Response handled, the command stays active for the command interval */
+	uint64_t deadline;			/* Time in ms after which the command is dropped instead of sent, 0 for none */
+	wat_cmd_handle_t handle;	/* Handle given to the user, WAT_CMD_HANDLE_INVALID for internal commands */
+	wat_cmd_prio_t prio;
+	struct wat_cmd *next_free;	/* Link in the span command pool */
+	char inline_cmd[WAT_CMD_INLINE_SZ];
 } wat_cmd_t;
 
-typedef struct wat_notify {
-	char *prefix;
-	wat_cmd_notify_func *func;
-} wat_notify_t;
+#define WAT_CMD_BATCH_MAX_SECTIONS		8
+#define WAT_CMD_BATCH_MAX_LINES			4
+
+/* One command of a batch sent as a single command line, see wat_cmd_enqueue_batch */
+typedef struct wat_cmd_section {
+	const char *cmd;			/* Command without the "AT" prefix, i.e "+CGMM" */
+	wat_cmd_response_func *cb;
+	void *obj;
+	uint8_t lines;				/* Number of information lines the command answers with */
+} wat_cmd_section_t;
+
+/* One field of a comma separated response entry, see wat_cmd_entry_fields. Points inside the entry
+   and is not null-terminated */
+typedef struct wat_field {
+	const char *str;
+	wat_size_t len;
+} wat_field_t;
+
+#define WAT_SCHEMA_MAX_FIELDS			8
+
+typedef enum {
+	WAT_SCHEMA_INT,				/* int member, see wat_field_int */
+	WAT_SCHEMA_STR,				/* char array member, truncated to fit */
+	WAT_SCHEMA_SKIP,			/* Field is not stored */
+} wat_schema_type_t;
+
+typedef struct wat_schema_field {
+	wat_schema_type_t type;
+	wat_size_t offset;			/* Offset of the member in the target struct */
+	wat_size_t size;			/* Size of the member */
+} wat_schema_field_t;
+
+/* Describes how the fields of a response entry map to the members of a struct, see wat_schema_parse */
+typedef struct wat_schema {
+	const char *prefix;			/* Skipped if the entry starts with it, i.e "+CREG: " */
+	wat_size_t prefix_len;
+	uint8_t min_fields;			/* Entries with less fields are rejected */
+	uint8_t num_fields;
+	wat_size_t struct_size;
+	const wat_schema_field_t *fields;
+} wat_schema_t;
+
+#define WAT_SCHEMA_FIELD(type, st, member) { type, offsetof(st, member), sizeof(((st *)0)->member) }
+#define WAT_SCHEMA_FIELD_SKIP { WAT_SCHEMA_SKIP, 0, 0 }
+#define WAT_SCHEMA(prefix, st, min_fields, fields) { prefix, sizeof(prefix) - 1, min_fields, wat_array_len(fields), sizeof(st), fields }
+
+/* Notify handlers are stored in a case-insensitive prefix trie, each node is one
+   character of a prefix. Children of a node are chained through their sibling pointer */
+typedef struct wat_notify_node {
+	char key;
+	wat_cmd_notify_func *func;		/* Set if a prefix ends at this node */
+	struct wat_notify_node *child;
+	struct wat_notify_node *sibling;
+} wat_notify_node_t;
+
+/* Token boundaries are kept as offsets into the RX buffer so that we can resume
+   scanning where we left off when more data is received */
+typedef struct wat_token_span {
+	wat_size_t start;
+	wat_size_t end;
+} wat_token_span_t;
+
+typedef struct wat_tokenizer {
+	wat_size_t scan_index;		/* Offset of the first byte that was not scanned yet */
+	wat_size_t consumed;		/* Number of bytes that can be flushed once the tokens are handled */
+	wat_size_t token_start;		/* Offset of the first byte of the token being received */
+	wat_size_t token_end;		/* Offset right after the last byte of the token being received */
+	uint8_t has_token:1;		/* We are in the middle of receiving a token */
+	uint8_t prompt:1;			/* We received a '>', chip will not send anything else */
+	unsigned token_count;
+	unsigned dispatched;		/* Leading tokens the last pass looked at without calling any handler,
+								   they are neither copied nor dispatched again */
+} wat_tokenizer_t;
+
+/* Tokens handed to the response and notify handlers are carved out of this arena.
+   The arena is rewound on every parsing pass, so tokens are only valid for the
+   duration of the handler call */
+typedef struct wat_token_arena {
+	char *data;
+	wat_size_t size;			/* Size of data, at least the biggest the read buffer can get */
+	wat_size_t used;
+	wat_token_span_t *spans;	/* Boundaries of the tokens found by the tokenizer */
+	char **tokens;				/* NULL terminated token list given to the handlers */
+	unsigned capacity;			/* Number of entries in spans and tokens, see wat_token_arena_grow */
+} wat_token_arena_t;
 
 typedef struct {
 	uint8_t busy:1;
@@ -345,6 +458,11 @@ struct wat_span {
 	wat_span_config_t config;	/* Configuration parameters */
 
 	wat_buffer_t *buffer;		/* Buffer for reads */
+	uint32_t rx_refused_count;	/* Number of reads that did not fit in the read buffer */
+	wat_buffer_t *tx_buffer;	/* Bytes that the device did not accept yet */
+	uint8_t want_write;			/* The device did not accept all the data, wait until it is writable */
+	wat_tokenizer_t tokenizer;	/* Parsing state of the data in the read buffer */
+	wat_token_arena_t token_arena;	/* Storage for the tokens of the current parsing pass */
 	wat_queue_t	*event_queue;
 	wat_sched_t *sched;			/* Scheduler for timeouts */
 
@@ -352,8 +470,12 @@ struct wat_span {
 
 	uint8_t	cmd_busy:1;			/* If currently executing a command */
 	wat_cmd_t *cmd;				/* Current command being executed */
-	wat_cmd_t *cmd_next;		/* Next priority command to be executed */
-	wat_queue_t *cmd_queue;		/* Commands waiting to be executed */
+	wat_queue_t *cmd_queues[WAT_CMD_PRIO_SZ];	/* Commands waiting to be executed, one queue per priority */
+	wat_mutex_t *cmd_mutex;		/* Protects the command pool and stats, commands are also queued from user threads */
+	wat_cmd_t *cmd_pool;		/* Completed commands, ready to be reused */
+	wat_cmd_stats_t cmd_stats;
+	wat_cmd_handle_t last_cmd_handle;
+	uint32_t cmd_interval;		/* Current gap between a response and the next command, see wat_cmd_pace */
 
 	uint8_t cnum_retries;		/* Number of times we have retried to get subscriber number */
 
@@ -362,8 +484,7 @@ struct wat_span {
 	wat_call_t *calls[WAT_MAX_CALLS_PER_SPAN];
 	unsigned last_call_id;
 
-	wat_notify_t *notifys[WAT_MAX_NOTIFYS_PER_SPAN];
-	unsigned notify_count;
+	wat_notify_node_t *notifys;	/* First level of the notify prefix trie */
 
 	wat_timer_id_t timeouts[WAT_TIMEOUTS_SZ];
 
@@ -375,12 +496,34 @@ struct wat_span {
 	wat_sms_t *inbound_sms;		/* Current Inboudn SMS being executed */
 };
 
+#define wat_cmd_stats_inc(span, counter) \
+	do { \
+		wat_mutex_lock((span)->cmd_mutex); \
+		(span)->cmd_stats.counter++; \
+		wat_mutex_unlock((span)->cmd_mutex); \
+	} while (0)
 
 void wat_span_run_events(wat_span_t *span);
 void wat_span_run_cmds(wat_span_t *span);
 void wat_span_run_smss(wat_span_t *span);
 void wat_span_run_sched(wat_span_t *span);
 wat_status_t wat_cmd_process(wat_span_t *span);
+wat_status_t wat_cmd_enqueue_prio(wat_span_t *span, wat_cmd_prio_t prio, const char *cmd, wat_cmd_response_func *cb, void *obj, uint32_t timeout_ms);
+wat_status_t wat_cmd_enqueue_query(wat_span_t *span, wat_cmd_prio_t prio, const char *cmd, wat_cmd_response_func *cb, void *obj, uint32_t timeout_ms);
+wat_status_t wat_cmd_enqueue_coalesced(wat_span_t *span, wat_cmd_prio_t prio, const char *cmd, wat_cmd_response_func *cb, void *obj, uint32_t timeout_ms);
+wat_status_t wat_cmd_enqueue_batch(wat_span_t *span, const wat_cmd_section_t *sections, int count, uint32_t timeout_ms);
+void wat_cmd_release(wat_span_t *span, wat_cmd_t *cmd);
+wat_status_t wat_cmd_enqueue_deadline(wat_span_t *span, const char *cmd, wat_cmd_response_func *cb, void *obj, uint32_t timeout_ms, uint32_t deadline_ms, wat_cmd_handle_t *handle);
+wat_status_t wat_cmd_cancel_handle(wat_span_t *span, wat_cmd_handle_t handle);
+wat_cmd_t *wat_cmd_dequeue(wat_span_t *span);
+wat_bool_t wat_cmd_pending(wat_span_t *span);
+void wat_cmd_flush_all(wat_span_t *span);
+void wat_cmd_write_failed(wat_span_t *span);
+wat_status_t wat_token_arena_grow(wat_token_arena_t *arena);
+
+/* Keep the reactor registration of the span wakeup fd in step with span start/stop */
+void wat_reactor_span_started(wat_span_t *span);
+void wat_reactor_span_stopped(wat_span_t *span);
 wat_status_t wat_sms_process(wat_sms_t *sms);
 wat_status_t wat_sms_send_body(wat_sms_t *sms);
 wat_status_t wat_handle_incoming_sms_pdu(wat_span_t *span, char *data, wat_size_t len);
@@ -388,12 +531,18 @@ wat_status_t wat_handle_incoming_sms_text(wat_span_t *span, char *oa, char *scts
 wat_status_t wat_event_process(wat_span_t *span, wat_event_t *event);
 void wat_span_run_timeouts(wat_span_t *span);
 wat_status_t wat_span_update_sig_status(wat_span_t *span, wat_bool_t up);
+wat_status_t wat_span_global_init(void);
 wat_status_t wat_span_update_alarm_status(wat_span_t *span, wat_alarm_t new_alarm);
 wat_bool_t wat_sig_status_up(wat_net_stat_t stat);
 wat_status_t wat_span_update_net_status(wat_span_t *span, unsigned stat);
 int wat_span_write(wat_span_t *span, void *data, uint32_t len);
+wat_status_t wat_span_flush_tx(wat_span_t *span);
+wat_span_t *wat_get_span(uint8_t span_id);
 void wat_decode_type_of_address(uint8_t octet, wat_number_type_t *type, wat_number_plan_t *plan);
-int wat_cmd_entry_tokenize(char *entry, char *tokens[], wat_size_t len);
+int wat_cmd_entry_fields(const char *entry, wat_field_t fields[], int max_fields);
+int wat_field_int(const wat_field_t *field);
+char *wat_field_copy(char *dest, wat_size_t size, const wat_field_t *field);
+int wat_schema_parse(const wat_schema_t *schema, const char *entry, void *dest);
 char *wat_string_clean(char *string);
 
 WAT_RESPONSE_FUNC(wat_response_atz);
@@ -425,6 +574,7 @@ WAT_NOTIFY_FUNC(wat_notify_clip);
 WAT_NOTIFY_FUNC(wat_notify_creg);
 
 WAT_SCHEDULED_FUNC(wat_scheduled_clcc);
+void wat_call_monitor_progress(wat_call_t *call);
 WAT_SCHEDULED_FUNC(wat_scheduled_csq);
 WAT_SCHEDULED_FUNC(wat_cmd_timeout);
 
@@ -445,7 +595,6 @@ wat_status_t _wat_span_set_state(const char *func, int line, wat_span_t *span, w
 
 typedef enum {
 	WAT_ITERATOR_CALLS =1,
-	WAT_ITERATOR_NOTIFYS,
 } wat_iterator_type_t;
 
 typedef struct wat_iterator {
@@ -461,7 +610,6 @@ wat_iterator_t *wat_iterator_next(wat_iterator_t *iter);
 wat_status_t wat_iterator_free(wat_iterator_t *iter);
 
 wat_iterator_t *wat_span_get_call_iterator(const wat_span_t *span, wat_iterator_t *iter);
-wat_iterator_t *wat_span_get_notify_iterator(const wat_span_t *span, wat_iterator_t *iter);
 
 wat_status_t wat_span_call_create(wat_span_t *span, wat_call_t **call, uint8_t id, wat_direction_t dir);
 void wat_span_call_destroy(wat_call_t **incall);
@@ -25,12 +25,14 @@
 
 
 typedef struct wat_queue wat_queue_t;
+typedef wat_bool_t (*wat_queue_match_func)(void *obj, void *data);
 
 wat_status_t wat_queue_create(wat_queue_t **outqueue, wat_size_t capacity);
 wat_status_t wat_queue_destroy(wat_queue_t **inqueue);
 wat_status_t wat_queue_enqueue(wat_queue_t *queue, void *obj);
 void *wat_queue_dequeue(wat_queue_t *queue);
 wat_bool_t wat_queue_empty(wat_queue_t *queue);
+void *wat_queue_find(wat_queue_t *queue, wat_queue_match_func match, void *data);
 
 
 #endif /* _WAT_QUEUE_H */
@@ -27,6 +27,7 @@
 
 typedef struct wat_sched wat_sched_t;
 typedef void (*wat_sched_callback_t)(void *data);
+typedef uint64_t (*wat_sched_clock_t)(void);
 typedef uint64_t wat_timer_id_t;
 
 /*! \brief Create a new scheduling context */
@@ -38,7 +39,8 @@ WAT_DECLARE(wat_status_t) wat_sched_run(wat_sched_t *sched);
 /*! 
  * \brief Schedule a new timer 
  * \param sched The scheduling context (required)
- * \param name Timer name, typically unique but is not required to be unique, any null terminated string is fine (required)
+ * \param name Timer name, typically unique but is not required to be unique. Only the pointer is kept,
+ *             so it must outlive the timer, typically a string literal (required)
  * \param callback The callback to call upon timer expiration (required)
  * \param data Optional data to pass to the callback
  * \param timer Timer id pointer to store the id of the newly created timer. It can be null
@@ -48,6 +50,16 @@ WAT_DECLARE(wat_status_t) wat_sched_run(wat_sched_t *sched);
 WAT_DECLARE(wat_status_t) wat_sched_timer(wat_sched_t *sched, const char *name,
 		int ms, wat_sched_callback_t callback, void *data, wat_timer_id_t *timer);
 
+/*! 
+ * \brief Schedule a new timer that may expire up to slack milliseconds late
+ *
+ * The expiration is rounded up to a multiple of the slack on the scheduler clock, so timers
+ * armed with the same slack, even from different schedules, expire at the same time.
+ * Meant for periodic work that does not need to be precise. A slack of 0 is wat_sched_timer
+ */
+WAT_DECLARE(wat_status_t) wat_sched_timer_slack(wat_sched_t *sched, const char *name,
+		int ms, int slack, wat_sched_callback_t callback, void *data, wat_timer_id_t *timer);
+
 /*! 
  * \brief Cancel the timer
  * \param sched The scheduling context (required)
@@ -73,6 +85,30 @@ WAT_DECLARE(wat_status_t) wat_sched_destroy(wat_sched_t **sched);
 WAT_DECLARE(wat_status_t) wat_sched_get_time_to_next_timer(const wat_sched_t *sched, int32_t *timeto);
 
 
+/*! 
+ * \brief Get a timerfd that becomes readable when the earliest timer expires (Linux only)
+ * \param sched The sched context
+ * \return The fd, created on the first call and closed by wat_sched_destroy, -1 on failure.
+ *         The fd follows CLOCK_MONOTONIC, so it does not work with a clock set by wat_sched_set_clock
+ */
+WAT_DECLARE(int) wat_sched_get_fd(wat_sched_t *sched);
+
+/*! \brief Make the fd readable right away, until wat_sched_clear_fd is called. No-op without an fd */
+WAT_DECLARE(void) wat_sched_wakeup(wat_sched_t *sched);
+
+/*! \brief Consume the fd expirations and any pending wakeup, call it before running the schedule */
+WAT_DECLARE(void) wat_sched_clear_fd(wat_sched_t *sched);
+
+/*! \brief Current time in milliseconds, on the clock used by the timers */
+WAT_DECLARE(uint64_t) wat_sched_time_ms(void);
+
+/*! 
+ * \brief Replace the clock used by all the schedules and command deadlines
+ * \param clock Function returning the current time in milliseconds, NULL restores the default
+ *              CLOCK_MONOTONIC clock. Meant for tests, set it before any timer is scheduled
+ */
+WAT_DECLARE(void) wat_sched_set_clock(wat_sched_clock_t clock);
+
 /*! \brief Global initialization, called just once */
 WAT_DECLARE(wat_status_t) wat_sched_global_init(void);
 
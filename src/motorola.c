@@ -46,6 +46,7 @@ static wat_module_t motorola_interface = {
 	.model =  0,
 	.name = "motorola",
 	.flags = WAT_MODFLAG_NONE,
+	.min_cmd_interval = WAT_DEFAULT_COMMAND_INTERVAL,
 };
 
 wat_status_t motorola_init(wat_span_t *span)
@@ -93,7 +94,7 @@ wat_status_t motorola_wait_sim(wat_span_t *span)
 	wat_cmd_enqueue(span, "AT+MADIGITAL=1", NULL, NULL, span->config.timeout_command);
 
 	/* Motorola dev guide states this command is necessary for full operation */
-	wat_cmd_enqueue(span, "AT+CPIN?", wat_response_cpin, NULL, span->config.timeout_command);
+	wat_cmd_enqueue_query(span, WAT_CMD_PRIO_NORMAL, "AT+CPIN?", wat_response_cpin, NULL, span->config.timeout_command);
 
 	/* FIXME: Only pin 0000 (no pin) supported at this moment */
 	wat_cmd_enqueue(span, "AT+CPIN=\"0000\"", NULL, NULL, span->config.timeout_command);
@@ -53,6 +53,8 @@ WAT_RESPONSE_FUNC(wat_response_codecinfo);
 WAT_RESPONSE_FUNC(wat_response_set_codec);
 WAT_RESPONSE_FUNC(wat_response_qss);
 WAT_NOTIFY_FUNC(wat_notify_qss);
+WAT_RESPONSE_FUNC(wat_response_ecam);
+WAT_NOTIFY_FUNC(wat_notify_ecam);
 
 static wat_module_t telit_gc864_interface = {
 	.start = telit_start,
@@ -64,6 +66,7 @@ static wat_module_t telit_gc864_interface = {
 	.model = TELIT_GC864,
 	.name = "Telit GC864",
 	.flags = WAT_MODFLAG_NONE,
+	.min_cmd_interval = 10,
 };
 
 static wat_module_t telit_he910_interface = {
@@ -76,6 +79,7 @@ static wat_module_t telit_he910_interface = {
 	.model = TELIT_HE910,
 	.name = "Telit HE910",
 	.flags = WAT_MODFLAG_NONE,
+	.min_cmd_interval = 0,
 };
 
 static wat_module_t telit_cc864_interface = {
@@ -88,6 +92,7 @@ static wat_module_t telit_cc864_interface = {
 	.model = TELIT_CC864,
 	.name = "Telit CC864",
 	.flags = WAT_MODFLAG_NONE,
+	.min_cmd_interval = 10,
 };
 
 static wat_module_t telit_de910_interface = {
@@ -100,8 +105,33 @@ static wat_module_t telit_de910_interface = {
 	.model = TELIT_DE910,
 	.name = "Telit DE910",
 	.flags = WAT_MODFLAG_NONE,
+	.min_cmd_interval = 0,
 };
 
+static const wat_cmd_section_t telit_audio_batch[] = {
+	{ "#SHFEC=1", NULL, NULL, 0 },				/* Echo cancellation */
+	{ "#SHSEC=1", NULL, NULL, 0 },
+	{ "#SHSSD=0", wat_response_shssd, NULL, 0 },	/* Sidetone sounds like echo on calls with long delay (e.g SIP calls) */
+};
+
+typedef struct {
+	int mode;
+	int status;
+} qss_entry_t;
+
+/* Format: <mode>,<status> */
+static const wat_schema_field_t qss_fields[] = {
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, qss_entry_t, mode),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, qss_entry_t, status),
+};
+static const wat_schema_t qss_schema = WAT_SCHEMA("#QSS: ", qss_entry_t, 2, qss_fields);
+
+/* Unsolicited format: <status> */
+static const wat_schema_field_t qss_urc_fields[] = {
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, qss_entry_t, status),
+};
+static const wat_schema_t qss_urc_schema = WAT_SCHEMA("#QSS: ", qss_entry_t, 1, qss_urc_fields);
+
 wat_status_t telit_gc864_init(wat_span_t *span)
 {
 	return wat_module_register(span, &telit_gc864_interface);
@@ -128,17 +158,17 @@ wat_status_t telit_de910_init(wat_span_t *span)
 
 static WAT_NOTIFY_FUNC(wat_notify_dtmf_info)
 {
-	unsigned count;
-	char *cmdtokens[10];
+	int count;
+	wat_field_t fields[1];
 	int consumed_tokens = 0;
 
 	WAT_NOTIFY_FUNC_DBG_START
 
 	wat_match_prefix(tokens[0], "#DTMFEV: ");
 
-	count = wat_cmd_entry_tokenize(tokens[0], cmdtokens, wat_array_len(cmdtokens));
+	count = wat_cmd_entry_fields(tokens[0], fields, wat_array_len(fields));
 
-	if (count < 0) {
+	if (count < 1) {
 		wat_log_span(span, WAT_LOG_ERROR, "Failed to parse #DTMFEV event '%s'\n", tokens[0]);
 		consumed_tokens = 1;
 	} else {
@@ -149,23 +179,22 @@ static WAT_NOTIFY_FUNC(wat_notify_dtmf_info)
 		g_interface.wat_dtmf_ind(span->id, tokens[0]);
 	}
 
-	wat_free_tokens(cmdtokens);
 	return consumed_tokens;
 }
 
 WAT_NOTIFY_FUNC(wat_notify_codec_info)
 {
-	unsigned count;
-	char *cmdtokens[10];
+	int count;
+	wat_field_t fields[1];
 	int consumed_tokens = 0;
 	
 	WAT_NOTIFY_FUNC_DBG_START
 
 	wat_match_prefix(tokens[0], "#CODECINFO: ");
 
-	count = wat_cmd_entry_tokenize(tokens[0], cmdtokens, wat_array_len(cmdtokens));
+	count = wat_cmd_entry_fields(tokens[0], fields, wat_array_len(fields));
 
-	if (count < 0) {
+	if (count < 1) {
 		wat_log_span(span, WAT_LOG_ERROR, "Failed to parse #CODECINFO event '%s'\n", tokens[0]);
 		consumed_tokens = 1;
 	} else {
@@ -173,7 +202,6 @@ WAT_NOTIFY_FUNC(wat_notify_codec_info)
 		consumed_tokens = 1;
 	}
 
-	wat_free_tokens(cmdtokens);
 	return consumed_tokens;
 }
 
@@ -231,12 +259,8 @@ wat_status_t telit_start(wat_span_t *span)
 		}
 	}
 
-	/* Enable Echo cancellation */
-	wat_cmd_enqueue(span, "AT#SHFEC=1", NULL, NULL, span->config.timeout_command);
-	wat_cmd_enqueue(span, "AT#SHSEC=1", NULL, NULL, span->config.timeout_command);
-
-	/* Disable Sidetone as it sounds like echo on calls with long delay (e.g SIP calls) */
-	wat_cmd_enqueue(span, "AT#SHSSD=0", wat_response_shssd, NULL, span->config.timeout_command);
+	/* Enable Echo cancellation and disable Sidetone */
+	wat_cmd_enqueue_batch(span, telit_audio_batch, wat_array_len(telit_audio_batch), span->config.timeout_command);
 
 	if (span->module.model != TELIT_CC864 && span->module.model != TELIT_DE910) {
 		/* Enable codec notifications 
@@ -245,6 +269,12 @@ wat_status_t telit_start(wat_span_t *span)
 		wat_cmd_register(span, "#CODECINFO", wat_notify_codec_info);
 	}
 	
+	if (span->module.model == TELIT_GC864 || span->module.model == TELIT_HE910) {
+		/* Get outbound call progress from #ECAM notifications instead of polling with CLCC */
+		wat_cmd_register(span, "#ECAM", wat_notify_ecam);
+		wat_cmd_enqueue(span, "AT#ECAM=1", wat_response_ecam, NULL, span->config.timeout_command);
+	}
+
 	/* Make sure the DIALMODE is set to 0 to receive an OK code as soon as possible
 	 * the option of using DIALMODE=2 is tempting as provides progress status 
 	 * notifications (DIALING, RINGING, CONNECTED, RELEASED, DISCONNECTED), but the modem
@@ -255,7 +285,7 @@ wat_status_t telit_start(wat_span_t *span)
 		wat_cmd_enqueue(span, "AT+COPS=0", NULL, NULL, span->config.timeout_command);
 
 		/* Check the PIN status, this will also report if there is no SIM inserted */
-		wat_cmd_enqueue(span, "AT+CPIN?", wat_response_cpin, NULL, 15000);
+		wat_cmd_enqueue_query(span, WAT_CMD_PRIO_NORMAL, "AT+CPIN?", wat_response_cpin, NULL, 15000);
 
 		switch (span->config.band) {
 			case WAT_BAND_900_1800:
@@ -317,21 +347,21 @@ wat_status_t telit_wait_sim(wat_span_t *span)
 	wat_log_span(span, WAT_LOG_INFO, "Waiting for SIM acccess...\n");
 	wat_cmd_register(span, "#QSS", wat_notify_qss);
 	wat_cmd_enqueue(span, "AT#QSS=2", wat_response_qss, NULL, span->config.timeout_command);
-	wat_cmd_enqueue(span, "AT#QSS?", wat_response_qss, NULL, span->config.timeout_command);
+	wat_cmd_enqueue_query(span, WAT_CMD_PRIO_NORMAL, "AT#QSS?", wat_response_qss, NULL, span->config.timeout_command);
 	return WAT_SUCCESS;
 }
 
 wat_status_t telit_handle_sig_status(wat_span_t *span, wat_bool_t up)
 {
 	/* Own Number */
-	wat_cmd_enqueue(span, "AT+CNUM", wat_response_cnum, NULL, 5000); /* Could not find timeout value for CNUM */
+	wat_cmd_enqueue_query(span, WAT_CMD_PRIO_NORMAL, "AT+CNUM", wat_response_cnum, NULL, 5000); /* Could not find timeout value for CNUM */
 
 	if (span->module.model != TELIT_CC864 && span->module.model != TELIT_DE910) {
 		/* Get the Operator Name */
-		wat_cmd_enqueue(span, "AT+COPS?", wat_response_cops, NULL, 30000);
+		wat_cmd_enqueue_query(span, WAT_CMD_PRIO_NORMAL, "AT+COPS?", wat_response_cops, NULL, 30000);
 
 		/* SMSC information */
-		wat_cmd_enqueue(span, "AT+CSCA?", wat_response_csca, NULL, 5000);
+		wat_cmd_enqueue_query(span, WAT_CMD_PRIO_NORMAL, "AT+CSCA?", wat_response_csca, NULL, 5000);
 	}
 	return WAT_SUCCESS;
 }
@@ -342,19 +372,15 @@ WAT_STR2ENUM(wat_str2wat_telit_sim_status, wat_telit_sim_status2str, wat_telit_s
 WAT_NOTIFY_FUNC(wat_notify_qss)
 {
 	int rc = 1;
-	char *cmdtokens[4];
-	int sim_status = 0;
+	qss_entry_t qss;
 
 	WAT_NOTIFY_FUNC_DBG_START
 
 	/* Format #QSS: 3 */
-	wat_match_prefix(tokens[0], "#QSS: ");
-
-	switch (wat_cmd_entry_tokenize(tokens[0], cmdtokens, wat_array_len(cmdtokens))) {
+	switch (wat_schema_parse(&qss_urc_schema, tokens[0], &qss)) {
 		case 1:
-			sim_status = atoi(cmdtokens[0]);
-			wat_log_span(span, WAT_LOG_INFO, "SIM access status changed to '%s' (%d)\n", wat_telit_sim_status2str(sim_status), sim_status);
-			if (WAT_TELIT_SIM_IS_READY(sim_status)) {
+			wat_log_span(span, WAT_LOG_INFO, "SIM access status changed to '%s' (%d)\n", wat_telit_sim_status2str(qss.status), qss.status);
+			if (WAT_TELIT_SIM_IS_READY(qss.status)) {
 				if (span->state < WAT_SPAN_STATE_POST_START) {
 					wat_span_set_state(span, WAT_SPAN_STATE_POST_START);
 				}
@@ -369,16 +395,13 @@ WAT_NOTIFY_FUNC(wat_notify_qss)
 			break;
 	}
 
-	wat_free_tokens(cmdtokens);
-
 	WAT_FUNC_DBG_END
 	return rc;
 }
 
 WAT_RESPONSE_FUNC(wat_response_qss)
 {
-	char *cmdtokens[4];
-	int sim_status = 0;
+	qss_entry_t qss;
 	int parameters = 0;
 	WAT_RESPONSE_FUNC_DBG_START
 	if (success != WAT_TRUE) {
@@ -388,19 +411,17 @@ WAT_RESPONSE_FUNC(wat_response_qss)
 	}
 
 	/* Format #QSS: 2,3 */
-	wat_match_prefix(tokens[0], "#QSS: ");
 	if (!tokens[1]) {
 		/* This is a response to AT#QSS = 2 (enabling Unsollicited QSS events)*/
 		WAT_FUNC_DBG_END
 		return 1;
 	}
 
-	parameters = wat_cmd_entry_tokenize(tokens[0], cmdtokens, wat_array_len(cmdtokens));
+	parameters = wat_schema_parse(&qss_schema, tokens[0], &qss);
 	switch (parameters) {
 		case 2:
-			sim_status = atoi(cmdtokens[1]);
-			wat_log_span(span, WAT_LOG_INFO, "SIM status is '%s' (%d)\n", wat_telit_sim_status2str(sim_status), sim_status);
-			if (WAT_TELIT_SIM_IS_READY(sim_status)) {
+			wat_log_span(span, WAT_LOG_INFO, "SIM status is '%s' (%d)\n", wat_telit_sim_status2str(qss.status), qss.status);
+			if (WAT_TELIT_SIM_IS_READY(qss.status)) {
 				if (span->state < WAT_SPAN_STATE_POST_START) {
 					wat_span_set_state(span, WAT_SPAN_STATE_POST_START);
 				}
@@ -411,8 +432,6 @@ WAT_RESPONSE_FUNC(wat_response_qss)
 					tokens[0], parameters);
 			break;
 	}
-	
-	wat_free_tokens(cmdtokens);
 
 	WAT_FUNC_DBG_END
 	return 2;
@@ -481,6 +500,91 @@ WAT_RESPONSE_FUNC(wat_response_codecinfo)
 	return 1;
 }
 
+WAT_RESPONSE_FUNC(wat_response_ecam)
+{
+	WAT_RESPONSE_FUNC_DBG_START
+	if (success != WAT_TRUE) {
+		wat_log_span(span, WAT_LOG_ERROR, "Failed to enable call progress notifications, polling call status instead\n");
+	} else {
+		wat_set_flag(&span->module, WAT_MODFLAG_CALL_PROGRESS_URC);
+	}
+	WAT_FUNC_DBG_END
+	return 1;
+}
+
+static wat_call_t *telit_find_outbound_call(wat_span_t *span, unsigned ccid)
+{
+	int i;
+
+	for (i = 0; i < wat_array_len(span->calls); i++) {
+		wat_call_t *call = span->calls[i];
+		if (!call || call->dir != WAT_DIRECTION_OUTGOING) {
+			continue;
+		}
+		if (call->modid == ccid || (!call->modid && call->state == WAT_CALL_STATE_DIALING)) {
+			return call;
+		}
+	}
+	return NULL;
+}
+
+WAT_NOTIFY_FUNC(wat_notify_ecam)
+{
+	unsigned ccid = 0;
+	unsigned ccstatus = 0;
+	wat_call_t *call = NULL;
+
+	WAT_NOTIFY_FUNC_DBG_START
+
+	/* Format #ECAM: <ccid>,<ccstatus>,<calltype>,,,[<number>,<type>] */
+	if (sscanf(tokens[0], "#ECAM: %u,%u", &ccid, &ccstatus) != 2) {
+		wat_log_span(span, WAT_LOG_ERROR, "Failed to parse #ECAM %s\n", tokens[0]);
+		WAT_FUNC_DBG_END
+		return 1;
+	}
+
+	/* Inbound calls are still handled with RING/CLIP */
+	call = telit_find_outbound_call(span, ccid);
+	if (!call) {
+		WAT_FUNC_DBG_END
+		return 1;
+	}
+
+	if (!call->modid) {
+		call->modid = ccid;
+		wat_log_span(span, WAT_LOG_DEBUG, "[id:%d] module call (modid:%d)\n", call->id, call->modid);
+	}
+
+	switch (ccstatus) {
+		case 1: /* Calling */
+			if (call->state == WAT_CALL_STATE_DIALING) {
+				wat_call_set_state(call, WAT_CALL_STATE_DIALED);
+			}
+			break;
+		case 2: /* Connecting, the remote end is alerted */
+			if (call->state == WAT_CALL_STATE_DIALING || call->state == WAT_CALL_STATE_DIALED) {
+				wat_call_set_state(call, WAT_CALL_STATE_RINGING);
+			}
+			break;
+		case 3: /* Active */
+			if (call->state >= WAT_CALL_STATE_DIALING && call->state <= WAT_CALL_STATE_RINGING) {
+				wat_call_set_state(call, WAT_CALL_STATE_ANSWERED);
+			}
+			break;
+		case 0: /* Idle */
+		case 7: /* Busy */
+			if (call->state >= WAT_CALL_STATE_DIALING && call->state <= WAT_CALL_STATE_UP) {
+				wat_call_set_state(call, WAT_CALL_STATE_TERMINATING);
+			}
+			break;
+		default:
+			break;
+	}
+
+	WAT_FUNC_DBG_END
+	return 1;
+}
+
 WAT_RESPONSE_FUNC(wat_response_set_codec)
 {
 	WAT_RESPONSE_FUNC_DBG_START
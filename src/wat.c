@@ -22,6 +22,7 @@
  */
 
 #include <stdarg.h>
+#include <errno.h>
 
 #include "libwat.h"
 #include "wat_internal.h"
@@ -148,8 +149,10 @@ WAT_STR2ENUM(wat_str2wat_alarm, wat_alarm2str, wat_alarm_t, WAT_ALARM_NAMES, WAT
 WAT_ENUM_NAMES(WAT_BAND_NAMES, WAT_BAND_STRINGS)
 WAT_STR2ENUM(wat_str2wat_band, wat_band2str, wat_band_t, WAT_BAND_NAMES, WAT_BAND_INVALID)
 
+WAT_ENUM_NAMES(WAT_BUFFER_POLICY_NAMES, WAT_BUFFER_POLICY_STRINGS)
+WAT_STR2ENUM(wat_str2wat_buffer_policy, wat_buffer_policy2str, wat_buffer_policy_t, WAT_BUFFER_POLICY_NAMES, WAT_BUFFER_POLICY_INVALID)
+
 WAT_RESPONSE_FUNC(wat_user_cmd_response);
-static wat_span_t *wat_get_span(uint8_t span_id);
 
 WAT_DECLARE(void) wat_version(uint8_t *current, uint8_t *revision, uint8_t *age)
 {
@@ -219,6 +222,11 @@ WAT_DECLARE(wat_status_t) wat_register(wat_interface_t *interface)
 
 	memcpy(&g_interface, interface, sizeof(*interface));
 
+	if (wat_span_global_init() != WAT_SUCCESS) {
+		return WAT_FAIL;
+	}
+	wat_cmd_init();
+
 	wat_log(WAT_LOG_DEBUG, "General interface registered\n");
 	return WAT_SUCCESS;
 }
@@ -305,6 +313,20 @@ WAT_DECLARE(wat_status_t) wat_span_config(uint8_t span_id, wat_span_config_t *sp
 		span->config.call_release_delay = WAT_DEFAULT_CALL_RELEASE_DELAY;
 	}
 
+	if (span->config.rx_buffer_policy >= WAT_BUFFER_POLICY_INVALID) {
+		wat_log_span(span, WAT_LOG_WARNING, "Invalid read buffer policy, dropping data when the buffer is full\n");
+		span->config.rx_buffer_policy = WAT_BUFFER_POLICY_DROP;
+	}
+	if (span->config.rx_buffer_policy == WAT_BUFFER_POLICY_GROW && span->config.lockfree_rx == WAT_TRUE) {
+		wat_log_span(span, WAT_LOG_WARNING, "Lock-free read buffer cannot grow, using back-pressure instead\n");
+		span->config.rx_buffer_policy = WAT_BUFFER_POLICY_BACKPRESSURE;
+	}
+	if (span->config.rx_buffer_policy != WAT_BUFFER_POLICY_GROW) {
+		span->config.rx_buffer_max_size = WAT_BUFFER_SZ;
+	} else if (span->config.rx_buffer_max_size < WAT_BUFFER_SZ) {
+		span->config.rx_buffer_max_size = WAT_DEFAULT_RX_BUFFER_MAX_SIZE;
+	}
+
 	wat_log_span(span, WAT_LOG_DEBUG, "Configured span for %s module\n", wat_moduletype2str(span_config->moduletype));
 	return WAT_SUCCESS;
 
@@ -358,6 +380,23 @@ WAT_DECLARE(wat_status_t) wat_span_stop(uint8_t span_id)
 	return wat_span_set_state(span, WAT_SPAN_STATE_STOP);
 }
 
+/* Work that wat_span_run can do right away, besides expired timers */
+static wat_bool_t wat_span_has_work(wat_span_t *span)
+{
+	if (!span->cmd_busy && wat_cmd_pending(span) == WAT_TRUE) {
+		return WAT_TRUE;
+	}
+
+	if (wat_queue_empty(span->event_queue) == WAT_FALSE) {
+		return WAT_TRUE;
+	}
+
+	if (wat_queue_empty(span->sms_queue) == WAT_FALSE) {
+		return WAT_TRUE;
+	}
+	return WAT_FALSE;
+}
+
 WAT_DECLARE(uint32_t) wat_span_schedule_next(uint8_t span_id)
 {
 	wat_span_t *span;
@@ -370,15 +409,7 @@ WAT_DECLARE(uint32_t) wat_span_schedule_next(uint8_t span_id)
 		return -1;
 	}
 
-	if (!span->cmd_busy && wat_queue_empty(span->cmd_queue) == WAT_FALSE) {
-		return 0;
-	}
-
-	if (wat_queue_empty(span->event_queue) == WAT_FALSE) {
-		return 0;
-	}
-
-	if (wat_queue_empty(span->sms_queue) == WAT_FALSE) {
+	if (wat_span_has_work(span) == WAT_TRUE) {
 		return 0;
 	}
 
@@ -401,6 +432,14 @@ WAT_DECLARE(void) wat_span_run(uint8_t span_id)
 		return;
 	}
 
+	/* Consume the wakeup before looking for work, so requests arriving meanwhile wake us up again */
+	wat_sched_clear_fd(span->sched);
+
+	/* Check if there is data the device did not accept yet */
+	if (span->want_write) {
+		wat_span_flush_tx(span);
+	}
+
 	/* Check if there are pending events requested by the user */
 	wat_span_run_events(span);
 
@@ -412,25 +451,122 @@ WAT_DECLARE(void) wat_span_run(uint8_t span_id)
 
 	/* Check if there are pending sms's requested by the user */
 	wat_span_run_smss(span);
+
+	if (wat_span_has_work(span) == WAT_TRUE) {
+		wat_sched_wakeup(span->sched);
+	}
 	return;
 }
 
-WAT_DECLARE(void) wat_span_process_read(uint8_t span_id, void *data, uint32_t len)
+WAT_DECLARE(int) wat_span_get_wakeup_fd(uint8_t span_id)
 {
 	wat_span_t *span;
+	int fd;
 
 	span = wat_get_span(span_id);
-	wat_assert_return_void(span, "Invalid span");
+	wat_assert_return(span, -1, "Invalid span");
+
+	if (span->state < WAT_SPAN_STATE_START) {
+		wat_log_span(span, WAT_LOG_ERROR, "Span was not started\n");
+		return -1;
+	}
+
+	if (span->config.shared_scheduler == WAT_TRUE) {
+		/* The shared schedule cannot tell which span has work */
+		return -1;
+	}
+
+	fd = wat_sched_get_fd(span->sched);
+	if (fd >= 0 && wat_span_has_work(span) == WAT_TRUE) {
+		/* Work queued before the fd existed, e.g the start up commands */
+		wat_sched_wakeup(span->sched);
+	}
+	return fd;
+}
+
+/* Applies the span buffer policy to the result of enqueueing received data */
+static wat_status_t wat_span_enqueue_read(wat_span_t *span, wat_status_t status, uint32_t len)
+{
+	if (status == WAT_SUCCESS) {
+		return WAT_SUCCESS;
+	}
+
+	span->rx_refused_count++;
+	if (span->config.rx_buffer_policy == WAT_BUFFER_POLICY_BACKPRESSURE) {
+		return WAT_EBUSY;
+	}
+
+	wat_log_span(span, WAT_LOG_ERROR, "Failed to enqueue, read buffer is full (dropped:%d)\n", len);
+	return WAT_FAIL;
+}
+
+/* Returns WAT_EBUSY if the read buffer is full and the span uses back-pressure, the
+   data should then be given again after wat_span_run is called */
+WAT_DECLARE(wat_status_t) wat_span_process_read(uint8_t span_id, void *data, uint32_t len)
+{
+	wat_span_t *span;
+
+	span = wat_get_span(span_id);
+	wat_assert_return(span, WAT_FAIL, "Invalid span");
 
 	if (span->config.debug_mask & WAT_DEBUG_UART_RAW) {
 		char mydata[WAT_MAX_CMD_SZ];
 		wat_log_span(span, WAT_LOG_DEBUG, "[RX RAW] %s (len:%d)\n", format_at_data(mydata, data, len), len);
 	}
 
-	if (wat_buffer_enqueue(span->buffer, data, len) != WAT_SUCCESS) {
-		wat_log_span(span, WAT_LOG_ERROR, "Failed to enqueue\n");
+	return wat_span_enqueue_read(span, wat_buffer_enqueue(span->buffer, data, len), len);
+}
+
+/* Returns true if some data could not be written to the device yet. The application
+   should then call wat_span_process_write once the device becomes writable */
+WAT_DECLARE(wat_bool_t) wat_span_want_write(uint8_t span_id)
+{
+	wat_span_t *span;
+
+	span = wat_get_span(span_id);
+	wat_assert_return(span, WAT_FALSE, "Invalid span");
+
+	if (span->state < WAT_SPAN_STATE_START) {
+		return WAT_FALSE;
+	}
+	return span->want_write ? WAT_TRUE : WAT_FALSE;
+}
+
+/* Must be called from the thread that runs the span */
+WAT_DECLARE(void) wat_span_process_write(uint8_t span_id)
+{
+	wat_span_t *span;
+
+	span = wat_get_span(span_id);
+	wat_assert_return_void(span, "Invalid span");
+
+	if (span->state < WAT_SPAN_STATE_START) {
+		return;
 	}
-	return;
+	wat_span_flush_tx(span);
+}
+
+/* Same as wat_span_process_read, but for several fragments received at once. The
+   fragments are appended to the read buffer in a single operation */
+WAT_DECLARE(wat_status_t) wat_span_process_readv(uint8_t span_id, const struct iovec *iov, int iovcnt)
+{
+	int i;
+	uint32_t len = 0;
+	wat_span_t *span;
+
+	span = wat_get_span(span_id);
+	wat_assert_return(span, WAT_FAIL, "Invalid span");
+	wat_assert_return(iovcnt > 0, WAT_FAIL, "No fragments");
+
+	for (i = 0; i < iovcnt; i++) {
+		if (span->config.debug_mask & WAT_DEBUG_UART_RAW) {
+			char mydata[WAT_MAX_CMD_SZ];
+			wat_log_span(span, WAT_LOG_DEBUG, "[RX RAW] %s (len:%d)\n", format_at_data(mydata, iov[i].iov_base, iov[i].iov_len), iov[i].iov_len);
+		}
+		len += iov[i].iov_len;
+	}
+
+	return wat_span_enqueue_read(span, wat_buffer_enqueuev(span->buffer, iov, iovcnt), len);
 }
 
 WAT_DECLARE(const wat_chip_info_t*) wat_span_get_chip_info(uint8_t span_id)
@@ -505,6 +641,45 @@ WAT_DECLARE(wat_alarm_t) wat_span_get_alarms(uint8_t span_id)
 	return span->alarm;
 }
 
+WAT_DECLARE(wat_status_t) wat_span_get_rx_stats(uint8_t span_id, wat_rx_stats_t *stats)
+{
+	wat_span_t *span;
+
+	span = wat_get_span(span_id);
+	wat_assert_return(span, WAT_FAIL, "Invalid span");
+	wat_assert_return(stats, WAT_FAIL, "No stats");
+
+	if (span->state < WAT_SPAN_STATE_START) {
+		return WAT_FAIL;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	stats->size = span->buffer->capacity;
+	stats->high_watermark = span->buffer->high_watermark;
+	stats->grow_count = span->buffer->grow_count;
+	stats->refused_count = span->rx_refused_count;
+	return WAT_SUCCESS;
+}
+
+WAT_DECLARE(wat_status_t) wat_span_get_cmd_stats(uint8_t span_id, wat_cmd_stats_t *stats)
+{
+	wat_span_t *span;
+
+	span = wat_get_span(span_id);
+	wat_assert_return(span, WAT_FAIL, "Invalid span");
+	wat_assert_return(stats, WAT_FAIL, "No stats");
+
+	if (span->state < WAT_SPAN_STATE_START) {
+		return WAT_FAIL;
+	}
+
+	wat_mutex_lock(span->cmd_mutex);
+	memcpy(stats, &span->cmd_stats, sizeof(*stats));
+	wat_mutex_unlock(span->cmd_mutex);
+	stats->interval = span->cmd_interval;
+	return WAT_SUCCESS;
+}
+
 WAT_DECLARE(const char *) wat_span_get_last_error(uint8_t span_id)
 {
 	wat_span_t *span;
@@ -783,6 +958,12 @@ WAT_RESPONSE_FUNC(wat_user_cmd_response)
 
 WAT_DECLARE(wat_status_t) wat_cmd_req(uint8_t span_id, const char *at_cmd, wat_at_cmd_response_func cb, void *obj)
 {
+	return wat_cmd_req_deadline(span_id, at_cmd, cb, obj, 0, NULL);
+}
+
+WAT_DECLARE(wat_status_t) wat_cmd_req_deadline(uint8_t span_id, const char *at_cmd, wat_at_cmd_response_func cb, void *obj, uint32_t deadline_ms, wat_cmd_handle_t *handle)
+{
+	wat_status_t status;
 	wat_user_cmd_t *user_cmd = NULL;
 	wat_span_t *span = NULL;
 
@@ -796,7 +977,21 @@ WAT_DECLARE(wat_status_t) wat_cmd_req(uint8_t span_id, const char *at_cmd, wat_a
 	}
 	user_cmd->cb = cb;
 	user_cmd->obj = obj;
-	return wat_cmd_enqueue(span, at_cmd, wat_user_cmd_response, user_cmd, span->config.timeout_command);
+	status = wat_cmd_enqueue_deadline(span, at_cmd, wat_user_cmd_response, user_cmd, span->config.timeout_command, deadline_ms, handle);
+	if (status != WAT_SUCCESS) {
+		wat_safe_free(user_cmd);
+	}
+	return status;
+}
+
+WAT_DECLARE(wat_status_t) wat_cmd_cancel(uint8_t span_id, wat_cmd_handle_t handle)
+{
+	wat_span_t *span = NULL;
+
+	span = wat_get_span(span_id);
+	wat_assert_return(span, WAT_FAIL, "Invalid span");
+
+	return wat_cmd_cancel_handle(span, handle);
 }
 
 wat_span_t *wat_get_span(uint8_t span_id)
@@ -812,22 +1007,69 @@ wat_span_t *wat_get_span(uint8_t span_id)
 	return span;
 }
 
+/* Data is queued and written to the device as soon as it accepts it. Returns len
+   if the data was queued, or WAT_FAIL if there is no more space in the queue */
 int wat_span_write(wat_span_t *span, void *data, uint32_t len)
 {
-	int res;
-	
 	if (span->config.debug_mask & WAT_DEBUG_UART_RAW) {
 		char mydata[WAT_MAX_CMD_SZ];
 		char *cmd = (char *)data;
 		wat_log_span(span, WAT_LOG_DEBUG, "[TX RAW] %s (len:%d)\n", format_at_data(mydata, cmd, len), len);
 	}
 
-	res = g_interface.wat_span_write(span->id, data, len);
-	if (res < len) {
-		wat_log_span(span, WAT_LOG_CRIT, "Failed to write to span (wrote:%d len:%d)\n", res, len);
+	if (wat_buffer_enqueue(span->tx_buffer, data, len) != WAT_SUCCESS) {
+		wat_log_span(span, WAT_LOG_CRIT, "Failed to write to span, transmit queue is full (len:%d)\n", len);
 		return WAT_FAIL;
 	}
-	return res;
+
+	wat_span_flush_tx(span);
+	return len;
+}
+
+/* Writes as much of the transmit queue as the device accepts. Everything
+   that was queued is handed to the device in a single write */
+wat_status_t wat_span_flush_tx(wat_span_t *span)
+{
+	const uint8_t *data = NULL;
+	wat_size_t len = 0;
+	int res;
+
+	if (wat_buffer_view(span->tx_buffer, &data, &len) != WAT_SUCCESS) {
+		/* Nothing to write */
+		return WAT_SUCCESS;
+	}
+
+	/* The write callback does not modify the data, it just does not take a const pointer */
+	errno = 0;
+	res = g_interface.wat_span_write(span->id, (void *)(uintptr_t)data, len);
+	if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		/* Device is not ready, try again when it is writable */
+		span->want_write = 1;
+		return WAT_SUCCESS;
+	}
+
+	if (res <= 0) {
+		/* Writing it again would most likely fail the same way, and nothing written without
+		   an error (e.g a closed device) would never become writable again */
+		wat_log_span(span, WAT_LOG_ERROR, "Failed to write to device (%s), dropping %d bytes\n",
+					 errno ? strerror(errno) : "nothing written", len);
+		wat_buffer_flush(span->tx_buffer, len);
+		span->want_write = 0;
+		wat_cmd_write_failed(span);
+		return WAT_FAIL;
+	}
+
+	wat_buffer_flush(span->tx_buffer, res);
+	if (res < len) {
+		if (span->config.debug_mask & WAT_DEBUG_UART_RAW) {
+			wat_log_span(span, WAT_LOG_DEBUG, "Partial write (wrote:%d len:%d)\n", res, len);
+		}
+		span->want_write = 1;
+		return WAT_SUCCESS;
+	}
+
+	span->want_write = 0;
+	return WAT_SUCCESS;
 }
 
 wat_status_t wat_module_register(wat_span_t *span, wat_module_t *module)
@@ -836,24 +1078,38 @@ wat_status_t wat_module_register(wat_span_t *span, wat_module_t *module)
 	return WAT_SUCCESS;
 }
 
+/* Number of calls to the user memory callbacks, for debugging purposes only. Spans may
+   allocate from several threads, so they are updated atomically */
+static uint64_t g_mem_allocs;
+static uint64_t g_mem_frees;
+
 void *wat_malloc(wat_size_t size)
 {
 	wat_assert_return(g_interface.wat_malloc, NULL, "No callback for malloc specified\n");
+	__atomic_fetch_add(&g_mem_allocs, 1, __ATOMIC_RELAXED);
 	return g_interface.wat_malloc(size);
 }
 
 void *wat_calloc(wat_size_t nmemb, wat_size_t size)
 {
 	wat_assert_return(g_interface.wat_calloc, NULL, "No callback for calloc specified\n");
+	__atomic_fetch_add(&g_mem_allocs, 1, __ATOMIC_RELAXED);
 	return g_interface.wat_calloc(nmemb, size);
 }
 
 void wat_free(void *ptr)
 {
 	wat_assert_return(g_interface.wat_free, , "No callback for free specified\n");
+	__atomic_fetch_add(&g_mem_frees, 1, __ATOMIC_RELAXED);
 	g_interface.wat_free(ptr);
 }
 
+void wat_mem_get_counters(uint64_t *allocs, uint64_t *frees)
+{
+	*allocs = __atomic_load_n(&g_mem_allocs, __ATOMIC_RELAXED);
+	*frees = __atomic_load_n(&g_mem_frees, __ATOMIC_RELAXED);
+}
+
 char *wat_strdup(const char *str)
 {
 	wat_size_t len = strlen(str) + 1;
@@ -26,8 +26,31 @@
 #include "libwat.h"
 #include "wat_internal.h"
 
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#define WAT_HAVE_ATOMICS 1
+#define wat_atomic_load(ptr)			__atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define wat_atomic_store(ptr, val)		__atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define wat_atomic_exchange(ptr, val)	__atomic_exchange_n(ptr, val, __ATOMIC_ACQ_REL)
+
+/* Offset in the ring of a free running counter, lock-free buffers have a power of two capacity */
+#define wat_buffer_ring_index(buffer, counter) ((counter) & ((buffer)->capacity - 1))
+#endif
+
+typedef enum {
+	WAT_BUFFER_FLAG_MIRRORED = (1 << 0),
+	WAT_BUFFER_FLAG_LOCKFREE = (1 << 1),
+} wat_buffer_flag_t;
+
+static void **wat_buffer_alloc_data(wat_size_t capacity, uint8_t mirrored)
+{
+	if (mirrored) {
+		/* Second half is a copy of the first half */
+		return wat_calloc(1, 2 * capacity);
+	}
+	return wat_calloc(1, (sizeof(void*)*capacity));
+}
 
-wat_status_t wat_buffer_create(wat_buffer_t **outbuffer, wat_size_t capacity)
+static wat_status_t _wat_buffer_create(wat_buffer_t **outbuffer, wat_size_t capacity, uint32_t flags)
 {
 	wat_buffer_t *buffer = NULL;
 
@@ -35,13 +58,24 @@ wat_status_t wat_buffer_create(wat_buffer_t **outbuffer, wat_size_t capacity)
 	wat_assert_return (capacity > 0, WAT_FAIL, "Buffer capacity is not bigger than 0\n");
 
 	*outbuffer = NULL;
+
+	if (flags & WAT_BUFFER_FLAG_LOCKFREE) {
+		/* head and tail only keep mapping to the same ring offset when they
+		   wrap around if the capacity divides their range */
+		wat_size_t ring_capacity = 1;
+
+		while (ring_capacity < capacity) {
+			ring_capacity <<= 1;
+		}
+		capacity = ring_capacity;
+	}
 	
 	buffer = wat_calloc(1, sizeof(*buffer));
 	if (!buffer) {
 		return WAT_FAIL;
 	}
 
-	buffer->data = wat_calloc(1, (sizeof(void*)*capacity));
+	buffer->data = wat_buffer_alloc_data(capacity, (flags & WAT_BUFFER_FLAG_MIRRORED) ? 1 : 0);
 	if (!buffer->data) {
 		goto failed;
 	}
@@ -51,9 +85,14 @@ wat_status_t wat_buffer_create(wat_buffer_t **outbuffer, wat_size_t capacity)
 	}
 	
 	buffer->capacity = capacity;
+	buffer->max_capacity = capacity;
 	buffer->windex = 0;
 	buffer->rindex = 0;
 	buffer->size = 0;
+	buffer->head = 0;
+	buffer->tail = 0;
+	buffer->mirrored = (flags & WAT_BUFFER_FLAG_MIRRORED) ? 1 : 0;
+	buffer->lockfree = (flags & WAT_BUFFER_FLAG_LOCKFREE) ? 1 : 0;
 	*outbuffer = buffer;
 	return WAT_SUCCESS;
 	
@@ -68,6 +107,138 @@ failed:
 	return WAT_FAIL;
 }
 
+wat_status_t wat_buffer_create(wat_buffer_t **outbuffer, wat_size_t capacity)
+{
+	return _wat_buffer_create(outbuffer, capacity, 0);
+}
+
+/* A mirrored buffer keeps a second copy of the ring right after the first one,
+   so the data currently in the buffer can always be accessed with a single
+   pointer using wat_buffer_view, without copying it out */
+wat_status_t wat_buffer_create_mirrored(wat_buffer_t **outbuffer, wat_size_t capacity)
+{
+	return _wat_buffer_create(outbuffer, capacity, WAT_BUFFER_FLAG_MIRRORED);
+}
+
+/* A lock-free buffer is a mirrored buffer that does not use its mutex. It is only safe
+   when a single thread enqueues data and a single thread views/flushes it */
+wat_status_t wat_buffer_create_lockfree(wat_buffer_t **outbuffer, wat_size_t capacity)
+{
+#ifdef WAT_HAVE_ATOMICS
+	return _wat_buffer_create(outbuffer, capacity, WAT_BUFFER_FLAG_MIRRORED | WAT_BUFFER_FLAG_LOCKFREE);
+#else
+	wat_log(WAT_LOG_WARNING, "No atomic operations available, using a locked buffer\n");
+	return _wat_buffer_create(outbuffer, capacity, WAT_BUFFER_FLAG_MIRRORED);
+#endif
+}
+
+/* Copies data at windex, wrapping around if needed. Returns the index right after the data */
+static wat_size_t wat_buffer_write(wat_buffer_t *buffer, wat_size_t windex, const void *data, wat_size_t len)
+{
+	uint8_t *buffer_data = (uint8_t*)buffer->data;
+	const uint8_t *in_data = data;
+	wat_size_t write_before_wrap = 0;
+	wat_size_t write_after_wrap = 0;
+
+	/* Find out how many bytes we can write before wrap around */
+	write_before_wrap = buffer->capacity - windex;
+	if (write_before_wrap <= len) {
+		/* See if we need there is more data to write */
+		write_after_wrap = len - write_before_wrap;
+	} else {
+		/* There is no need to wrap around */
+		write_before_wrap = len;
+	}
+
+	/* Write what we can before wrap around */
+	memcpy(&buffer_data[windex], in_data, write_before_wrap);
+	if (buffer->mirrored) {
+		memcpy(&buffer_data[buffer->capacity + windex], in_data, write_before_wrap);
+	}
+	
+	windex += write_before_wrap;
+
+	if (windex == buffer->capacity) {
+		/* Wrap around */
+		windex = 0;
+	}
+
+	/* We still have more data to write */
+	if (write_after_wrap) {
+		memcpy(buffer_data, &in_data[write_before_wrap], write_after_wrap);
+		if (buffer->mirrored) {
+			memcpy(&buffer_data[buffer->capacity], &in_data[write_before_wrap], write_after_wrap);
+		}
+		windex = write_after_wrap;
+	}
+	return windex;
+}
+
+#ifdef WAT_HAVE_ATOMICS
+/* Producer side */
+static wat_status_t wat_buffer_lockfree_enqueuev(wat_buffer_t *buffer, const struct iovec *iov, int iovcnt, wat_size_t len)
+{
+	int i;
+	wat_size_t head = buffer->head;
+	wat_size_t tail = wat_atomic_load(&buffer->tail);
+	wat_size_t windex;
+
+	if ((head - tail + len) > buffer->capacity) {
+		return WAT_EBUSY;
+	}
+
+	if ((head - tail + len) > buffer->high_watermark) {
+		buffer->high_watermark = head - tail + len;
+	}
+
+	/* The bytes we are about to write are free in both halves of the mirror,
+	   so the consumer cannot be looking at them */
+	windex = wat_buffer_ring_index(buffer, head);
+	for (i = 0; i < iovcnt; i++) {
+		windex = wat_buffer_write(buffer, windex, iov[i].iov_base, iov[i].iov_len);
+	}
+
+	/* Publish the data before telling the consumer about it */
+	wat_atomic_store(&buffer->head, head + len);
+	wat_atomic_store(&buffer->new_data, 1);
+	return WAT_SUCCESS;
+}
+
+/* Consumer side */
+static wat_status_t wat_buffer_lockfree_view(wat_buffer_t *buffer, const uint8_t **data, wat_size_t *len)
+{
+	uint8_t *buffer_data = (uint8_t*)buffer->data;
+	wat_size_t head;
+
+	/* Clear the flag before looking at head, so we cannot miss data enqueued in between */
+	wat_atomic_exchange(&buffer->new_data, 0);
+
+	head = wat_atomic_load(&buffer->head);
+	if (head == buffer->tail) {
+		return WAT_FAIL;
+	}
+
+	*data = &buffer_data[wat_buffer_ring_index(buffer, buffer->tail)];
+	*len = head - buffer->tail;
+	return WAT_SUCCESS;
+}
+
+/* Consumer side */
+static wat_status_t wat_buffer_lockfree_flush(wat_buffer_t *buffer, wat_size_t len)
+{
+	wat_size_t head = wat_atomic_load(&buffer->head);
+
+	/* We cannot flush more that what we currently have */
+	if ((head - buffer->tail) < len) {
+		return WAT_FAIL;
+	}
+
+	/* Hand the space back to the producer */
+	wat_atomic_store(&buffer->tail, buffer->tail + len);
+	return WAT_SUCCESS;
+}
+#endif
+
 wat_status_t wat_buffer_destroy(wat_buffer_t **inbuffer)
 {
 	wat_buffer_t *buffer = NULL;
@@ -78,59 +249,214 @@ wat_status_t wat_buffer_destroy(wat_buffer_t **inbuffer)
 	buffer = *inbuffer;
 	wat_mutex_destroy(&buffer->mutex);
 	wat_safe_free(buffer->data);
+	wat_safe_free(buffer->retired_data);
 	wat_safe_free(buffer);
 	*inbuffer = NULL;
 	
 	return WAT_SUCCESS;
 }
 
+/* Allows the buffer to grow up to max_capacity bytes instead of refusing data when it is full */
+wat_status_t wat_buffer_set_max_capacity(wat_buffer_t *buffer, wat_size_t max_capacity)
+{
+	if (max_capacity > buffer->capacity && buffer->lockfree) {
+		wat_log(WAT_LOG_WARNING, "Lock-free buffers cannot grow\n");
+		return WAT_FAIL;
+	}
+
+	wat_mutex_lock(buffer->mutex);
+	buffer->max_capacity = (max_capacity > buffer->capacity) ? max_capacity : buffer->capacity;
+	wat_mutex_unlock(buffer->mutex);
+	return WAT_SUCCESS;
+}
+
+/* Must be called with the mutex locked. The data is moved to the start of the new area,
+   so offsets relative to the start of the data remain valid */
+static wat_status_t wat_buffer_grow(wat_buffer_t *buffer, wat_size_t needed)
+{
+	uint8_t *old_data = (uint8_t*)buffer->data;
+	uint8_t *new_data = NULL;
+	wat_size_t new_capacity = buffer->capacity;
+
+	if (needed > buffer->max_capacity) {
+		return WAT_FAIL;
+	}
+
+	while (new_capacity < needed) {
+		new_capacity *= 2;
+	}
+	if (new_capacity > buffer->max_capacity) {
+		new_capacity = buffer->max_capacity;
+	}
+
+	new_data = (uint8_t*)wat_buffer_alloc_data(new_capacity, buffer->mirrored);
+	if (!new_data) {
+		return WAT_FAIL;
+	}
+
+	if (buffer->mirrored) {
+		memcpy(new_data, &old_data[buffer->rindex], buffer->size);
+		memcpy(&new_data[new_capacity], new_data, buffer->size);
+
+		if (buffer->retired_data) {
+			/* Grew again before the next view, the consumer only knows about the retired area */
+			wat_free(buffer->data);
+		} else {
+			/* The consumer may still be parsing a view of the old area */
+			buffer->retired_data = buffer->data;
+		}
+	} else {
+		wat_size_t read_before_wrap = buffer->capacity - buffer->rindex;
+
+		if (read_before_wrap >= buffer->size) {
+			memcpy(new_data, &old_data[buffer->rindex], buffer->size);
+		} else {
+			memcpy(new_data, &old_data[buffer->rindex], read_before_wrap);
+			memcpy(&new_data[read_before_wrap], old_data, buffer->size - read_before_wrap);
+		}
+		wat_free(buffer->data);
+	}
+
+	buffer->data = (void **)new_data;
+	buffer->capacity = new_capacity;
+	buffer->rindex = 0;
+	buffer->windex = buffer->size;
+	buffer->grow_count++;
+	return WAT_SUCCESS;
+}
+
 
 wat_status_t wat_buffer_enqueue(wat_buffer_t *buffer, void *data, wat_size_t len)
 {
-	uint8_t *buffer_data = (uint8_t*)buffer->data;
-	uint8_t *in_data = data;
+	struct iovec iov;
 
-	wat_size_t write_before_wrap = 0;
-	wat_size_t write_after_wrap = 0;
+	iov.iov_base = data;
+	iov.iov_len = len;
+	return wat_buffer_enqueuev(buffer, &iov, 1);
+}
+
+/* Either all the fragments are enqueued, or none of them */
+wat_status_t wat_buffer_enqueuev(wat_buffer_t *buffer, const struct iovec *iov, int iovcnt)
+{
+	int i;
+	wat_size_t len = 0;
+
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+#ifdef WAT_HAVE_ATOMICS
+	if (buffer->lockfree) {
+		return wat_buffer_lockfree_enqueuev(buffer, iov, iovcnt, len);
+	}
+#endif
 	
 	wat_mutex_lock(buffer->mutex);
-	if ((buffer->size + len) > buffer->capacity) {
+	if ((buffer->size + len) > buffer->capacity &&
+		wat_buffer_grow(buffer, buffer->size + len) != WAT_SUCCESS) {
 		wat_mutex_unlock(buffer->mutex);
-		wat_log(WAT_LOG_ERROR, "buffer is full\n");
-		return WAT_FAIL;
+		return WAT_EBUSY;
 	}
 
-	/* Find out how many bytes we can write before wrap around */
-	write_before_wrap = buffer->capacity - buffer->windex;
-	if (write_before_wrap <= len) {
-		/* See if we need there is more data to write */
-		write_after_wrap = len - write_before_wrap;
-	} else {
-		/* There is no need to wrap around */
-		write_before_wrap = len;
+	for (i = 0; i < iovcnt; i++) {
+		buffer->windex = wat_buffer_write(buffer, buffer->windex, iov[i].iov_base, iov[i].iov_len);
 	}
-
-	/* Write what we can before wrap around */
-	memcpy(&buffer_data[buffer->windex], in_data, write_before_wrap);
 	
-	buffer->windex += write_before_wrap;
+	buffer->size += len;
+	if (buffer->size > buffer->high_watermark) {
+		buffer->high_watermark = buffer->size;
+	}
+
+	buffer->new_data = 1;
+	wat_mutex_unlock(buffer->mutex);
+
+	return WAT_SUCCESS;
+}
+
+/* Returns the free space right after the data currently in buffer, up to the end of the ring,
+   so that the producer can read straight into it instead of going through wat_buffer_enqueue.
+   wat_buffer_commit must then be called with the number of bytes actually written. Nothing else
+   may be enqueued in between */
+wat_status_t wat_buffer_reserve(wat_buffer_t *buffer, uint8_t **data, wat_size_t *len)
+{
+	uint8_t *buffer_data = (uint8_t*)buffer->data;
+	wat_size_t windex;
+	wat_size_t used;
+
+#ifdef WAT_HAVE_ATOMICS
+	if (buffer->lockfree) {
+		used = buffer->head - wat_atomic_load(&buffer->tail);
+		windex = wat_buffer_ring_index(buffer, buffer->head);
+	} else
+#endif
+	{
+		wat_mutex_lock(buffer->mutex);
+		if (buffer->size == buffer->capacity) {
+			wat_buffer_grow(buffer, buffer->capacity + 1);
+		}
+		buffer_data = (uint8_t*)buffer->data;
+		used = buffer->size;
+		windex = buffer->windex;
+		wat_mutex_unlock(buffer->mutex);
+	}
+
+	if (used == buffer->capacity) {
+		return WAT_EBUSY;
+	}
+
+	*data = &buffer_data[windex];
+	*len = buffer->capacity - used;
+	if (*len > (buffer->capacity - windex)) {
+		/* Do not go past the end of the ring */
+		*len = buffer->capacity - windex;
+	}
+	return WAT_SUCCESS;
+}
+
+wat_status_t wat_buffer_commit(wat_buffer_t *buffer, wat_size_t len)
+{
+	uint8_t *buffer_data = (uint8_t*)buffer->data;
+	wat_size_t windex;
+
+	if (!len) {
+		return WAT_SUCCESS;
+	}
+
+#ifdef WAT_HAVE_ATOMICS
+	if (buffer->lockfree) {
+		windex = wat_buffer_ring_index(buffer, buffer->head);
+		memcpy(&buffer_data[buffer->capacity + windex], &buffer_data[windex], len);
+
+		if ((buffer->head + len - wat_atomic_load(&buffer->tail)) > buffer->high_watermark) {
+			buffer->high_watermark = buffer->head + len - wat_atomic_load(&buffer->tail);
+		}
 
+		/* Publish the data before telling the consumer about it */
+		wat_atomic_store(&buffer->head, buffer->head + len);
+		wat_atomic_store(&buffer->new_data, 1);
+		return WAT_SUCCESS;
+	}
+#endif
+
+	wat_mutex_lock(buffer->mutex);
+	buffer_data = (uint8_t*)buffer->data;
+	windex = buffer->windex;
+	if (buffer->mirrored) {
+		memcpy(&buffer_data[buffer->capacity + windex], &buffer_data[windex], len);
+	}
+
+	buffer->windex += len;
 	if (buffer->windex == buffer->capacity) {
 		/* Wrap around */
 		buffer->windex = 0;
 	}
-
-	/* We still have more data to write */
-	if (write_after_wrap) {
-		memcpy(buffer_data, &in_data[write_before_wrap], write_after_wrap);
-		buffer->windex = write_after_wrap;
-	}
-	
 	buffer->size += len;
+	if (buffer->size > buffer->high_watermark) {
+		buffer->high_watermark = buffer->size;
+	}
 
 	buffer->new_data = 1;
 	wat_mutex_unlock(buffer->mutex);
-
 	return WAT_SUCCESS;
 }
 
@@ -143,6 +469,18 @@ wat_status_t wat_buffer_peep(wat_buffer_t *buffer, void *data, wat_size_t *len)
 	wat_size_t read_before_wrap = 0;
 	wat_size_t read_after_wrap = 0;
 
+#ifdef WAT_HAVE_ATOMICS
+	if (buffer->lockfree) {
+		const uint8_t *view_data = NULL;
+
+		if (wat_buffer_lockfree_view(buffer, &view_data, len) != WAT_SUCCESS) {
+			return WAT_FAIL;
+		}
+		memcpy(out_data, view_data, *len);
+		return WAT_SUCCESS;
+	}
+#endif
+
 	wat_mutex_lock(buffer->mutex);
 	buffer->new_data = 0;
 
@@ -151,6 +489,8 @@ wat_status_t wat_buffer_peep(wat_buffer_t *buffer, void *data, wat_size_t *len)
 		return WAT_FAIL;
 	}
 
+	/* The data area may have changed if the buffer grew */
+	buffer_data = (uint8_t*)buffer->data;
 	*len = buffer->size;
 	
 	if (buffer->rindex < buffer->windex) {
@@ -175,8 +515,50 @@ wat_status_t wat_buffer_peep(wat_buffer_t *buffer, void *data, wat_size_t *len)
 	return WAT_SUCCESS;
 }
 
+/* Returns a pointer to all the data currently in buffer, without copying or dequeueing it.
+   Only valid on mirrored buffers. The data pointed to remains valid until the buffer is
+   flushed, dequeued or reset */
+wat_status_t wat_buffer_view(wat_buffer_t *buffer, const uint8_t **data, wat_size_t *len)
+{
+	uint8_t *buffer_data = (uint8_t*)buffer->data;
+
+	wat_assert_return(buffer->mirrored, WAT_FAIL, "Buffer is not mirrored\n");
+
+#ifdef WAT_HAVE_ATOMICS
+	if (buffer->lockfree) {
+		return wat_buffer_lockfree_view(buffer, data, len);
+	}
+#endif
+
+	wat_mutex_lock(buffer->mutex);
+	buffer->new_data = 0;
+
+	/* The caller is done with the previous view */
+	wat_safe_free(buffer->retired_data);
+
+	if (!buffer->size) {
+		wat_mutex_unlock(buffer->mutex);
+		return WAT_FAIL;
+	}
+
+	/* The data area may have changed if the buffer grew */
+	buffer_data = (uint8_t*)buffer->data;
+
+	/* rindex + size never goes past the end of the mirror */
+	*data = &buffer_data[buffer->rindex];
+	*len = buffer->size;
+
+	wat_mutex_unlock(buffer->mutex);
+	return WAT_SUCCESS;
+}
+
 wat_bool_t wat_buffer_new_data(wat_buffer_t *buffer)
 {
+#ifdef WAT_HAVE_ATOMICS
+	if (buffer->lockfree) {
+		return wat_atomic_load(&buffer->new_data) ? WAT_TRUE : WAT_FALSE;
+	}
+#endif
 	if (buffer->new_data) {
 		return WAT_TRUE;
 	}
@@ -190,6 +572,19 @@ wat_status_t wat_buffer_dequeue(wat_buffer_t *buffer, void *data, wat_size_t len
 	wat_size_t read_before_wrap = 0;
 	wat_size_t read_after_wrap = 0;
 
+#ifdef WAT_HAVE_ATOMICS
+	if (buffer->lockfree) {
+		wat_size_t head = wat_atomic_load(&buffer->head);
+
+		/* We cannot dequeue more that what we currently have */
+		if ((head - buffer->tail) < len) {
+			return WAT_FAIL;
+		}
+		memcpy(out_data, &buffer_data[wat_buffer_ring_index(buffer, buffer->tail)], len);
+		return wat_buffer_lockfree_flush(buffer, len);
+	}
+#endif
+
 	wat_mutex_lock(buffer->mutex);
 	/* We cannot dequeue more that what we currently have */
 	if (buffer->size < len) {
@@ -197,6 +592,9 @@ wat_status_t wat_buffer_dequeue(wat_buffer_t *buffer, void *data, wat_size_t len
 		return WAT_FAIL;
 	}
 
+	/* The data area may have changed if the buffer grew */
+	buffer_data = (uint8_t *)buffer->data;
+
 	read_before_wrap = buffer->capacity - buffer->rindex;
 	if (read_before_wrap <= len) {
 		read_after_wrap = len - read_before_wrap;
@@ -225,8 +623,18 @@ wat_status_t wat_buffer_dequeue(wat_buffer_t *buffer, void *data, wat_size_t len
 wat_status_t wat_buffer_flush(wat_buffer_t *buffer, wat_size_t len)
 {
 	unsigned read_before_wrap;
+
+#ifdef WAT_HAVE_ATOMICS
+	if (buffer->lockfree) {
+		return wat_buffer_lockfree_flush(buffer, len);
+	}
+#endif
 	
 	wat_mutex_lock(buffer->mutex);
+
+	/* The caller is done with the data it viewed */
+	wat_safe_free(buffer->retired_data);
+
 	/* We cannot flush more that what we currently have */
 	if (buffer->size < len) {
 		wat_mutex_unlock(buffer->mutex);
@@ -246,6 +654,12 @@ wat_status_t wat_buffer_flush(wat_buffer_t *buffer, wat_size_t len)
 
 wat_status_t wat_buffer_reset(wat_buffer_t *buffer)
 {
+#ifdef WAT_HAVE_ATOMICS
+	if (buffer->lockfree) {
+		/* Only the consumer may reset a lock-free buffer, drop everything that was enqueued so far */
+		return wat_buffer_lockfree_flush(buffer, wat_atomic_load(&buffer->head) - buffer->tail);
+	}
+#endif
 	wat_mutex_lock(buffer->mutex);
 	buffer->size = 0;
 	buffer->rindex = 0;
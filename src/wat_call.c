@@ -117,6 +117,18 @@ wat_call_t *wat_span_get_call_by_state(wat_span_t *span, wat_call_state_t state)
 	return call;
 }
 
+/* Poll the call state with CLCC to find out when an outbound call is answered,
+   unless the module reports call progress with unsolicited notifications */
+void wat_call_monitor_progress(wat_call_t *call)
+{
+	wat_span_t *span = call->span;
+
+	if (wat_test_flag(&span->module, WAT_MODFLAG_CALL_PROGRESS_URC)) {
+		return;
+	}
+	wat_sched_timer(span->sched, "progress_monitor", span->config.progress_poll_interval, wat_scheduled_clcc, (void*) call, &span->timeouts[WAT_PROGRESS_MONITOR]);
+}
+
 wat_status_t _wat_call_set_state(const char *func, int line, wat_call_t *call, wat_call_state_t new_state)
 {
 	wat_span_t *span = call->span;
@@ -139,9 +151,9 @@ wat_status_t _wat_call_set_state(const char *func, int line, wat_call_t *call, w
 
 				sprintf(cmd, "ATD%s; ", call->called_num.digits);
 				
-				wat_cmd_enqueue(span, cmd, wat_response_atd, call, 15000);
+				wat_cmd_enqueue_prio(span, WAT_CMD_PRIO_CALL, cmd, wat_response_atd, call, 15000);
 
-				wat_sched_timer(span->sched, "progress_monitor", span->config.progress_poll_interval, wat_scheduled_clcc, (void*) call, &span->timeouts[WAT_PROGRESS_MONITOR]);
+				wat_call_monitor_progress(call);
 			}
 		}
 		break;
@@ -179,7 +191,7 @@ wat_status_t _wat_call_set_state(const char *func, int line, wat_call_t *call, w
 		break;
 		case WAT_CALL_STATE_ANSWERED:
 			if (call->dir == WAT_DIRECTION_INCOMING) {
-				wat_cmd_enqueue(span, "ATA", wat_response_ata, call, 30000);
+				wat_cmd_enqueue_prio(span, WAT_CMD_PRIO_CALL, "ATA", wat_response_ata, call, 30000);
 			} else {
 				wat_con_status_t con_status;
 				memset(&con_status, 0, sizeof(con_status));
@@ -212,7 +224,7 @@ wat_status_t _wat_call_set_state(const char *func, int line, wat_call_t *call, w
 		break;
 		case WAT_CALL_STATE_HANGUP:
 		{
-			wat_cmd_enqueue(span, "ATH", wat_response_ath, call, 30000);
+			wat_cmd_enqueue_prio(span, WAT_CMD_PRIO_CALL, "ATH", wat_response_ath, call, 30000);
 		}
 		break;
 		case WAT_CALL_STATE_HANGUP_CMPL:
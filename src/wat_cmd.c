@@ -57,17 +57,134 @@ WAT_STR2ENUM(wat_str2wat_clcc_stat, wat_clcc_stat2str, wat_clcc_stat_t, WAT_CLCC
 WAT_ENUM_NAMES(WAT_PIN_CHIP_STAT_NAMES, WAT_PIN_CHIP_STAT_STRINGS)
 WAT_STR2ENUM(wat_str2wat_chip_pin_stat, wat_chip_pin_stat2str, wat_pin_stat_t, WAT_PIN_CHIP_STAT_NAMES, WAT_PIN_INVALID)
 
+WAT_ENUM_NAMES(WAT_CMD_PRIO_NAMES, WAT_CMD_PRIO_STRINGS)
+WAT_STR2ENUM(wat_str2wat_cmd_prio, wat_cmd_prio2str, wat_cmd_prio_t, WAT_CMD_PRIO_NAMES, WAT_CMD_PRIO_SZ)
+
 
 WAT_SCHEDULED_FUNC(wat_cmd_complete);
+static WAT_SCHEDULED_FUNC(wat_cmd_retry);
 WAT_SCHEDULED_FUNC(wat_scheduled_cnum);
 WAT_SCHEDULED_FUNC(wat_scheduled_hangup_complete);
 
 typedef struct {
-	unsigned id;
-	unsigned dir;
-	unsigned stat;
+	int id;
+	int dir;
+	int stat;
 } clcc_entry_t;
 
+typedef struct {
+	int mode;
+	int stat;
+	int lac;
+	int ci;
+} creg_entry_t;
+
+typedef struct {
+	int mode;
+	int format;
+	char oper[WAT_MAX_OPERATOR_SZ];
+} cops_entry_t;
+
+typedef struct {
+	char alpha[WAT_MAX_TYPE_SZ];
+	char number[WAT_MAX_NUMBER_SZ];
+	int type;
+} cnum_entry_t;
+
+typedef struct {
+	char number[WAT_MAX_NUMBER_SZ];
+	int type;
+} csca_entry_t;
+
+typedef struct {
+	int rssi;
+	int ber;
+} csq_entry_t;
+
+typedef struct {
+	char number[WAT_MAX_NUMBER_SZ];
+	int type;
+	int validity;
+} clip_entry_t;
+
+typedef struct {
+	char oa[WAT_MAX_NUMBER_SZ];
+	int length;
+	char scts[32];
+} cmt_entry_t;
+
+/* Format: <id>,<dir>,<stat>,<mode>,<mpty>[,<number>,<type>[,<alpha>]] */
+static const wat_schema_field_t clcc_fields[] = {
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, clcc_entry_t, id),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, clcc_entry_t, dir),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, clcc_entry_t, stat),
+};
+static const wat_schema_t clcc_schema = WAT_SCHEMA("+CLCC: ", clcc_entry_t, 5, clcc_fields);
+
+/* Format: <mode>,<stat>[,<lac>,<ci>] */
+static const wat_schema_field_t creg_fields[] = {
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, creg_entry_t, mode),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, creg_entry_t, stat),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, creg_entry_t, lac),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, creg_entry_t, ci),
+};
+static const wat_schema_t creg_schema = WAT_SCHEMA("+CREG: ", creg_entry_t, 2, creg_fields);
+
+/* Unsolicited format: <stat> */
+static const wat_schema_field_t creg_urc_fields[] = {
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, creg_entry_t, stat),
+};
+static const wat_schema_t creg_urc_schema = WAT_SCHEMA("+CREG: ", creg_entry_t, 1, creg_urc_fields);
+
+/* Format: <mode>[,<format>,<oper>] */
+static const wat_schema_field_t cops_fields[] = {
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, cops_entry_t, mode),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, cops_entry_t, format),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_STR, cops_entry_t, oper),
+};
+static const wat_schema_t cops_schema = WAT_SCHEMA("+COPS: ", cops_entry_t, 3, cops_fields);
+
+/* Format: <alpha>,<number>,<type> */
+static const wat_schema_field_t cnum_fields[] = {
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_STR, cnum_entry_t, alpha),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_STR, cnum_entry_t, number),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, cnum_entry_t, type),
+};
+static const wat_schema_t cnum_schema = WAT_SCHEMA("+CNUM: ", cnum_entry_t, 3, cnum_fields);
+
+/* Format: <number>,<type> */
+static const wat_schema_field_t csca_fields[] = {
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_STR, csca_entry_t, number),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, csca_entry_t, type),
+};
+static const wat_schema_t csca_schema = WAT_SCHEMA("+CSCA: ", csca_entry_t, 2, csca_fields);
+
+/* Format: <rssi>,<ber> */
+static const wat_schema_field_t csq_fields[] = {
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, csq_entry_t, rssi),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, csq_entry_t, ber),
+};
+static const wat_schema_t csq_schema = WAT_SCHEMA("+CSQ: ", csq_entry_t, 2, csq_fields);
+
+/* Format: <number>,<type>[,<subaddr>,<satype>,<alpha>,<CLI_validity>] */
+static const wat_schema_field_t clip_fields[] = {
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_STR, clip_entry_t, number),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, clip_entry_t, type),
+	WAT_SCHEMA_FIELD_SKIP,
+	WAT_SCHEMA_FIELD_SKIP,
+	WAT_SCHEMA_FIELD_SKIP,
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, clip_entry_t, validity),
+};
+static const wat_schema_t clip_schema = WAT_SCHEMA("+CLIP: ", clip_entry_t, 1, clip_fields);
+
+/* PDU mode: <alpha>,<length>. Text mode: <oa>,<alpha>,<scts>[,...] */
+static const wat_schema_field_t cmt_fields[] = {
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_STR, cmt_entry_t, oa),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, cmt_entry_t, length),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_STR, cmt_entry_t, scts),
+};
+static const wat_schema_t cmt_schema = WAT_SCHEMA("+CMT: ", cmt_entry_t, 2, cmt_fields);
+
 typedef enum {
 	WAT_TERM_OK,
 	WAT_TERM_CONNECT,
@@ -84,23 +201,27 @@ typedef enum {
 
 typedef struct wat_terminator {
 	char *termstr;
+	uint8_t termlen;
 	wat_bool_t success;
 	wat_term_t term_type;
 	wat_bool_t call_progress_info;
 } wat_terminator_t;
 
+#define WAT_TERMSTR(str) str, sizeof(str) - 1
+
+/* Indexed by wat_term_t, see wat_match_terminator */
 static wat_terminator_t terminators[] = {
-	{ "OK", WAT_TRUE, WAT_TERM_OK, WAT_FALSE },
-	{ "CONNECT", WAT_TRUE, WAT_TERM_CONNECT, WAT_TRUE },
-	{ "BUSY", WAT_FALSE, WAT_TERM_BUSY, WAT_TRUE },
-	{ "ERROR", WAT_FALSE, WAT_TERM_ERR, WAT_FALSE },
-	{ "NO DIALTONE", WAT_FALSE, WAT_TERM_NO_DIALTONE, WAT_TRUE },
-	{ "NO ANSWER", WAT_FALSE, WAT_TERM_NO_ANSWER, WAT_TRUE},
-	{ "NO CARRIER", WAT_FALSE, WAT_TERM_NO_CARRIER, WAT_TRUE },
-	{ "+CMS ERROR:", WAT_FALSE, WAT_TERM_CMS_ERR, WAT_FALSE },
-	{ "+CME ERROR:", WAT_FALSE, WAT_TERM_CME_ERR, WAT_FALSE },
-	{ "+EXT ERROR:", WAT_FALSE, WAT_TERM_EXT_ERR, WAT_FALSE },
-	{ ">", WAT_TRUE, WAT_TERM_SMS, WAT_FALSE },
+	{ WAT_TERMSTR("OK"), WAT_TRUE, WAT_TERM_OK, WAT_FALSE },
+	{ WAT_TERMSTR("CONNECT"), WAT_TRUE, WAT_TERM_CONNECT, WAT_TRUE },
+	{ WAT_TERMSTR("BUSY"), WAT_FALSE, WAT_TERM_BUSY, WAT_TRUE },
+	{ WAT_TERMSTR("ERROR"), WAT_FALSE, WAT_TERM_ERR, WAT_FALSE },
+	{ WAT_TERMSTR("NO DIALTONE"), WAT_FALSE, WAT_TERM_NO_DIALTONE, WAT_TRUE },
+	{ WAT_TERMSTR("NO ANSWER"), WAT_FALSE, WAT_TERM_NO_ANSWER, WAT_TRUE},
+	{ WAT_TERMSTR("NO CARRIER"), WAT_FALSE, WAT_TERM_NO_CARRIER, WAT_TRUE },
+	{ WAT_TERMSTR("+CMS ERROR:"), WAT_FALSE, WAT_TERM_CMS_ERR, WAT_FALSE },
+	{ WAT_TERMSTR("+CME ERROR:"), WAT_FALSE, WAT_TERM_CME_ERR, WAT_FALSE },
+	{ WAT_TERMSTR("+EXT ERROR:"), WAT_FALSE, WAT_TERM_EXT_ERR, WAT_FALSE },
+	{ WAT_TERMSTR(">"), WAT_TRUE, WAT_TERM_SMS, WAT_FALSE },
 };
 
 struct enum_code {
@@ -301,10 +422,33 @@ static struct enum_code ext_codes[] = {
 	{ -1, "invalid" },
 };
 
-static wat_status_t wat_tokenize_line(wat_span_t *span, char *tokens[], char *line, wat_size_t len, wat_size_t *consumed);
+/* Direct-indexed views of the code tables above, built by wat_cmd_init.
+   Sizes must be larger than the highest code in each table */
+#define WAT_CME_INDEX_SZ 773
+#define WAT_CMS_INDEX_SZ 539
+#define WAT_EXT_INDEX_SZ 1
+
+static char *cme_index[WAT_CME_INDEX_SZ];
+static char *cms_index[WAT_CMS_INDEX_SZ];
+static char *ext_index[WAT_EXT_INDEX_SZ];
+
+static wat_status_t wat_tokenize_line(wat_span_t *span, const char *line, wat_size_t len, wat_size_t *consumed);
 static int wat_cmd_handle_notify(wat_span_t *span, char *tokens[]);
+static wat_cmd_notify_func *wat_cmd_lookup_notify(wat_span_t *span, const char *token);
 static int wat_cmd_handle_response(wat_span_t *span, char *tokens[], wat_terminator_t *terminator, char *error);
 static wat_terminator_t *wat_match_terminator(const char* token, char **error);
+static void wat_cmd_pace(wat_span_t *span, wat_bool_t answered);
+static WAT_RESPONSE_FUNC(wat_response_batch);
+
+typedef struct wat_cmd_batch {
+	uint8_t count;
+	struct {
+		char cmd[WAT_CMD_INLINE_SZ];
+		wat_cmd_response_func *cb;
+		void *obj;
+		uint8_t lines;
+	} sections[WAT_CMD_BATCH_MAX_SECTIONS];
+} wat_cmd_batch_t;
 
 wat_bool_t wat_match_prefix(char *string, const char *prefix)
 {
@@ -318,125 +462,603 @@ wat_bool_t wat_match_prefix(char *string, const char *prefix)
 	return WAT_FALSE;
 }
 
-static char *wat_strerror(int error, struct enum_code error_table[])
+static void wat_build_code_index(struct enum_code error_table[], char *index[], uint32_t index_len)
 {
 	int i = 0;
 
+	memset(index, 0, index_len * sizeof(index[0]));
 	while (error_table[i].code != -1) {
-		if (error_table[i].code == error) {
-			return error_table[i].string;
+		if (error_table[i].code < index_len) {
+			index[error_table[i].code] = error_table[i].string;
+		} else {
+			wat_log(WAT_LOG_CRIT, "Error code %d does not fit in index (size:%d)\n", error_table[i].code, index_len);
 		}
 		i++;
 	}
-	return "invalid";
 }
 
-/* This function guarrantees that this command will be sent right after the current command that is being executed
-    (before any queued command)	only one AT command can be sent this way, this function should only be used if
-    this command needs to go before the commands that were already queued */
+void wat_cmd_init(void)
+{
+	wat_build_code_index(cme_codes, cme_index, wat_array_len(cme_index));
+	wat_build_code_index(cms_codes, cms_index, wat_array_len(cms_index));
+	wat_build_code_index(ext_codes, ext_index, wat_array_len(ext_index));
+}
 
-wat_status_t wat_cmd_send(wat_span_t *span, const char *incommand, wat_cmd_response_func *cb, void *obj, uint32_t timeout)
+/* Parses the numeric code following an error terminator and resolves it through a direct-indexed table */
+static char *wat_strerror(const char *str, char *index[], uint32_t index_len)
 {
-	wat_cmd_t *cmd;
+	uint32_t code = 0;
 
-	if (span->cmd_next != NULL) {
-		wat_log_span(span, WAT_LOG_CRIT, "We already had a command to send next!!! (new:%s existing:%s)\n", incommand, span->cmd_next->cmd);
-		return WAT_FAIL;
+	while (*str == ' ') {
+		str++;
 	}
 
-	wat_assert_return(span->cmd_queue, WAT_FAIL, "No command queue!\n");
+	if (*str < '0' || *str > '9') {
+		return "invalid";
+	}
 
-	if (!incommand) {
-		wat_log_span(span, WAT_LOG_DEBUG, "Sending dummy cmd cb:%p\n", cb);
-	} else {
-		if (!strlen(incommand)) {
-			wat_log_span(span, WAT_LOG_DEBUG, "Invalid cmd to end \"%s\"\n", incommand);
-			return WAT_FAIL;
+	for (; *str >= '0' && *str <= '9'; str++) {
+		code = (code * 10) + (*str - '0');
+		if (code >= index_len) {
+			return "invalid";
 		}
+	}
+	return index[code] ? index[code] : "invalid";
+}
 
-		if (span->config.debug_mask & WAT_DEBUG_AT_HANDLE) {
-			wat_log_span(span, WAT_LOG_DEBUG, "Next command \"%s\"\n", incommand);
-		}
+/* Commands are taken from a per-span pool, so the periodic polls do not hit the allocator once
+   the pool has grown to the number of commands in flight */
+static wat_cmd_t *wat_cmd_alloc(wat_span_t *span, const char *incommand, wat_cmd_response_func *cb, void *obj, uint32_t timeout)
+{
+	wat_cmd_t *cmd;
+
+	wat_mutex_lock(span->cmd_mutex);
+	cmd = span->cmd_pool;
+	if (cmd) {
+		span->cmd_pool = cmd->next_free;
+		span->cmd_stats.reused++;
 	}
+	wat_mutex_unlock(span->cmd_mutex);
 
-	/* Add a \r to finish the command */
-	cmd = wat_calloc(1, sizeof(*cmd));
-	wat_assert_return(cmd, WAT_FAIL, "Failed to alloc new command\n");
-	
+	if (!cmd) {
+		cmd = wat_malloc(sizeof(*cmd));
+		wat_assert_return(cmd, NULL, "Failed to alloc new command\n");
+		wat_cmd_stats_inc(span, allocated);
+	}
+
+	memset(cmd, 0, offsetof(wat_cmd_t, inline_cmd));
 	cmd->cb = cb;
 	cmd->obj = obj;
 	cmd->timeout = timeout;
 	if (incommand) {
-		cmd->cmd = wat_strdup(incommand);
+		wat_size_t len = strlen(incommand);
+		if (len < sizeof(cmd->inline_cmd)) {
+			memcpy(cmd->inline_cmd, incommand, len + 1);
+			cmd->cmd = cmd->inline_cmd;
+		} else {
+			cmd->cmd = wat_strdup(incommand);
+			if (!cmd->cmd) {
+				wat_cmd_release(span, cmd);
+				return NULL;
+			}
+			wat_cmd_stats_inc(span, spilled);
+		}
 	}
-	
-	span->cmd_next = cmd;
-	return WAT_SUCCESS;
+	return cmd;
 }
 
-wat_status_t wat_cmd_enqueue(wat_span_t *span, const char *incommand, wat_cmd_response_func *cb, void *obj, uint32_t timeout)
+void wat_cmd_release(wat_span_t *span, wat_cmd_t *cmd)
 {
+	if (cmd->cmd != cmd->inline_cmd) {
+		wat_safe_free(cmd->cmd);
+	}
+	cmd->cmd = NULL;
+
+	wat_mutex_lock(span->cmd_mutex);
+	cmd->next_free = span->cmd_pool;
+	span->cmd_pool = cmd;
+	wat_mutex_unlock(span->cmd_mutex);
+}
+
+/* Releases every pending command and frees the pool, called when the span stops */
+void wat_cmd_flush_all(wat_span_t *span)
+{
+	int prio;
 	wat_cmd_t *cmd;
-	wat_assert_return(span->cmd_queue, WAT_FAIL, "No command queue!\n");
+
+	wat_mutex_lock(span->cmd_mutex);
+	cmd = span->cmd;
+	span->cmd = NULL;
+	wat_mutex_unlock(span->cmd_mutex);
+
+	if (cmd) {
+		if (cmd->cb == wat_response_batch) {
+			wat_safe_free(cmd->obj);
+		}
+		wat_cmd_release(span, cmd);
+	}
+
+	for (prio = 0; prio < WAT_CMD_PRIO_SZ; prio++) {
+		if (!span->cmd_queues[prio]) {
+			continue;
+		}
+		while ((cmd = wat_queue_dequeue(span->cmd_queues[prio])) != NULL) {
+			if (cmd->cb == wat_response_batch) {
+				wat_safe_free(cmd->obj);
+			}
+			wat_cmd_release(span, cmd);
+		}
+	}
+
+	wat_mutex_lock(span->cmd_mutex);
+	while (span->cmd_pool) {
+		cmd = span->cmd_pool;
+		span->cmd_pool = cmd->next_free;
+		wat_free(cmd);
+	}
+	wat_mutex_unlock(span->cmd_mutex);
+	span->cmd_busy = 0;
+}
+
+static wat_cmd_t *wat_cmd_new(wat_span_t *span, wat_cmd_prio_t prio, const char *incommand, wat_cmd_response_func *cb, void *obj, uint32_t timeout)
+{
+	wat_cmd_t *cmd;
+
+	wat_assert_return(prio < WAT_CMD_PRIO_SZ, NULL, "Invalid command priority\n");
+	wat_assert_return(span->cmd_queues[prio], NULL, "No command queue!\n");
 
 	if (!incommand) {
 		wat_log_span(span, WAT_LOG_DEBUG, "Enqueued dummy cmd cb:%p\n", cb);
 	} else {
 		if (!strlen(incommand)) {
 			wat_log_span(span, WAT_LOG_DEBUG, "Invalid cmd to enqueue \"%s\"\n", incommand);
-			return WAT_FAIL;
+			return NULL;
 		}
 
 		if (span->config.debug_mask & WAT_DEBUG_AT_HANDLE) {
-			wat_log_span(span, WAT_LOG_DEBUG, "Enqueued command \"%s\"\n", incommand);
+			wat_log_span(span, WAT_LOG_DEBUG, "Enqueued command \"%s\" (prio:%s)\n", incommand, wat_cmd_prio2str(prio));
 		}
 	}
 
-	/* Add a \r to finish the command */
-	cmd = wat_calloc(1, sizeof(*cmd));
-	wat_assert_return(cmd, WAT_FAIL, "Failed to alloc new command\n");
-	
-	cmd->cb = cb;
-	cmd->obj = obj;
-	cmd->timeout = timeout;
-	if (incommand) {
-		cmd->cmd = wat_strdup(incommand);
+	cmd = wat_cmd_alloc(span, incommand, cb, obj, timeout);
+	wat_assert_return(cmd, NULL, "Failed to alloc new command\n");
+
+	cmd->prio = prio;
+	return cmd;
+}
+
+/* Finishes queueing cmd once wat_queue_enqueue returned status */
+static wat_status_t wat_cmd_pushed(wat_span_t *span, wat_cmd_t *cmd, wat_status_t status)
+{
+	if (status != WAT_SUCCESS) {
+		wat_log_span(span, WAT_LOG_CRIT, "Command queue full (prio:%s), dropping \"%s\"\n", wat_cmd_prio2str(cmd->prio), cmd->cmd ? cmd->cmd : "dummy");
+		wat_cmd_release(span, cmd);
+		return WAT_FAIL;
+	}
+	if (span->sched) {
+		/* Commands may be requested from another thread than the one running the span */
+		wat_sched_wakeup(span->sched);
+	}
+	return WAT_SUCCESS;
+}
+
+static wat_status_t wat_cmd_push(wat_span_t *span, wat_cmd_t *cmd)
+{
+	return wat_cmd_pushed(span, cmd, wat_queue_enqueue(span->cmd_queues[cmd->prio], cmd));
+}
+
+/* Commands are dispatched from the highest priority lane that has work, FIFO within a lane.
+   A command already sent to the chip is never preempted */
+wat_status_t wat_cmd_enqueue_prio(wat_span_t *span, wat_cmd_prio_t prio, const char *incommand, wat_cmd_response_func *cb, void *obj, uint32_t timeout)
+{
+	wat_cmd_t *cmd;
+
+	cmd = wat_cmd_new(span, prio, incommand, cb, obj, timeout);
+	if (!cmd) {
+		return WAT_FAIL;
+	}
+	return wat_cmd_push(span, cmd);
+}
+
+/* Same as wat_cmd_enqueue_prio for the read-only queries of the library (i.e AT+CSQ), which are sent
+   again if the chip does not answer in time. Never use it for user commands or commands with side effects */
+wat_status_t wat_cmd_enqueue_query(wat_span_t *span, wat_cmd_prio_t prio, const char *incommand, wat_cmd_response_func *cb, void *obj, uint32_t timeout)
+{
+	wat_cmd_t *cmd;
+
+	cmd = wat_cmd_new(span, prio, incommand, cb, obj, timeout);
+	if (!cmd) {
+		return WAT_FAIL;
+	}
+	cmd->idempotent = WAT_TRUE;
+	return wat_cmd_push(span, cmd);
+}
+
+/* Queues a command that is dropped instead of sent if it is still waiting deadline_ms from now,
+   handle (if not NULL) receives an id to cancel it with wat_cmd_cancel_handle */
+wat_status_t wat_cmd_enqueue_deadline(wat_span_t *span, const char *incommand, wat_cmd_response_func *cb, void *obj, uint32_t timeout, uint32_t deadline_ms, wat_cmd_handle_t *handle)
+{
+	wat_cmd_handle_t id;
+	wat_cmd_t *cmd;
+
+	cmd = wat_cmd_new(span, WAT_CMD_PRIO_NORMAL, incommand, cb, obj, timeout);
+	if (!cmd) {
+		return WAT_FAIL;
+	}
+
+	if (deadline_ms) {
+		cmd->deadline = wat_sched_time_ms() + deadline_ms;
+	}
+
+	wat_mutex_lock(span->cmd_mutex);
+	if (++span->last_cmd_handle == WAT_CMD_HANDLE_INVALID) {
+		span->last_cmd_handle++;
+	}
+	id = cmd->handle = span->last_cmd_handle;
+	wat_mutex_unlock(span->cmd_mutex);
+
+	if (wat_cmd_push(span, cmd) != WAT_SUCCESS) {
+		return WAT_FAIL;
+	}
+	if (handle) {
+		*handle = id;
 	}
-	wat_queue_enqueue(span->cmd_queue, cmd);
 	return WAT_SUCCESS;
 }
 
+static wat_bool_t wat_cmd_match_handle(void *obj, void *data)
+{
+	wat_cmd_t *queued = obj;
+
+	if (queued->handle == *(wat_cmd_handle_t *)data) {
+		/* Flagged while the queue is locked, the command cannot be dequeued and reused meanwhile */
+		queued->cancelled = WAT_TRUE;
+		return WAT_TRUE;
+	}
+	return WAT_FALSE;
+}
+
+/* Cancelled commands stay in their queue, they are dropped by wat_cmd_dequeue.
+   Runs under cmd_mutex so a command moving from its queue to span->cmd is seen in one of them */
+wat_status_t wat_cmd_cancel_handle(wat_span_t *span, wat_cmd_handle_t handle)
+{
+	int prio;
+	wat_status_t status = WAT_FAIL;
+
+	wat_assert_return(handle != WAT_CMD_HANDLE_INVALID, WAT_EINVAL, "Invalid command handle\n");
+
+	wat_mutex_lock(span->cmd_mutex);
+	for (prio = 0; prio < WAT_CMD_PRIO_SZ; prio++) {
+		if (wat_queue_find(span->cmd_queues[prio], wat_cmd_match_handle, &handle)) {
+			status = WAT_SUCCESS;
+			break;
+		}
+	}
+
+	/* An answered command stays active for the command interval, but it is complete */
+	if (status != WAT_SUCCESS && span->cmd && span->cmd->handle == handle && span->cmd->answered != WAT_TRUE) {
+		status = WAT_EBUSY;
+	}
+	wat_mutex_unlock(span->cmd_mutex);
+	return status;
+}
+
+/* The response handler of a dropped command is called with success set to WAT_FALSE, so the owner of obj can release it */
+static void wat_cmd_drop(wat_span_t *span, wat_cmd_t *cmd, char *reason)
+{
+	char *tokens[1] = { NULL };
+
+	wat_log_span(span, WAT_LOG_NOTICE, "Dropping command '%s', %s\n", cmd->cmd ? cmd->cmd : "dummy", reason);
+
+	wat_cmd_stats_inc(span, dropped);
+	if (cmd->cb) {
+		cmd->cb(span, tokens, WAT_FALSE, cmd->obj, reason);
+	}
+	wat_cmd_release(span, cmd);
+}
+
+typedef struct wat_cmd_key {
+	const char *cmd;
+	wat_cmd_response_func *cb;
+} wat_cmd_key_t;
+
+static wat_bool_t wat_cmd_match(void *obj, void *data)
+{
+	wat_cmd_t *queued = obj;
+	wat_cmd_key_t *key = data;
+
+	if (queued->cb == key->cb && queued->cmd && !strcmp(queued->cmd, key->cmd)) {
+		return WAT_TRUE;
+	}
+	return WAT_FALSE;
+}
+
+/* Same as wat_cmd_enqueue_prio, but if an identical command with the same response handler is still waiting
+   to be sent, that one is reused and its response serves every caller. Only use this for queries whose
+   response handler does not depend on obj (i.e AT+CLCC updates every call on the span) */
+wat_status_t wat_cmd_enqueue_coalesced(wat_span_t *span, wat_cmd_prio_t prio, const char *incommand, wat_cmd_response_func *cb, void *obj, uint32_t timeout)
+{
+	wat_cmd_key_t key;
+	wat_cmd_t *cmd;
+	wat_status_t status;
+
+	wat_assert_return(incommand, WAT_FAIL, "Cannot coalesce dummy commands\n");
+
+	/* Taken from the pool before locking, cmd_mutex is not recursive */
+	cmd = wat_cmd_new(span, prio, incommand, cb, obj, timeout);
+	if (!cmd) {
+		return WAT_FAIL;
+	}
+	cmd->idempotent = WAT_TRUE;
+
+	key.cmd = incommand;
+	key.cb = cb;
+
+	/* Looked up and queued in one step, so that two threads cannot both queue it */
+	wat_mutex_lock(span->cmd_mutex);
+	if (wat_queue_find(span->cmd_queues[prio], wat_cmd_match, &key)) {
+		span->cmd_stats.coalesced++;
+		wat_mutex_unlock(span->cmd_mutex);
+
+		if (span->config.debug_mask & WAT_DEBUG_AT_HANDLE) {
+			wat_log_span(span, WAT_LOG_DEBUG, "Command \"%s\" already queued, not enqueuing it again\n", incommand);
+		}
+		wat_cmd_release(span, cmd);
+		return WAT_SUCCESS;
+	}
+	status = wat_queue_enqueue(span->cmd_queues[prio], cmd);
+	wat_mutex_unlock(span->cmd_mutex);
+
+	return wat_cmd_pushed(span, cmd, status);
+}
+
+/* This function guarrantees that this command will be sent right after the current command that is being executed
+    (before any queued command), this function should only be used if this command needs to go before the commands
+    that were already queued */
+wat_status_t wat_cmd_send(wat_span_t *span, const char *incommand, wat_cmd_response_func *cb, void *obj, uint32_t timeout)
+{
+	return wat_cmd_enqueue_prio(span, WAT_CMD_PRIO_NEXT, incommand, cb, obj, timeout);
+}
+
+wat_status_t wat_cmd_enqueue(wat_span_t *span, const char *incommand, wat_cmd_response_func *cb, void *obj, uint32_t timeout)
+{
+	return wat_cmd_enqueue_prio(span, WAT_CMD_PRIO_NORMAL, incommand, cb, obj, timeout);
+}
+
+/* Sends several commands as one command line (i.e AT+CGMM;+CGMI;+CGMR) to save round trips.
+   The chip answers with the information lines of every command followed by a single final result,
+   each section gets its own lines plus the final result passed to its response handler.
+   Only use this for commands that always answer with the same number of lines */
+wat_status_t wat_cmd_enqueue_batch(wat_span_t *span, const wat_cmd_section_t *sections, int count, uint32_t timeout)
+{
+	int i;
+	wat_size_t len;
+	wat_status_t status;
+	wat_cmd_batch_t *batch;
+	char line[WAT_MAX_CMD_SZ];
+
+	wat_assert_return(count > 0 && count <= WAT_CMD_BATCH_MAX_SECTIONS, WAT_FAIL, "Invalid number of commands in batch\n");
+
+	batch = wat_calloc(1, sizeof(*batch));
+	wat_assert_return(batch, WAT_FAIL, "Failed to alloc command batch\n");
+
+	len = snprintf(line, sizeof(line), "AT");
+	for (i = 0; i < count; i++) {
+		if (strlen(sections[i].cmd) + 2 >= sizeof(batch->sections[i].cmd) ||
+			sections[i].lines > WAT_CMD_BATCH_MAX_LINES) {
+
+			wat_log_span(span, WAT_LOG_CRIT, "Cannot batch command \"%s\"\n", sections[i].cmd);
+			wat_safe_free(batch);
+			return WAT_FAIL;
+		}
+
+		len += snprintf(&line[len], sizeof(line) - len, "%s%s", i ? ";" : "", sections[i].cmd);
+		if (len >= sizeof(line)) {
+			wat_log_span(span, WAT_LOG_CRIT, "Command batch too long\n");
+			wat_safe_free(batch);
+			return WAT_FAIL;
+		}
+
+		strcpy(batch->sections[i].cmd, sections[i].cmd);
+		batch->sections[i].cb = sections[i].cb;
+		batch->sections[i].obj = sections[i].obj;
+		batch->sections[i].lines = sections[i].lines;
+	}
+	batch->count = count;
+
+	status = wat_cmd_enqueue(span, line, wat_response_batch, batch, timeout);
+	if (status != WAT_SUCCESS) {
+		wat_safe_free(batch);
+	}
+	return status;
+}
+
+/* Sends the commands of a batch one by one, ahead of anything else queued so the original order is kept */
+static void wat_cmd_batch_split(wat_span_t *span, wat_cmd_batch_t *batch, uint32_t timeout)
+{
+	int i;
+	char cmd[WAT_CMD_INLINE_SZ + 2];
+
+	for (i = 0; i < batch->count; i++) {
+		snprintf(cmd, sizeof(cmd), "AT%s", batch->sections[i].cmd);
+		wat_cmd_enqueue_prio(span, WAT_CMD_PRIO_NEXT, cmd, batch->sections[i].cb, batch->sections[i].obj, timeout);
+	}
+	wat_safe_free(batch);
+}
+
+static WAT_RESPONSE_FUNC(wat_response_batch)
+{
+	int i, j;
+	int lines = 0;
+	int consumed = 0;
+	char *term_error = NULL;
+	wat_cmd_batch_t *batch = obj;
+	char *section_tokens[WAT_CMD_BATCH_MAX_LINES + 2];
+
+	/* Information lines come first, the final result is the last token */
+	while (tokens[consumed] && !wat_match_terminator(tokens[consumed], &term_error)) {
+		consumed++;
+	}
+	consumed++;
+
+	for (i = 0; i < batch->count; i++) {
+		lines += batch->sections[i].lines;
+	}
+
+	if (success != WAT_TRUE || lines != consumed - 1) {
+		wat_log_span(span, WAT_LOG_DEBUG, "Command batch \"%s\" failed (%s), sending commands one by one\n", span->cmd->cmd, error);
+		wat_cmd_batch_split(span, batch, span->cmd->timeout);
+		return consumed;
+	}
+
+	lines = 0;
+	for (i = 0; i < batch->count; i++) {
+		for (j = 0; j < batch->sections[i].lines; j++) {
+			section_tokens[j] = tokens[lines++];
+		}
+		section_tokens[j++] = tokens[consumed - 1];
+		section_tokens[j] = NULL;
+
+		if (batch->sections[i].cb) {
+			batch->sections[i].cb(span, section_tokens, success, batch->sections[i].obj, error);
+		}
+	}
+	wat_safe_free(batch);
+	return consumed;
+}
+
+/* A real command becomes span->cmd under cmd_mutex, in the same step it leaves its queue,
+   dropped commands are released with the lock dropped since their handler may queue again */
+wat_cmd_t *wat_cmd_dequeue(wat_span_t *span)
+{
+	int prio;
+	uint64_t now = 0;
+	wat_cmd_t *cmd;
+	char *reason;
+
+	wat_mutex_lock(span->cmd_mutex);
+	for (prio = 0; prio < WAT_CMD_PRIO_SZ; prio++) {
+		while ((cmd = wat_queue_dequeue(span->cmd_queues[prio])) != NULL) {
+			reason = NULL;
+			if (cmd->cancelled == WAT_TRUE) {
+				reason = "cancelled";
+			} else if (cmd->deadline) {
+				if (!now) {
+					now = wat_sched_time_ms();
+				}
+				if (now >= cmd->deadline) {
+					reason = "deadline expired";
+				}
+			}
+			if (reason) {
+				wat_mutex_unlock(span->cmd_mutex);
+				wat_cmd_drop(span, cmd, reason);
+				wat_mutex_lock(span->cmd_mutex);
+				continue;
+			}
+			if (cmd->cmd) {
+				span->cmd = cmd;
+			}
+			wat_mutex_unlock(span->cmd_mutex);
+			return cmd;
+		}
+	}
+	wat_mutex_unlock(span->cmd_mutex);
+	return NULL;
+}
+
+wat_bool_t wat_cmd_pending(wat_span_t *span)
+{
+	int prio;
+
+	for (prio = 0; prio < WAT_CMD_PRIO_SZ; prio++) {
+		if (wat_queue_empty(span->cmd_queues[prio]) == WAT_FALSE) {
+			return WAT_TRUE;
+		}
+	}
+	return WAT_FALSE;
+}
+
+/* Classifies a token on its first characters, then confirms the single candidate */
 static wat_terminator_t *wat_match_terminator(const char* token, char **error)
 {
-	int i = 0;
+	wat_term_t term_type;
 	wat_terminator_t *terminator = NULL;
 
-	for (i = 0; i < wat_array_len(terminators); i++) {
-		terminator = &terminators[i];
-		if (!strncmp(terminator->termstr, token, strlen(terminator->termstr))) {
-			switch(terminator->term_type) {
-				case WAT_TERM_CMS_ERR:					
-					*error = wat_strerror(atoi(&token[strlen(terminator->termstr) + 1]), cms_codes);
+	switch (token[0]) {
+		case 'O':
+			term_type = WAT_TERM_OK;
+			break;
+		case 'C':
+			term_type = WAT_TERM_CONNECT;
+			break;
+		case 'B':
+			term_type = WAT_TERM_BUSY;
+			break;
+		case 'E':
+			term_type = WAT_TERM_ERR;
+			break;
+		case '>':
+			term_type = WAT_TERM_SMS;
+			break;
+		case 'N':
+			if (token[1] != 'O' || token[2] != ' ') {
+				return NULL;
+			}
+			switch (token[3]) {
+				case 'D':
+					term_type = WAT_TERM_NO_DIALTONE;
 					break;
-				case WAT_TERM_CME_ERR:
-					*error = wat_strerror(atoi(&token[strlen(terminator->termstr) + 1]), cme_codes);
+				case 'A':
+					term_type = WAT_TERM_NO_ANSWER;
 					break;
-				case WAT_TERM_EXT_ERR:
-					*error = wat_strerror(atoi(&token[strlen(terminator->termstr) + 1]), ext_codes);
+				case 'C':
+					term_type = WAT_TERM_NO_CARRIER;
 					break;
 				default:
-					*error = terminator->termstr;
-					break;
+					return NULL;
 			}
-			return terminator;
-		}
+			break;
+		case '+':
+			if (token[1] == 'E') {
+				term_type = WAT_TERM_EXT_ERR;
+			} else if (token[1] == 'C' && token[2] == 'M' && token[3] == 'S') {
+				term_type = WAT_TERM_CMS_ERR;
+			} else if (token[1] == 'C' && token[2] == 'M' && token[3] == 'E') {
+				term_type = WAT_TERM_CME_ERR;
+			} else {
+				return NULL;
+			}
+			break;
+		default:
+			return NULL;
 	}
-	return NULL;
+
+	terminator = &terminators[term_type];
+	if (strncmp(terminator->termstr, token, terminator->termlen)) {
+		return NULL;
+	}
+
+	switch(terminator->term_type) {
+		case WAT_TERM_CMS_ERR:
+			*error = wat_strerror(&token[terminator->termlen], cms_index, wat_array_len(cms_index));
+			break;
+		case WAT_TERM_CME_ERR:
+			*error = wat_strerror(&token[terminator->termlen], cme_index, wat_array_len(cme_index));
+			break;
+		case WAT_TERM_EXT_ERR:
+			*error = wat_strerror(&token[terminator->termlen], ext_index, wat_array_len(ext_index));
+			break;
+		default:
+			*error = terminator->termstr;
+			break;
+	}
+	return terminator;
 }
 
 wat_status_t wat_cmd_process(wat_span_t *span)
 {
-	char data[WAT_BUFFER_SZ];	
+	const uint8_t *data = NULL;
 	unsigned i = 0;
 	wat_size_t len = 0;
 
@@ -445,28 +1067,44 @@ wat_status_t wat_cmd_process(wat_span_t *span)
 		return WAT_SUCCESS;
 	}
 
-	if (wat_buffer_peep(span->buffer, data, &len) == WAT_SUCCESS) {
+	if (wat_buffer_view(span->buffer, &data, &len) == WAT_SUCCESS) {
 		wat_size_t consumed = 0;
-		char *tokens[WAT_TOKENS_SZ];
+		char **tokens = NULL;
 		int tokens_consumed = 0;
 		int tokens_unused = 0;
 		wat_terminator_t *terminator = NULL;
 		wat_status_t status = WAT_FAIL;
 
-		memset(tokens, 0, sizeof(tokens));
+		uint64_t allocs_before = 0;
+		uint64_t frees_before = 0;
+
+		if (span->config.debug_mask & WAT_DEBUG_AT_PARSE) {
+			wat_mem_get_counters(&allocs_before, &frees_before);
+		}
 
 		if (span->config.debug_mask & WAT_DEBUG_UART_DUMP) {
 			char mydata[WAT_MAX_CMD_SZ];
 			wat_log_span(span, WAT_LOG_DEBUG, "[RX AT] %s (len:%d)\n", format_at_data(mydata, data, len), len);
 		}
 
-		status = wat_tokenize_line(span, tokens, (char*)data, len, &consumed);
-		if (status == WAT_SUCCESS) {
-			for (i = 0; !(wat_strlen_zero(tokens[i])); i++) {
+		status = wat_tokenize_line(span, (const char*)data, len, &consumed);
+		if (status == WAT_BREAK) {
+			/* The data could not be tokenized, do not keep parsing it on every pass */
+			wat_buffer_flush(span->buffer, consumed);
+			wat_tokenizer_reset(span);
+		} else if (status == WAT_SUCCESS) {
+			wat_bool_t terminated = WAT_FALSE;
+
+			/* Until something is consumed, every token is offered to the notify handler of the first one,
+			   so tokens the last pass looked at without calling a handler would not call one now */
+			tokens = span->token_arena.tokens;
+			tokens_unused = span->tokenizer.dispatched;
+			for (i = span->tokenizer.dispatched; !(wat_strlen_zero(tokens[i])); i++) {
 				char *error = NULL;
 
 				terminator = wat_match_terminator(tokens[i], &error);
 				if (terminator) {
+					terminated = WAT_TRUE;
 					if (terminator->call_progress_info) {
 						/* Check if this is a response to a ATD command */
 						if (span->cmd && !strncmp(span->cmd->cmd, "ATD", 3)) {
@@ -474,7 +1112,7 @@ wat_status_t wat_cmd_process(wat_span_t *span)
 							tokens_unused = 0;
 						} else {
 							/* This could be a hangup from the remote side, schedule a CLCC to find out which call hung-up */
-							wat_cmd_enqueue(span, "AT+CLCC", wat_response_clcc, NULL, span->config.timeout_command);
+							wat_cmd_enqueue_coalesced(span, WAT_CMD_PRIO_CALL, "AT+CLCC", wat_response_clcc, NULL, span->config.timeout_command);
 							tokens_consumed++;
 						}						
 					} else {
@@ -494,13 +1132,28 @@ wat_status_t wat_cmd_process(wat_span_t *span)
 				}
 			}
 
-			wat_free_tokens(tokens);
+			/* Tokens live in the span token arena, they are released on the next pass */
 			if (tokens_consumed) {
 				/* If we handled this token, remove it from the buffer */
 
 				wat_buffer_flush(span->buffer, consumed);
+				wat_tokenizer_reset(span);
+			} else if (terminated == WAT_FALSE && !wat_cmd_lookup_notify(span, tokens[0])) {
+				/* i.e the lines of a long response waiting for its final result */
+				span->tokenizer.dispatched = i;
+			} else {
+				span->tokenizer.dispatched = 0;
 			}
 		}
+
+		if (span->config.debug_mask & WAT_DEBUG_AT_PARSE) {
+			uint64_t allocs = 0;
+			uint64_t frees = 0;
+
+			wat_mem_get_counters(&allocs, &frees);
+			wat_log_span(span, WAT_LOG_DEBUG, "Parsing pass done (heap allocs:%llu frees:%llu)\n",
+						(unsigned long long)(allocs - allocs_before), (unsigned long long)(frees - frees_before));
+		}
 	}
 
 	return WAT_SUCCESS;
@@ -519,10 +1172,11 @@ WAT_SCHEDULED_FUNC(wat_cmd_complete)
 		wat_log_span(span, WAT_LOG_DEBUG, "Command complete\n");
 	}
 
+	wat_mutex_lock(span->cmd_mutex);
 	span->cmd = NULL;
+	wat_mutex_unlock(span->cmd_mutex);
 
-	wat_safe_free(cmd->cmd);
-	wat_safe_free(cmd);
+	wat_cmd_release(span, cmd);
 	span->cmd_busy = 0;
 	
 	return;
@@ -536,6 +1190,13 @@ static int wat_cmd_handle_response(wat_span_t *span, char *tokens[], wat_termina
 	wat_assert_return(span->cmd, WAT_FAIL, "We did not have a command pending\n");
 	
 	cmd = span->cmd;
+	if (cmd->answered == WAT_TRUE) {
+		/* The handler already ran, and may have released obj (e.g a command batch) */
+		wat_log_span(span, WAT_LOG_WARNING, "Ignoring extra response to command '%s'\n", cmd->cmd);
+		return 1;
+	}
+	cmd->answered = WAT_TRUE;
+
 	if (span->config.debug_mask & WAT_DEBUG_AT_HANDLE) {
 		wat_log_span(span, WAT_LOG_DEBUG, "Handling response for cmd:%s\n", cmd->cmd);
 	}
@@ -556,29 +1217,60 @@ static int wat_cmd_handle_response(wat_span_t *span, char *tokens[], wat_termina
 		wat_log_span(span, WAT_LOG_DEBUG, "Response consumed %d tokens\n", tokens_consumed);
 	}
 
+	wat_cmd_pace(span, WAT_TRUE);
+
 	/* Some chip manufacturers recommend a grace period between receiving a response and sending another command */
-	wat_sched_timer(span->sched, "command_interval", span->config.cmd_interval, wat_cmd_complete, (void*) span, NULL);	
+	if (span->cmd_interval) {
+		wat_sched_timer(span->sched, "command_interval", span->cmd_interval, wat_cmd_complete, (void*) span, NULL);
+	} else {
+		wat_cmd_complete(span);
+	}
 	return tokens_consumed;
 }
 
+/* With adaptive_cmd_interval, every answered command halves the gap down to the module minimum,
+   a timeout means the chip may have missed the command, so go back to the configured gap */
+static void wat_cmd_pace(wat_span_t *span, wat_bool_t answered)
+{
+	uint32_t interval;
+
+	if (span->config.adaptive_cmd_interval != WAT_TRUE) {
+		return;
+	}
+
+	if (answered == WAT_TRUE) {
+		interval = span->cmd_interval / 2;
+		if (interval < span->module.min_cmd_interval) {
+			interval = span->module.min_cmd_interval;
+		}
+	} else {
+		interval = span->config.cmd_interval;
+	}
+
+	if (interval > span->config.cmd_interval) {
+		interval = span->config.cmd_interval;
+	}
+
+	if (interval != span->cmd_interval && (span->config.debug_mask & WAT_DEBUG_AT_HANDLE)) {
+		wat_log_span(span, WAT_LOG_DEBUG, "Command interval %dms -> %dms\n", span->cmd_interval, interval);
+	}
+	span->cmd_interval = interval;
+}
+
 static int wat_cmd_handle_notify(wat_span_t *span, char *tokens[])
 {	
-	int i;
 	int tokens_consumed = 0;
+	wat_cmd_notify_func *func = NULL;
 
 	/* For notifications, the first token contains the AT command prefix */
 	if (span->config.debug_mask & WAT_DEBUG_AT_HANDLE) {
 		wat_log_span(span, WAT_LOG_DEBUG, "Handling notify for cmd:%s\n", tokens[0]);
 	}
 
-	for (i = 0; i < wat_array_len(span->notifys); i++) {
-		if (span->notifys[i]) {
-			wat_notify_t *notify = span->notifys[i];
-			if (!strncasecmp(notify->prefix, tokens[0], strlen(notify->prefix))) {
-				tokens_consumed = notify->func(span, tokens);
-				goto done;
-			}
-		}
+	func = wat_cmd_lookup_notify(span, tokens[0]);
+	if (func) {
+		tokens_consumed = func(span, tokens);
+		goto done;
 	}
 
 	/* This is not an error, sometimes sometimes we have an incomplete response
@@ -593,221 +1285,365 @@ done:
 	return tokens_consumed;
 }
 
-static wat_status_t wat_tokenize_line(wat_span_t *span, char *tokens[], char *line, wat_size_t len, wat_size_t *consumed)
+static void wat_tokenizer_add_token(wat_span_t *span, wat_size_t start, wat_size_t end)
 {
-	int i;
-	int token_index = 0;
-	uint8_t has_token = 0;
-	unsigned consumed_index = 0;
+	wat_tokenizer_t *tokenizer = &span->tokenizer;
 
-	char *token_str = NULL;
-	char *p = NULL;
+	span->token_arena.spans[tokenizer->token_count].start = start;
+	span->token_arena.spans[tokenizer->token_count].end = end;
+	tokenizer->token_count++;
+}
 
-	for (i = 0; i < len; i++) {
-		switch(line[i]) {
+/* Doubles the token slots, a response has at most one token per two bytes of the read
+   buffer, so this is bounded by the size of the token arena */
+wat_status_t wat_token_arena_grow(wat_token_arena_t *arena)
+{
+	unsigned capacity = arena->capacity ? (2 * arena->capacity) : WAT_TOKENS_SZ;
+	wat_token_span_t *spans;
+	char **tokens;
+
+	spans = wat_calloc(capacity, sizeof(*spans));
+	tokens = wat_calloc(capacity, sizeof(*tokens));
+	if (!spans || !tokens) {
+		wat_safe_free(spans);
+		wat_safe_free(tokens);
+		return WAT_FAIL;
+	}
+
+	if (arena->spans) {
+		memcpy(spans, arena->spans, arena->capacity * sizeof(*spans));
+		memcpy(tokens, arena->tokens, arena->capacity * sizeof(*tokens));
+	}
+	wat_safe_free(arena->spans);
+	wat_safe_free(arena->tokens);
+	arena->spans = spans;
+	arena->tokens = tokens;
+	arena->capacity = capacity;
+	return WAT_SUCCESS;
+}
+
+void wat_tokenizer_reset(wat_span_t *span)
+{
+	memset(&span->tokenizer, 0, sizeof(span->tokenizer));
+}
+
+/* The tokenizer remembers how far it scanned the buffer the last time it was called, so
+   only the bytes that were received since then are scanned. The buffer must not be
+   flushed without resetting the tokenizer */
+static wat_status_t wat_tokenize_line(wat_span_t *span, const char *line, wat_size_t len, wat_size_t *consumed)
+{
+	unsigned i;
+	wat_size_t index;
+	char **tokens;
+	wat_tokenizer_t *tokenizer = &span->tokenizer;
+	wat_token_arena_t *arena = &span->token_arena;
+
+	for (index = tokenizer->scan_index; index < len && !tokenizer->prompt; index++) {
+		/* Leave room for a '>' token and the NULL terminator */
+		if (tokenizer->token_count + 2 > arena->capacity && wat_token_arena_grow(arena) != WAT_SUCCESS) {
+			wat_log_span(span, WAT_LOG_CRIT, "Failed to grow token list, dropping %d bytes\n", len);
+			*consumed = len;
+			return WAT_BREAK;
+		}
+
+		switch(line[index]) {
 			case '\n':
-				if (has_token) {
+				if (tokenizer->has_token) {
 					/* This is the end of a token */
-					has_token = 0;
+					tokenizer->has_token = 0;
 
-					tokens[token_index++] = token_str;
-					consumed_index = i;
+					wat_tokenizer_add_token(span, tokenizer->token_start, tokenizer->token_end);
+					tokenizer->consumed = index + 1;
 				}
-				if (!token_index) {
-					consumed_index = i;
+				if (!tokenizer->token_count) {
+					tokenizer->consumed = index + 1;
 				}
 				break;
 			case '\r':
 				/* Ignore \r */
-				if (!token_index) {
-					consumed_index = i;
+				if (!tokenizer->token_count) {
+					tokenizer->consumed = index + 1;
 				}
 				break;
 			case '>':
-				{
-					/* We are in SMS mode */
+				/* We are in SMS mode */
 
-					/* Save previous token */
-					if (has_token) {
-						/* This is the end of a token */
-						has_token = 0;
-
-						tokens[token_index++] = token_str;
-					}
-					/* Create a new token */
-					tokens[token_index++] = wat_strdup(">\0");
+				/* Save previous token */
+				if (tokenizer->has_token) {
+					/* This is the end of a token */
+					tokenizer->has_token = 0;
 
-					/* Chip will not send anything else after a '>' */
-					i = len - 1;
-					consumed_index = i;
+					wat_tokenizer_add_token(span, tokenizer->token_start, tokenizer->token_end);
 				}
+				wat_tokenizer_add_token(span, index, index + 1);
+
+				/* Chip will not send anything else after a '>' */
+				tokenizer->prompt = 1;
 				break;
 			default:
-				if (!has_token) {
+				if (!tokenizer->has_token) {
 					/* This is the start of a new token */
-					has_token = 1;
-
-					token_str = wat_calloc(1, WAT_MAX_CMD_SZ);
-					wat_assert_return(token_str, WAT_FAIL, "Failed to allocate new token\n");
-
-					p = token_str;
+					tokenizer->has_token = 1;
+					tokenizer->token_start = index;
 				}
-				*(p++) = line[i];
+				tokenizer->token_end = index + 1;
 		}
 	}
 
-	if (has_token) {
+	if (tokenizer->prompt) {
+		/* Anything received after the '>' is discarded along with the tokens */
+		index = len;
+		tokenizer->consumed = len;
+	}
+
+	tokenizer->scan_index = index;
+
+	if (tokenizer->has_token) {
 		/* We are in the middle of receiving a Command wait for the rest */
-		wat_free_tokens(tokens);
-		wat_safe_free(token_str);
 		return WAT_FAIL;
 	}
 
-	/* No more tokens left in buffer */
-	if (token_index) {
-		while (i <  len) {
-			/* Remove remaining \r and \n" */
-			if (line[i] != '\r' && line[i] != '\n') {
-				break;
+	if (!tokenizer->token_count) {
+		/* No complete tokens in buffer */
+		return WAT_FAIL;
+	}
+
+	/* Tokens from the previous pass are not used anymore, unless no handler got them */
+	if (!tokenizer->dispatched) {
+		arena->used = 0;
+	}
+	tokens = arena->tokens;
+
+	for (i = tokenizer->dispatched; i < tokenizer->token_count; i++) {
+		char *p = NULL;
+		wat_token_span_t *token_span = &arena->spans[i];
+
+		/* Tokens never use more than the bytes they were read from plus a NULL,
+		   so the arena cannot run out of space */
+		tokens[i] = p = &arena->data[arena->used];
+		for (index = token_span->start; index < token_span->end && p < &tokens[i][WAT_MAX_CMD_SZ - 1]; index++) {
+			if (line[index] != '\r') {
+				*(p++) = line[index];
 			}
-			i++;
-			consumed_index = i;
 		}
+		*(p++) = '\0';
+		arena->used += p - tokens[i];
+	}
+	tokens[i] = NULL;
 
-		*consumed = consumed_index+1;
+	*consumed = tokenizer->consumed;
 
-		if (span->config.debug_mask & WAT_DEBUG_AT_PARSE) {
-			wat_log(WAT_LOG_DEBUG, "Decoded tokens %d consumed:%u len:%u\n", token_index, *consumed, len);
+	if (span->config.debug_mask & WAT_DEBUG_AT_PARSE) {
+		wat_log(WAT_LOG_DEBUG, "Decoded tokens %d consumed:%u len:%u arena:%u\n", tokenizer->token_count, *consumed, len, arena->used);
 
-			for (i = 0; i < token_index; i++) {
-				wat_log(WAT_LOG_DEBUG, "  Token[%d]:%s\n", i, tokens[i]);
-			}
+		for (i = 0; i < tokenizer->token_count; i++) {
+			wat_log(WAT_LOG_DEBUG, "  Token[%d]:%s\n", i, tokens[i]);
 		}
-		return WAT_SUCCESS;
 	}
-	*consumed = consumed_index+1;
-	return WAT_FAIL;
+	return WAT_SUCCESS;
 }
 
-void wat_free_tokens(char *tokens[])
+static wat_notify_node_t *wat_notify_find_child(wat_notify_node_t *first, char key)
 {
-	unsigned i;
-	for (i = 0; tokens[i]; i++) {
-		wat_safe_free(tokens[i]);
+	wat_notify_node_t *node;
+
+	for (node = first; node; node = node->sibling) {
+		if (node->key == key) {
+			return node;
+		}
+	}
+	return NULL;
+}
+
+/* Returns the handler for the longest registered prefix that matches the token */
+static wat_cmd_notify_func *wat_cmd_lookup_notify(wat_span_t *span, const char *token)
+{
+	const char *p;
+	wat_notify_node_t *node = NULL;
+	wat_notify_node_t *level = span->notifys;
+	wat_cmd_notify_func *func = NULL;
+
+	for (p = token; *p && level; p++) {
+		node = wat_notify_find_child(level, tolower((unsigned char)*p));
+		if (!node) {
+			break;
+		}
+		if (node->func) {
+			func = node->func;
+		}
+		level = node->child;
 	}
+	return func;
 }
 
 wat_status_t wat_cmd_register(wat_span_t *span, const char *prefix, wat_cmd_notify_func func)
 {
-	wat_status_t status = WAT_FAIL;
-	wat_notify_t *new_notify = NULL;
-	wat_iterator_t *iter = NULL;
-	wat_iterator_t *curr = NULL;
+	const char *p;
+	wat_notify_node_t *node = NULL;
+	wat_notify_node_t **level = &span->notifys;
 
-	/* Check if there is already a notify callback set for this prefix first */
-	iter = wat_span_get_notify_iterator(span, iter);
-	for (curr = iter; curr; curr = wat_iterator_next(curr)) {
-		wat_notify_t *notify = wat_iterator_current(curr);
-		if (!strcmp(notify->prefix, prefix)) {
-			/* Overwrite existing notify */
-			wat_log_span(span, WAT_LOG_INFO, "Already had a notifier for prefix %s\n", prefix);
+	wat_assert_return(!wat_strlen_zero(prefix), WAT_FAIL, "Empty notify prefix\n");
 
-			notify->func = func;
-			status = WAT_SUCCESS;
-			goto done;
+	for (p = prefix; *p; p++) {
+		char key = tolower((unsigned char)*p);
+
+		node = wat_notify_find_child(*level, key);
+		if (!node) {
+			node = wat_calloc(1, sizeof(*node));
+			wat_assert_return(node, WAT_FAIL, "Failed to alloc memory\n");
+
+			node->key = key;
+			node->sibling = *level;
+			*level = node;
 		}
+		level = &node->child;
 	}
 
-	if (span->notify_count == wat_array_len(span->notifys)) {
-		wat_log(WAT_LOG_CRIT, "Failed to register new notifier, no space left in notify list\n");
-		goto done;
+	if (node->func) {
+		/* Overwrite existing notify */
+		wat_log_span(span, WAT_LOG_INFO, "Already had a notifier for prefix %s\n", prefix);
 	}
+	node->func = func;
+	return WAT_SUCCESS;
+}
 
-	new_notify = wat_calloc(1, sizeof(*new_notify));
-	wat_assert_return(new_notify, WAT_FAIL, "Failed to alloc memory\n");
-
-	new_notify->prefix = wat_strdup(prefix);
-	new_notify->func = func;
-	
-	span->notifys[span->notify_count] = new_notify;
-	span->notify_count++;
+static void wat_notify_node_destroy(wat_notify_node_t *node)
+{
+	while (node) {
+		wat_notify_node_t *sibling = node->sibling;
 
-	status = WAT_SUCCESS;
+		wat_notify_node_destroy(node->child);
+		wat_free(node);
+		node = sibling;
+	}
+}
 
-done:
-	wat_iterator_free(iter);
-	return status;
+void wat_cmd_unregister_all(wat_span_t *span)
+{
+	wat_notify_node_destroy(span->notifys);
+	span->notifys = NULL;
 }
 
-int wat_cmd_entry_tokenize(char *token, char *tokens[], wat_size_t len)
+/* Splits a comma separated entry (i.e 1,0,3,0,0,"+15551234",145) in place. Empty fields are kept,
+   quotes are not part of the field view and commas inside quotes do not split. Returns the number of
+   fields in the entry, fields past max_fields are counted but not stored */
+int wat_cmd_entry_fields(const char *entry, wat_field_t fields[], int max_fields)
 {
-	char *previous_token = NULL;
-	int token_count = 0;
-	char *p = NULL;
-	char *saveptr = NULL;
-	char *entry = wat_strdup(token);
+	int count = 0;
+	const char *p = entry;
+	const char *end;
+	wat_field_t field;
+
+	while (*p == ' ') {
+		p++;
+	}
+	if (*p == '\0') {
+		return 0;
+	}
 
-	/* since the array is null-terminated, at least 2 elements are required */
-	wat_assert_return(len > 1, 0, "invalid token array len");
+	while (1) {
+		while (*p == ' ') {
+			p++;
+		}
 
-	memset(tokens, 0, (len * sizeof(tokens[0])));
+		if (*p == '\"') {
+			field.str = ++p;
+			end = strchr(p, '\"');
+			if (!end) {
+				end = p + strlen(p);
+			}
+			field.len = end - p;
+			/* Ignore anything between the closing quote and the next separator */
+			p = end + strcspn(end, ",");
+		} else {
+			field.str = p;
+			p += strcspn(p, ",");
+			for (end = p; end > field.str && end[-1] == ' '; end--);
+			field.len = end - field.str;
+		}
+
+		if (count < max_fields) {
+			fields[count] = field;
+		}
+		count++;
 
-	if (entry[0] == ',') {
-		/* If the first character is a ',' , this string begins with an empty token,
-		 we still need to count it */
-		tokens[token_count++] = wat_strdup("");
+		if (*p != ',') {
+			break;
+		}
+		p++;
 	}
 
-	if (token_count == (len - 1)) {
-		wat_log(WAT_LOG_ERROR, "No space left in token array, ignoring the rest of the entry (token=%s)\n", token);
-		goto done;
+	return count;
+}
+
+/* Same as atoi, limited to the field */
+int wat_field_int(const wat_field_t *field)
+{
+	int value = 0;
+	int negative = 0;
+	wat_size_t i = 0;
+
+	if (i < field->len && (field->str[i] == '-' || field->str[i] == '+')) {
+		negative = (field->str[i] == '-');
+		i++;
+	}
+	for (; i < field->len && field->str[i] >= '0' && field->str[i] <= '9'; i++) {
+		value = (value * 10) + (field->str[i] - '0');
 	}
+	return negative ? -value : value;
+}
 
-	for (p = strtok_r(entry, ",", &saveptr); p; p = strtok_r(NULL, ",", &saveptr)) {
+/* Copies the field as a null-terminated string, truncated to fit in dest */
+char *wat_field_copy(char *dest, wat_size_t size, const wat_field_t *field)
+{
+	wat_size_t len = field->len;
 
-		if (token_count == (len - 1)) {
-			wat_log(WAT_LOG_ERROR, "No space left in token array, ignoring the rest of the entry (token=%s)\n", p);
-			break;
-		}
+	if (len >= size) {
+		len = size - 1;
+	}
+	memcpy(dest, field->str, len);
+	dest[len] = '\0';
+	return dest;
+}
 
-		/* if this is not our first token, check if the current token has an end quote but not a starting quote */
-		if (token_count > 0 && p[strlen(p)-1] == '\"' && p[0] != '\"') {
-			previous_token = tokens[token_count - 1];
-			/* check if the previous token has a starting quote and no ending quote */
-			if (previous_token[strlen(previous_token)-1] != '\"' &&
-				previous_token[0] == '\"') {
-				/* looks like the previous token did have a starting quote but no ending quote,
-				   we can combine current token with previous token */
-				char *new_token = NULL;
-
-				/* allocate enough space to hold both the previous token and the new token */
-				new_token = (char *)wat_calloc(1, strlen(previous_token) + strlen(p) + 1);
-				
-				wat_assert_return(new_token != NULL, 0, "Failed to allocate space for new token\n");
-
-				/* merge the previous token with the current token separated by a comma into the new token */
-				sprintf(new_token, "%s,%s", previous_token, p);
-
-				/* replace the previous token str pointer with the new token */
-				tokens[token_count - 1] = new_token;
-
-				/* free the previous token now that is merged in the new one */
-				wat_safe_free(previous_token);
-				continue;
-			}
-		}
+/* Parses a response entry into the struct described by the schema in a single pass, without modifying
+   the entry. Members of fields missing from the entry are zeroed. Returns the number of fields in the
+   entry, or -1 if it has less than the schema requires */
+int wat_schema_parse(const wat_schema_t *schema, const char *entry, void *dest)
+{
+	int i;
+	int count;
+	wat_field_t fields[WAT_SCHEMA_MAX_FIELDS];
 
-		tokens[token_count] = wat_strdup(p);
-		token_count++;
+	wat_assert_return(schema->num_fields <= WAT_SCHEMA_MAX_FIELDS, -1, "Too many fields in schema\n");
+
+	if (!strncmp(entry, schema->prefix, schema->prefix_len)) {
+		entry += schema->prefix_len;
 	}
 
-done:
+	memset(dest, 0, schema->struct_size);
 
-	if (entry) {
-		wat_free(entry);
+	count = wat_cmd_entry_fields(entry, fields, schema->num_fields);
+	if (count < schema->min_fields) {
+		return -1;
 	}
 
-	return token_count;
+	for (i = 0; i < schema->num_fields && i < count; i++) {
+		const wat_schema_field_t *field = &schema->fields[i];
+		char *member = (char *)dest + field->offset;
+
+		switch (field->type) {
+			case WAT_SCHEMA_INT:
+				*(int *)member = wat_field_int(&fields[i]);
+				break;
+			case WAT_SCHEMA_STR:
+				wat_field_copy(member, field->size, &fields[i]);
+				break;
+			case WAT_SCHEMA_SKIP:
+				break;
+		}
+	}
+	return count;
 }
 
 WAT_RESPONSE_FUNC(wat_response_atz)
@@ -964,11 +1800,7 @@ WAT_RESPONSE_FUNC(wat_response_clip)
 /* Network Registration Report */
 WAT_RESPONSE_FUNC(wat_response_creg)
 {
-	char *cmdtokens[10];
-	/*unsigned mode = 0;*/
-	unsigned stat = 0;
-	unsigned lac = 0;
-	unsigned ci = 0;
+	creg_entry_t creg;
 	
 	WAT_RESPONSE_FUNC_DBG_START
 	
@@ -978,26 +1810,18 @@ WAT_RESPONSE_FUNC(wat_response_creg)
 		return 1;
 	}
 
-	wat_match_prefix(tokens[0], "+CREG: ");
-	
-	switch(wat_cmd_entry_tokenize(tokens[0], cmdtokens, wat_array_len(cmdtokens))) {
+	switch(wat_schema_parse(&creg_schema, tokens[0], &creg)) {
 		case 4: /* Format: <mode>, <stat>[,<Lac>, <Ci>] */
-			lac = atoi(cmdtokens[2]);
-			ci = atoi(cmdtokens[3]);
-			span->net_info.lac = lac;
-			span->net_info.ci = ci;
+			span->net_info.lac = creg.lac;
+			span->net_info.ci = creg.ci;
 			/* Fall-through */
 		case 2: /* Format: <mode>, <stat> */
-			/*mode = atoi(cmdtokens[0]);*/
-			stat = atoi(cmdtokens[1]);
-			wat_span_update_net_status(span, stat);
+			wat_span_update_net_status(span, creg.stat);
 			break;	
 		default:
 			wat_log_span(span, WAT_LOG_ERROR, "Failed to parse CREG Response %s\n", tokens[0]);
 	}
 	
-	wat_free_tokens(cmdtokens);	
-	
 	WAT_FUNC_DBG_END
 	return 2;
 }
@@ -1021,18 +1845,17 @@ WAT_RESPONSE_FUNC(wat_response_cops)
 	int consumed_tokens = 1;
 	WAT_RESPONSE_FUNC_DBG_START
 
-	if (wat_match_prefix(tokens[0], "+COPS: ") == WAT_TRUE) {
+	if (!strncmp(tokens[0], cops_schema.prefix, cops_schema.prefix_len)) {
 		/* This is a response to AT+COPS? */
-		char *cmdtokens[5];
+		cops_entry_t cops;
 		/* Format: +COPS: X,X,<operator name> */
 
 		consumed_tokens = 2;
-		if (wat_cmd_entry_tokenize(tokens[0], cmdtokens, wat_array_len(cmdtokens)) < 3) {
+		if (wat_schema_parse(&cops_schema, tokens[0], &cops) < 0) {
 			wat_log_span(span, WAT_LOG_ERROR, "Failed to parse COPS entry:%s\n", tokens[0]);
 		} else {
-			strncpy(span->net_info.operator_name, wat_string_clean(cmdtokens[2]), sizeof(span->net_info.operator_name));
+			memcpy(span->net_info.operator_name, cops.oper, sizeof(span->net_info.operator_name));
 		}
-		wat_free_tokens(cmdtokens);
 	} else {
 		/* This is a response to AT+COPS=X,X */
 
@@ -1048,7 +1871,7 @@ WAT_RESPONSE_FUNC(wat_response_cops)
 WAT_RESPONSE_FUNC(wat_response_cnum)
 {
 	int numtokens = 0;
-	char *cmdtokens[5];
+	cnum_entry_t cnum;
 	WAT_RESPONSE_FUNC_DBG_START
 
 	if (success != WAT_TRUE) {
@@ -1070,23 +1893,20 @@ WAT_RESPONSE_FUNC(wat_response_cnum)
 	}
 
 	numtokens = 2;
-	wat_match_prefix(tokens[0], "+CNUM: ");
 
-	if (wat_cmd_entry_tokenize(tokens[0], cmdtokens, wat_array_len(cmdtokens)) < 3) {
+	if (wat_schema_parse(&cnum_schema, tokens[0], &cnum) < 0) {
 		wat_log_span(span, WAT_LOG_ERROR, "Failed to parse CNUM entry:%s\n", tokens[0]);
-		wat_free_tokens(cmdtokens);		
 		goto end_fail;
 	}
 
-	if (strlen(wat_string_clean(cmdtokens[1])) <= 0) {
+	if (!cnum.number[0]) {
 		wat_log_span(span, WAT_LOG_DEBUG, "Subscriber not available yet\n");
-		wat_free_tokens(cmdtokens);
 		goto end_fail;
 	}
 
-	strncpy(span->sim_info.subscriber_type, wat_string_clean(cmdtokens[0]), sizeof(span->sim_info.subscriber_type));
-	strncpy(span->sim_info.subscriber.digits, wat_string_clean(cmdtokens[1]), sizeof(span->sim_info.subscriber.digits));
-	wat_decode_type_of_address(atoi(cmdtokens[2]), &span->sim_info.subscriber.type, &span->sim_info.subscriber.plan);
+	memcpy(span->sim_info.subscriber_type, cnum.alpha, sizeof(span->sim_info.subscriber_type));
+	memcpy(span->sim_info.subscriber.digits, cnum.number, sizeof(span->sim_info.subscriber.digits));
+	wat_decode_type_of_address(cnum.type, &span->sim_info.subscriber.type, &span->sim_info.subscriber.plan);
 		
 	wat_log_span(span, WAT_LOG_NOTICE, "Subscriber:%s type:%s plan:%s <%s> \n",
 				 span->sim_info.subscriber.digits, wat_number_type2str(span->sim_info.subscriber.type),
@@ -1104,15 +1924,13 @@ WAT_RESPONSE_FUNC(wat_response_cnum)
 		g_interface.wat_span_sts(span->id, &sts_event);
 	}
 
-	wat_free_tokens(cmdtokens);
-
 	WAT_FUNC_DBG_END
 	return numtokens;
 
 end_fail:
 	if (span->cnum_retries++ < WAT_DEFAULT_CNUM_RETRIES) {
 		/* Subscriber number was not available yet */
-		wat_sched_timer(span->sched, "subscriber_number", WAT_DEFAULT_CNUM_POLL, wat_scheduled_cnum, (void *) span, NULL);
+		wat_sched_timer_slack(span->sched, "subscriber_number", WAT_DEFAULT_CNUM_POLL, WAT_PERIODIC_TIMER_SLACK, wat_scheduled_cnum, (void *) span, NULL);
 	}
 
 	WAT_FUNC_DBG_END
@@ -1122,7 +1940,7 @@ end_fail:
 WAT_RESPONSE_FUNC(wat_response_csca)
 {
 	WAT_RESPONSE_FUNC_DBG_START
-	char *cmdtokens[3];
+	csca_entry_t csca;
 
 	if (success != WAT_TRUE) {
 		wat_log_span(span, WAT_LOG_ERROR, "Failed to obtain Service Centre Address (%s)\n", error);
@@ -1141,24 +1959,19 @@ WAT_RESPONSE_FUNC(wat_response_csca)
 		return 1;
 	}
 
-	wat_match_prefix(tokens[0], "+CSCA: ");
-
-	if (wat_cmd_entry_tokenize(tokens[0], cmdtokens, wat_array_len(cmdtokens)) < 2) {
+	if (wat_schema_parse(&csca_schema, tokens[0], &csca) < 0) {
 		wat_log_span(span, WAT_LOG_ERROR, "Failed to parse CSCA entry:%s\n", tokens[0]);
-		wat_free_tokens(cmdtokens);
 		WAT_FUNC_DBG_END
 		return 2;
 	}
 
-	strncpy(span->sim_info.smsc.digits, wat_string_clean(cmdtokens[0]), sizeof(span->sim_info.smsc.digits));
-	wat_decode_type_of_address(atoi(cmdtokens[1]), &span->sim_info.smsc.type, &span->sim_info.smsc.plan);
+	memcpy(span->sim_info.smsc.digits, csca.number, sizeof(span->sim_info.smsc.digits));
+	wat_decode_type_of_address(csca.type, &span->sim_info.smsc.type, &span->sim_info.smsc.plan);
 
 	wat_log_span(span, WAT_LOG_NOTICE, "SMSC:%s type:%s plan:%s\n",
 							span->sim_info.smsc.digits, wat_number_type2str(span->sim_info.smsc.type),
 							wat_number_plan2str(span->sim_info.smsc.plan));
 
-	wat_free_tokens(cmdtokens);
-
 	WAT_FUNC_DBG_END
 	return 2;
 }
@@ -1166,7 +1979,7 @@ WAT_RESPONSE_FUNC(wat_response_csca)
 
 WAT_RESPONSE_FUNC(wat_response_csq)
 {
-	unsigned rssi, ber;
+	csq_entry_t csq;
 	wat_alarm_t new_alarm = WAT_ALARM_NONE;
 
 	WAT_RESPONSE_FUNC_DBG_START
@@ -1177,12 +1990,10 @@ WAT_RESPONSE_FUNC(wat_response_csq)
 		return 1;
 	}
 
-	wat_match_prefix(tokens[0], "+CSQ: ");
-	
-	if (sscanf(tokens[0], "%d,%d\n", &rssi, &ber) == 2) {
+	if (wat_schema_parse(&csq_schema, tokens[0], &csq) >= 0) {
 		char dest[30];
-		span->sig_info.rssi = rssi;
-		span->sig_info.ber = ber;
+		span->sig_info.rssi = csq.rssi;
+		span->sig_info.ber = csq.ber;
 
 		if (span->sig_info.rssi == 0 || span->sig_info.rssi == 1 || span->sig_info.rssi == 99) {
 			new_alarm = WAT_ALARM_NO_SIGNAL;
@@ -1198,7 +2009,7 @@ WAT_RESPONSE_FUNC(wat_response_csq)
 
 		wat_span_update_alarm_status(span, new_alarm);
 
-		wat_log_span(span, WAT_LOG_DEBUG, "Signal strength:%s (BER:%s)\n", wat_decode_rssi(dest, rssi), wat_csq_ber2str(ber));
+		wat_log_span(span, WAT_LOG_DEBUG, "Signal strength:%s (BER:%s)\n", wat_decode_rssi(dest, csq.rssi), wat_csq_ber2str(csq.ber));
 	} else {
 		wat_log_span(span, WAT_LOG_ERROR, "Failed to parse CSQ %s\n", tokens[0]);
 	}
@@ -1216,7 +2027,7 @@ WAT_RESPONSE_FUNC(wat_response_ata)
 	} else {
 		wat_log_span(span, WAT_LOG_INFO, "[id:%d] Failed to answer call (%s)\n", call->id, error);
 		/* Schedule a CLCC to resync the call state */
-		wat_cmd_enqueue(call->span, "AT+CLCC", wat_response_clcc, call, span->config.timeout_command);
+		wat_cmd_enqueue_coalesced(call->span, WAT_CMD_PRIO_CALL, "AT+CLCC", wat_response_clcc, call, span->config.timeout_command);
 	}
 	
 	WAT_FUNC_DBG_END
@@ -1237,7 +2048,7 @@ WAT_RESPONSE_FUNC(wat_response_ath)
 	} else {
 		wat_log_span(span, WAT_LOG_ERROR, "[id:%d] Failed to hangup call (%s)\n", call->id, error);
 		/* Schedule a CLCC to resync the call state */
-		wat_cmd_enqueue(call->span, "AT+CLCC", wat_response_clcc, call, span->config.timeout_command);
+		wat_cmd_enqueue_coalesced(call->span, WAT_CMD_PRIO_CALL, "AT+CLCC", wat_response_clcc, call, span->config.timeout_command);
 	}
 	
 	WAT_FUNC_DBG_END
@@ -1252,7 +2063,7 @@ WAT_RESPONSE_FUNC(wat_response_atd)
 	if (!success) {
 		wat_log_span(span, WAT_LOG_ERROR, "[id:%d] Failed to make outbound call (%s)\n", call->id, error);
 		/* Schedule a CLCC to resync the call state */
-		wat_cmd_enqueue(call->span, "AT+CLCC", wat_response_clcc, call, span->config.timeout_command);
+		wat_cmd_enqueue_coalesced(call->span, WAT_CMD_PRIO_CALL, "AT+CLCC", wat_response_clcc, call, span->config.timeout_command);
 	}
 
 	WAT_FUNC_DBG_END
@@ -1301,51 +2112,38 @@ WAT_RESPONSE_FUNC(wat_response_clcc)
 		<alpha>: string type, alphanumeric representation of <number> corresponding to entry found in phonebook
 	*/
 
-	wat_match_prefix(tokens[0], "+CLCC: ");
-
-	for (i = 0; strncmp(tokens[i], "OK", 2); i++) {
-		unsigned id, dir, stat;
-		char *cmdtokens[10];
+	for (i = 0; strncmp(tokens[i], "OK", 2) && num_clcc_entries < wat_array_len(entries); i++) {
+		clcc_entry_t *entry = &entries[num_clcc_entries];
 
-		if (wat_cmd_entry_tokenize(tokens[i], cmdtokens, wat_array_len(cmdtokens)) < 8) {
+		if (wat_schema_parse(&clcc_schema, tokens[i], entry) < 0) {
 			wat_log_span(span, WAT_LOG_ERROR, "Failed to parse CLCC entry:%s\n", tokens[i]);
 			WAT_FUNC_DBG_END
-			wat_free_tokens(cmdtokens);
 			return 1;
 		}
 
-		id = atoi(cmdtokens[0]);
-		if (id <= 0) {
+		if (entry->id <= 0) {
 			wat_log_span(span, WAT_LOG_ERROR, "Failed to parse call ID from CLCC entry:%s\n", tokens[i]);
 			WAT_FUNC_DBG_END
 			return 1;
 		}
 
-		dir = atoi(cmdtokens[1]);
-		if (dir < 0) {
+		if (entry->dir < 0) {
 			wat_log_span(span, WAT_LOG_ERROR, "Failed to parse call direction from CLCC entry:%s\n", tokens[i]);
 			WAT_FUNC_DBG_END
 			return 1;
 		}
 
-		stat = atoi(cmdtokens[2]);
-		if (stat < 0) {
+		if (entry->stat < 0) {
 			wat_log_span(span, WAT_LOG_ERROR, "Failed to parse call state from CLCC entry:%s\n", tokens[i]);
 			WAT_FUNC_DBG_END
 			return 1;
 		}
 
 		wat_log_span(span, WAT_LOG_DEBUG, "CLCC entry (id:%d dir:%s stat:%s)\n",
-													id,
-													wat_direction2str(dir),
-													wat_clcc_stat2str(stat));
-
-		entries[num_clcc_entries].id = id;
-		entries[num_clcc_entries].dir = dir;
-		entries[num_clcc_entries].stat = stat;
+													entry->id,
+													wat_direction2str(entry->dir),
+													wat_clcc_stat2str(entry->stat));
 		num_clcc_entries++;
-		
-		wat_free_tokens(cmdtokens);
 	}
 
 	iter = wat_span_get_call_iterator(span, NULL);
@@ -1393,7 +2191,7 @@ WAT_RESPONSE_FUNC(wat_response_clcc)
 								matched = WAT_TRUE;
 
 								/* Keep monitoring the call to find out when the call is anwered */
-								wat_sched_timer(span->sched, "progress_monitor", span->config.progress_poll_interval, wat_scheduled_clcc, (void*) call, &span->timeouts[WAT_PROGRESS_MONITOR]);
+								wat_call_monitor_progress(call);
 								break;
 							
 						}
@@ -1409,14 +2207,14 @@ WAT_RESPONSE_FUNC(wat_response_clcc)
 							case 2: /* Dialing */
 								matched = WAT_TRUE;
 								/* Keep monitoring the call to find out when the call is anwered */
-								wat_sched_timer(span->sched, "progress_monitor", span->config.progress_poll_interval, wat_scheduled_clcc, (void*) call, &span->timeouts[WAT_PROGRESS_MONITOR]);
+								wat_call_monitor_progress(call);
 								break;
 							case 3: /* Alerting */
 								wat_call_set_state(call, WAT_CALL_STATE_RINGING);
 							
 								matched = WAT_TRUE;
 								/* Keep monitoring the call to find out when the call is anwered */
-								wat_sched_timer(span->sched, "progress_monitor", span->config.progress_poll_interval, wat_scheduled_clcc, (void*) call, &span->timeouts[WAT_PROGRESS_MONITOR]);
+								wat_call_monitor_progress(call);
 								break;
 							case 0:
 								matched = WAT_TRUE;
@@ -1432,7 +2230,7 @@ WAT_RESPONSE_FUNC(wat_response_clcc)
 						case 3:
 							matched = WAT_TRUE;
 							/* Keep monitoring the call to find out when the call is anwered */
-							wat_sched_timer(span->sched, "progress_monitor", span->config.progress_poll_interval, wat_scheduled_clcc, (void*) call, &span->timeouts[WAT_PROGRESS_MONITOR]);
+							wat_call_monitor_progress(call);
 							break;
 						case 0:
 							matched = WAT_TRUE;
@@ -1459,7 +2257,7 @@ WAT_RESPONSE_FUNC(wat_response_clcc)
 				break;
 		}
 		
-		if (matched == WAT_FALSE) {
+		if (matched == WAT_FALSE && call->state != WAT_CALL_STATE_TERMINATING) {
 			if (span->config.debug_mask & WAT_DEBUG_CALL_STATE) {
 				wat_log_span(span, WAT_LOG_DEBUG, "[id:%d] No CLCC entries for call (state:%s), hanging up\n", call->id, wat_call_state2str(call->state));
 			}
@@ -1599,9 +2397,8 @@ WAT_NOTIFY_FUNC(wat_notify_cring)
 /* Incoming SMS */
 WAT_NOTIFY_FUNC(wat_notify_cmt)
 {
-	wat_size_t len;
-	char *cmdtokens[4];
-	unsigned numtokens;
+	cmt_entry_t cmt;
+	int numtokens;
 
 	WAT_NOTIFY_FUNC_DBG_START
 	/* Format +CMT <alpha>, <length> */
@@ -1614,9 +2411,7 @@ WAT_NOTIFY_FUNC(wat_notify_cmt)
 		return 0;
 	}
 
-	wat_match_prefix(tokens[0], "+CMT: ");
-
-	numtokens = wat_cmd_entry_tokenize(tokens[0], cmdtokens, wat_array_len(cmdtokens));
+	numtokens = wat_schema_parse(&cmt_schema, tokens[0], &cmt);
 
 	/* PDU Mode:
 	+CMT:<alpha>,<length>,\r\n<pdu>
@@ -1636,30 +2431,27 @@ WAT_NOTIFY_FUNC(wat_notify_cmt)
 	length: text length
 	*/
 
-	if (numtokens < 2) {
-		wat_log_span(span, WAT_LOG_WARNING, "Failed to parse incoming SMS Header %s (%d)\n", tokens[0], numtokens);
+	if (numtokens < 0) {
+		wat_log_span(span, WAT_LOG_WARNING, "Failed to parse incoming SMS Header %s\n", tokens[0]);
 		goto done;
 	}
 
 	if (numtokens == 2) {/* PDU mode */
-		len = atoi(cmdtokens[1]);
-		if (len <= 0) {
+		if (cmt.length <= 0) {
 			wat_log_span(span, WAT_LOG_WARNING, "Invalid PDU len in SMS header %s\n", tokens[0]);
 			goto done;
 		}
 
-		wat_log_span(span, WAT_LOG_DEBUG, "[sms]PDU len:%d\n", len);
-		wat_handle_incoming_sms_pdu(span, tokens[1], len);
+		wat_log_span(span, WAT_LOG_DEBUG, "[sms]PDU len:%d\n", cmt.length);
+		wat_handle_incoming_sms_pdu(span, tokens[1], cmt.length);
 	}
 
 	if (numtokens > 2) { /* Text mode */
-		len = atoi(cmdtokens[1]);
-		wat_log_span(span, WAT_LOG_DEBUG, "[sms]TEXT len:%d\n", len);
-		wat_handle_incoming_sms_text(span, cmdtokens[0], cmdtokens[2], tokens[1]);
+		wat_log_span(span, WAT_LOG_DEBUG, "[sms]TEXT len:%d\n", (int) strlen(tokens[1]));
+		wat_handle_incoming_sms_text(span, cmt.oa, cmt.scts, tokens[1]);
 	}
 	
 done:
-	wat_free_tokens(cmdtokens);
 	WAT_FUNC_DBG_END
 	return 2;
 }
@@ -1667,15 +2459,13 @@ done:
 /* Calling Line Identification Presentation */
 WAT_NOTIFY_FUNC(wat_notify_clip)
 {
-	char *cmdtokens[10];
-	unsigned numtokens;
+	clip_entry_t clip;
+	int numtokens;
 	wat_call_t *call = NULL;
 
 	WAT_NOTIFY_FUNC_DBG_START
 
-	wat_match_prefix(tokens[0], "+CLIP: ");
-
-	numtokens = wat_cmd_entry_tokenize(tokens[0], cmdtokens, wat_array_len(cmdtokens));
+	numtokens = wat_schema_parse(&clip_schema, tokens[0], &clip);
 	if (numtokens < 3) {
 		/* This is not a notify but a CLIP response, do not handle it here */
 		return 0;
@@ -1725,25 +2515,16 @@ WAT_NOTIFY_FUNC(wat_notify_clip)
 				2 - CLI is not available due to interworking problems or limitation of originating network.
 	*/
 	
-	if (numtokens < 1) {
-		wat_log_span(span, WAT_LOG_ERROR, "Failed to parse CLIP entry:%s\n", tokens[0]);
-		wat_free_tokens(cmdtokens);
-		return 0;
-	}
-
-	if (strlen(cmdtokens[0]) < 0) {
+	if (!clip.number[0]) {
 		wat_log_span(span, WAT_LOG_DEBUG, "Calling Number not available\n");
 		goto done;
 	}
 
-	strncpy(call->calling_num.digits, cmdtokens[0], strlen(cmdtokens[0]));
-
-	if (numtokens >= 1) {
-		wat_decode_type_of_address(atoi(cmdtokens[1]), &call->calling_num.type, &call->calling_num.plan);
-	}
+	memcpy(call->calling_num.digits, clip.number, sizeof(call->calling_num.digits));
+	wat_decode_type_of_address(clip.type, &call->calling_num.type, &call->calling_num.plan);
 
 	if (numtokens >= 6) {
-		switch (atoi(cmdtokens[5])) {
+		switch (clip.validity) {
 			case 0:
 				call->calling_num.validity = WAT_NUMBER_VALIDITY_VALID;
 				break;
@@ -1767,28 +2548,25 @@ WAT_NOTIFY_FUNC(wat_notify_clip)
 										wat_number_validity2str(call->calling_num.validity), call->calling_num.validity);
 
 done:	
-	wat_free_tokens(cmdtokens);
 	return 1;
 }
 
 WAT_NOTIFY_FUNC(wat_notify_creg)
 {
 	int stat;
-	unsigned count;
-	char *cmdtokens[3];
+	int count;
+	creg_entry_t creg;
 	int consumed_tokens = 0;
 	
 	WAT_NOTIFY_FUNC_DBG_START
 
-	wat_match_prefix(tokens[0], "+CREG: ");
-
-	count = wat_cmd_entry_tokenize(tokens[0], cmdtokens, wat_array_len(cmdtokens));
+	count = wat_schema_parse(&creg_urc_schema, tokens[0], &creg);
 
 	if (count < 0) {
 		wat_log_span(span, WAT_LOG_ERROR, "Failed to parse CREG Response %s\n", tokens[0]);
 		consumed_tokens = 1;
 	} else if (count == 1) {
-		stat = atoi(cmdtokens[0]);
+		stat = creg.stat;
 		if (stat < 0) {
 			wat_log_span(span, WAT_LOG_ERROR, "Failed to parse CREG Response %s\n", tokens[0]);
 			consumed_tokens = 1;
@@ -1803,7 +2581,6 @@ WAT_NOTIFY_FUNC(wat_notify_creg)
 		consumed_tokens = 0;
 	}
 
-	wat_free_tokens(cmdtokens);
 	return consumed_tokens;
 }
 
@@ -1824,47 +2601,85 @@ WAT_SCHEDULED_FUNC(wat_cmd_timeout)
 	wat_assert_return_void(span->cmd, "Command timeout, but we do not have an active command?");
 
 	cmd = span->cmd;
-	
+
+	wat_cmd_pace(span, WAT_FALSE);
+
+	if (cmd->cb != wat_response_batch && cmd->idempotent == WAT_TRUE && cmd->retries < WAT_MAX_CMD_RETRIES) {
+		uint32_t backoff = WAT_CMD_RETRY_BACKOFF << cmd->retries;
+
+		cmd->retries++;
+		wat_cmd_stats_inc(span, retried);
+		wat_log_span(span, WAT_LOG_ERROR, "Timed out executing command: '%s', retrying %d/%d in %dms\n", cmd->cmd, cmd->retries, WAT_MAX_CMD_RETRIES, backoff);
+
+		/* The command stays active during the back-off, so a late response still completes it */
+		wat_sched_timer(span->sched, "command retry", backoff, wat_cmd_retry, (void*) span, &span->timeouts[WAT_TIMEOUT_CMD]);
+		return;
+	}
+
+	wat_mutex_lock(span->cmd_mutex);
 	span->cmd = NULL;
+	wat_mutex_unlock(span->cmd_mutex);
 	
 	span->cmd_busy = 0;
 
-	if (cmd->retries++ < WAT_MAX_CMD_RETRIES) {
-		wat_log_span(span, WAT_LOG_ERROR, "Timed out executing command: '%s', retrying %d\n", cmd->cmd, cmd->retries);
-		wat_queue_enqueue(span->cmd_queue, cmd);
+	if (cmd->cb == wat_response_batch) {
+		/* Maybe the chip does not like one of the commands, retry them one by one */
+		wat_log_span(span, WAT_LOG_ERROR, "Timed out executing command batch: '%s', sending commands one by one\n", cmd->cmd);
+		wat_cmd_batch_split(span, cmd->obj, cmd->timeout);
 	} else {
 		wat_log_span(span, WAT_LOG_ERROR, "Final time out executing command: '%s'\n", cmd->cmd);
-		wat_safe_free(cmd->cmd);
-		wat_safe_free(cmd);
-	}	
+	}
+	wat_cmd_release(span, cmd);
+}
+
+static WAT_SCHEDULED_FUNC(wat_cmd_retry)
+{
+	wat_span_t *span = (wat_span_t *) data;
+
+	wat_assert_return_void(span->cmd, "Command retry, but we do not have an active command?");
+
+	/* Armed first, a failed write brings it forward */
+	wat_sched_timer(span->sched, "command timeout", span->cmd->timeout, wat_cmd_timeout, (void*) span, &span->timeouts[WAT_TIMEOUT_CMD]);
+	wat_write_command(span);
+}
+
+/* The device refused the command being sent, time it out now instead of waiting for cmd->timeout */
+void wat_cmd_write_failed(wat_span_t *span)
+{
+	if (!span->cmd_busy || !span->cmd || span->cmd->answered == WAT_TRUE) {
+		return;
+	}
+
+	wat_sched_cancel_timer(span->sched, span->timeouts[WAT_TIMEOUT_CMD]);
+	wat_sched_timer(span->sched, "command write failed", 1, wat_cmd_timeout, (void*) span, &span->timeouts[WAT_TIMEOUT_CMD]);
 }
 
 WAT_SCHEDULED_FUNC(wat_scheduled_cnum)
 {
 	wat_span_t *span = (wat_span_t *) data;
-	wat_cmd_enqueue(span, "AT+CNUM", wat_response_cnum, NULL, span->config.timeout_command);
+	wat_cmd_enqueue_query(span, WAT_CMD_PRIO_POLL, "AT+CNUM", wat_response_cnum, NULL, span->config.timeout_command);
 }
 
 WAT_SCHEDULED_FUNC(wat_scheduled_clcc)
 {
 	wat_call_t *call = (wat_call_t *)data;
-	wat_cmd_enqueue(call->span, "AT+CLCC", wat_response_clcc, call, call->span->config.timeout_command);
+	wat_cmd_enqueue_coalesced(call->span, WAT_CMD_PRIO_CALL, "AT+CLCC", wat_response_clcc, call, call->span->config.timeout_command);
 }
 
 WAT_SCHEDULED_FUNC(wat_scheduled_csq)
 {
 	wat_span_t *span = (wat_span_t *)data;
-	wat_cmd_enqueue(span, "AT+CSQ", wat_response_csq, span, span->config.timeout_command);
+	wat_cmd_enqueue_query(span, WAT_CMD_PRIO_POLL, "AT+CSQ", wat_response_csq, span, span->config.timeout_command);
 
 	if (span->config.signal_poll_interval) {
-		wat_sched_timer(span->sched, "signal_monitor", span->config.signal_poll_interval, wat_scheduled_csq, (void*) span, NULL);
+		wat_sched_timer_slack(span->sched, "signal_monitor", span->config.signal_poll_interval, WAT_PERIODIC_TIMER_SLACK, wat_scheduled_csq, (void*) span, NULL);
 	}
 }
 
-char* format_at_data(char *dest, void *indata, wat_size_t len)
+char* format_at_data(char *dest, const void *indata, wat_size_t len)
 {
 	int i;
-	uint8_t *data = indata;
+	const uint8_t *data = indata;
 	char *p = dest;
 
 	for (i = 0; i < len; i++) {
@@ -28,6 +28,12 @@
 
 extern wat_event_handler_t event_handlers[];
 
+/* Schedule of the spans configured with shared_scheduler, created by the first of them to start.
+   Spans may be started and stopped from different threads, the mutex protects both */
+static wat_sched_t *g_shared_sched = NULL;
+static unsigned g_shared_sched_users = 0;
+static wat_mutex_t *g_shared_sched_mutex = NULL;
+
 static wat_status_t wat_span_perform_start(wat_span_t *span);
 static wat_status_t wat_span_perform_post_start(wat_span_t *span);
 static wat_status_t wat_span_perform_stop(wat_span_t *span);
@@ -35,6 +41,16 @@ static wat_status_t wat_span_perform_stop(wat_span_t *span);
 WAT_RESPONSE_FUNC(wat_response_post_start_complete);
 WAT_SCHEDULED_FUNC(wat_scheduled_wait_sim);
 
+/* Called from wat_register, may be called again when the library registers again */
+wat_status_t wat_span_global_init(void)
+{
+	if (!g_shared_sched_mutex && wat_mutex_create(&g_shared_sched_mutex) != WAT_SUCCESS) {
+		wat_log(WAT_LOG_CRIT, "Failed to create shared scheduler mutex\n");
+		return WAT_FAIL;
+	}
+	return WAT_SUCCESS;
+}
+
 /* Check for pending commands, and execute command if module is not cmd_busy */
 void wat_span_run_events(wat_span_t *span)
 {
@@ -64,24 +80,18 @@ void wat_span_run_cmds(wat_span_t *span)
 	wat_cmd_t *cmd = NULL;
 
 	if (!span->cmd_busy) {
-		if (span->cmd_next) {
-			/* Check if there are any priority command to be transmitted */
-			cmd = span->cmd_next;
-			span->cmd_next = NULL;
-		} else {
-			/* Check if there are any commands waiting to be transmitted */
-			cmd = wat_queue_dequeue(span->cmd_queue);
-		}
-		
+		/* Check if there are any commands waiting to be transmitted, highest priority first */
+		cmd = wat_cmd_dequeue(span);
+
 		if (cmd) {
 			if (cmd->cmd == NULL) {
 				/* This is a dummy command, just call the callback function */
 				wat_log_span(span, WAT_LOG_DEBUG, "Dequeuing dummy command %p\n", cmd->cb);
 				cmd->cb(span, NULL, WAT_SUCCESS, cmd->obj, NULL);
-				wat_safe_free(cmd);
+				wat_cmd_release(span, cmd);
 				return;
 			}
-			span->cmd = cmd;
+			/* wat_cmd_dequeue already made it span->cmd */
 			span->cmd_busy = 1;
 
 			if (span->config.debug_mask & WAT_DEBUG_AT_HANDLE) {
@@ -89,8 +99,9 @@ void wat_span_run_cmds(wat_span_t *span)
 				wat_log_span(span, WAT_LOG_DEBUG, "Dequeuing command %s\n", format_at_data(mydata, span->cmd->cmd, strlen(span->cmd->cmd)));
 			}
 
-			wat_write_command(span);
+			/* Armed first, a failed write brings it forward */
 			wat_sched_timer(span->sched, "command timeout", cmd->timeout, wat_cmd_timeout, (void*) span, &span->timeouts[WAT_TIMEOUT_CMD]);
+			wat_write_command(span);
 		}
 	}
 
@@ -163,22 +174,6 @@ wat_iterator_t *wat_span_get_call_iterator(const wat_span_t *span, wat_iterator_
 	return iter;
 }
 
-wat_iterator_t *wat_span_get_notify_iterator(const wat_span_t *span, wat_iterator_t *iter)
-{
-	if (!(iter = wat_get_iterator(WAT_ITERATOR_NOTIFYS, iter))) {
-		return NULL;
-	}
-	iter->index = 0;
-
-	if (!span->notifys[iter->index]) {
-		/* If the first element in the array is NULL, there are no elements in the array, return NULL */
-		wat_safe_free(iter);
-		return NULL;
-	}
-	iter->span = span;
-	return iter;
-}
-
 wat_iterator_t *wat_iterator_next(wat_iterator_t *iter)
 {
 	wat_assert_return(iter && iter->type, NULL, "Invalid iterator\n");
@@ -193,15 +188,6 @@ wat_iterator_t *wat_iterator_next(wat_iterator_t *iter)
 				}
 			}
 			return NULL;
-		case WAT_ITERATOR_NOTIFYS:
-			if (iter->index == iter->span->notify_count) {
-				return NULL;
-			}
-			iter->index++;
-			if (!iter->span->notifys[iter->index]) {
-				return NULL;
-			}
-			return iter;	
 		default:
 			break;
 	}
@@ -219,9 +205,6 @@ void *wat_iterator_current(wat_iterator_t *iter)
 			wat_assert_return(iter->index, NULL, "calls iterator index cannot be zero!\n");
 			wat_assert_return(iter->index <= wat_array_len(iter->span->calls), NULL, "channel iterator index bigger than calls size!\n");
 			return iter->span->calls[iter->index];
-		case WAT_ITERATOR_NOTIFYS:
-			wat_assert_return(iter->index <= iter->span->notify_count, NULL, "channel iterator index bigger than notify count!\n");
-			return iter->span->notifys[iter->index];
 		default:
 			break;
 	}
@@ -286,13 +269,13 @@ wat_status_t wat_span_update_sig_status(wat_span_t *span, wat_bool_t up)
 		span->module.handle_sig_status(span, up);
 	} else if (span->sigstatus == WAT_SIGSTATUS_UP) {
 		/* Get the Operator Name */
-		wat_cmd_enqueue(span, "AT+COPS?", wat_response_cops, NULL, 30000);
+		wat_cmd_enqueue_query(span, WAT_CMD_PRIO_NORMAL, "AT+COPS?", wat_response_cops, NULL, 30000);
 
 		/* Own Number */
-		wat_cmd_enqueue(span, "AT+CNUM", wat_response_cnum, NULL, 5000); /* Could not find timeout value for CNUM */
+		wat_cmd_enqueue_query(span, WAT_CMD_PRIO_NORMAL, "AT+CNUM", wat_response_cnum, NULL, 5000); /* Could not find timeout value for CNUM */
 
 		/* SMSC information */
-		wat_cmd_enqueue(span, "AT+CSCA?", wat_response_csca, NULL, 5000);
+		wat_cmd_enqueue_query(span, WAT_CMD_PRIO_NORMAL, "AT+CSCA?", wat_response_csca, NULL, 5000);
 	}
 
 	return WAT_SUCCESS;
@@ -400,10 +383,33 @@ void wat_decode_type_of_address(uint8_t octet, wat_number_type_t *type, wat_numb
 	return;
 }
 
+static const wat_cmd_section_t wat_start_batch[] = {
+	{ "+CMEE=1", NULL, NULL, 0 },
+	{ "+CRC=1", NULL, NULL, 0 },
+};
+
+static const wat_cmd_section_t wat_chip_info_batch[] = {
+	{ "+CGMM", wat_response_cgmm, NULL, 1 },	/* Module Model Identification */
+	{ "+CGMI", wat_response_cgmi, NULL, 1 },	/* Module Manufacturer Identification */
+	{ "+CGMR", wat_response_cgmr, NULL, 1 },	/* Module Revision Identification */
+	{ "+CGSN", wat_response_cgsn, NULL, 1 },	/* Module Serial Number */
+	{ "+CIMI", wat_response_cimi, NULL, 1 },	/* Module IMSI */
+};
+
 static wat_status_t wat_span_perform_start(wat_span_t *span)
 {
+	int i;
+	wat_status_t status;
+
 	memset(span->calls, 0, sizeof(span->calls));
-	memset(span->notifys, 0, sizeof(span->notifys));
+	span->notifys = NULL;
+	span->cmd_pool = NULL;
+	memset(&span->cmd_stats, 0, sizeof(span->cmd_stats));
+	if (wat_mutex_create(&span->cmd_mutex) != WAT_SUCCESS) {
+		wat_log_span(span, WAT_LOG_CRIT, "Failed to create command mutex\n");
+		return WAT_FAIL;
+	}
+	span->cmd_interval = span->config.cmd_interval;
 	memset(&span->net_info, 0, sizeof(span->net_info));
 	
 	if (wat_queue_create(&span->event_queue, WAT_EVENT_QUEUE_SZ) != WAT_SUCCESS) {
@@ -411,9 +417,11 @@ static wat_status_t wat_span_perform_start(wat_span_t *span)
 		return WAT_FAIL;
 	}
 
-	if (wat_queue_create(&span->cmd_queue, WAT_CMD_QUEUE_SZ) != WAT_SUCCESS) {
-		wat_log_span(span, WAT_LOG_CRIT, "Failed to create queue\n");
-		return WAT_FAIL;
+	for (i = 0; i < WAT_CMD_PRIO_SZ; i++) {
+		if (wat_queue_create(&span->cmd_queues[i], WAT_CMD_QUEUE_SZ) != WAT_SUCCESS) {
+			wat_log_span(span, WAT_LOG_CRIT, "Failed to create queue\n");
+			return WAT_FAIL;
+		}
 	}
 
 	if (wat_queue_create(&span->sms_queue, WAT_MAX_SMSS_PER_SPAN) != WAT_SUCCESS) {
@@ -421,12 +429,52 @@ static wat_status_t wat_span_perform_start(wat_span_t *span)
 		return WAT_FAIL;
 	}
 
-	if (wat_buffer_create(&span->buffer, WAT_BUFFER_SZ) != WAT_SUCCESS) {
+	if (span->config.lockfree_rx == WAT_TRUE) {
+		status = wat_buffer_create_lockfree(&span->buffer, WAT_BUFFER_SZ);
+	} else {
+		status = wat_buffer_create_mirrored(&span->buffer, WAT_BUFFER_SZ);
+	}
+
+	if (status != WAT_SUCCESS) {
 		wat_log_span(span, WAT_LOG_CRIT, "Failed to create buffer\n");
 		return WAT_FAIL;
 	}
+	wat_buffer_set_max_capacity(span->buffer, span->config.rx_buffer_max_size);
+	span->rx_refused_count = 0;
+	wat_tokenizer_reset(span);
+
+	if (wat_buffer_create_mirrored(&span->tx_buffer, WAT_TX_BUFFER_SZ) != WAT_SUCCESS) {
+		wat_log_span(span, WAT_LOG_CRIT, "Failed to create transmit buffer\n");
+		return WAT_FAIL;
+	}
+	span->want_write = 0;
 
-	if (wat_sched_create(&span->sched, "span_schedule") != WAT_SUCCESS) {
+	/* Every byte of the read buffer plus a NULL per token, the NULL of a line takes the place
+	   of its line feed so only a trailing '>' needs more. The buffer may be bigger than
+	   requested (i.e lock-free buffers are rounded up to a power of two) */
+	span->token_arena.size = span->buffer->max_capacity + WAT_TOKENS_SZ;
+	span->token_arena.data = wat_calloc(1, span->token_arena.size);
+	if (!span->token_arena.data) {
+		wat_log_span(span, WAT_LOG_CRIT, "Failed to create token arena\n");
+		return WAT_FAIL;
+	}
+	span->token_arena.used = 0;
+	if (wat_token_arena_grow(&span->token_arena) != WAT_SUCCESS) {
+		wat_log_span(span, WAT_LOG_CRIT, "Failed to create token list\n");
+		return WAT_FAIL;
+	}
+
+	if (span->config.shared_scheduler == WAT_TRUE) {
+		wat_mutex_lock(g_shared_sched_mutex);
+		if (!g_shared_sched && wat_sched_create(&g_shared_sched, "shared_schedule") != WAT_SUCCESS) {
+			wat_mutex_unlock(g_shared_sched_mutex);
+			wat_log_span(span, WAT_LOG_CRIT, "Failed to create shared scheduler\n");
+			return WAT_FAIL;
+		}
+		span->sched = g_shared_sched;
+		g_shared_sched_users++;
+		wat_mutex_unlock(g_shared_sched_mutex);
+	} else if (wat_sched_create(&span->sched, "span_schedule") != WAT_SUCCESS) {
 		wat_log_span(span, WAT_LOG_CRIT, "Failed to create scheduler\n");
 		return WAT_FAIL;
 	}
@@ -454,11 +502,8 @@ static wat_status_t wat_span_perform_start(wat_span_t *span)
 
 	wat_cmd_enqueue(span, "ATX4", NULL, NULL, span->config.timeout_command);
 
-	/* Enable Mobile Equipment Error Reporting, numeric mode */
-	wat_cmd_enqueue(span, "AT+CMEE=1", NULL, NULL, span->config.timeout_command);
-
-	/* Enable extended format reporting */
-	wat_cmd_enqueue(span, "AT+CRC=1", NULL, NULL, span->config.timeout_command);
+	/* Enable Mobile Equipment Error Reporting (numeric mode) and extended format reporting */
+	wat_cmd_enqueue_batch(span, wat_start_batch, wat_array_len(wat_start_batch), span->config.timeout_command);
 
 	if (wat_test_flag(&span->module, WAT_MODFLAG_IS_CDMA)) {
 		/* This is a CDMA module, no SIM here */
@@ -498,57 +543,68 @@ static wat_status_t wat_span_perform_post_start(wat_span_t *span)
 	span->module.set_codec(span, span->config.codec_mask);
 
 	/* Get some information about the chip */
-	
-	/* Get Module Model Identification */
-	wat_cmd_enqueue(span, "AT+CGMM", wat_response_cgmm, NULL, span->config.timeout_command);
-
-	/* Get Module Manufacturer Identification */
-	wat_cmd_enqueue(span, "AT+CGMI", wat_response_cgmi, NULL, span->config.timeout_command);
-
-	/* Get Module Revision Identification */
-	wat_cmd_enqueue(span, "AT+CGMR", wat_response_cgmr, NULL, span->config.timeout_command);
-
-	/* Get Module Serial Number */
-	wat_cmd_enqueue(span, "AT+CGSN", wat_response_cgsn, NULL, span->config.timeout_command);
-
-	/* Get Module IMSI */
-	wat_cmd_enqueue(span, "AT+CIMI", wat_response_cimi, NULL, span->config.timeout_command);
+	wat_cmd_enqueue_batch(span, wat_chip_info_batch, wat_array_len(wat_chip_info_batch), span->config.timeout_command);
 
 	/* Signal Quality */
-	wat_cmd_enqueue(span, "AT+CSQ", wat_response_csq, NULL, span->config.timeout_command);
+	wat_cmd_enqueue_query(span, WAT_CMD_PRIO_NORMAL, "AT+CSQ", wat_response_csq, NULL, span->config.timeout_command);
 	
 	/* Enable Network Registration Unsolicited result code */
 	wat_cmd_enqueue(span, "AT+CREG=1", NULL, NULL, span->config.timeout_command);
 
 	/* Check Registration Status in case module is already registered */
-	wat_cmd_enqueue(span, "AT+CREG?", wat_response_creg, NULL, span->config.timeout_command);
+	wat_cmd_enqueue_query(span, WAT_CMD_PRIO_NORMAL, "AT+CREG?", wat_response_creg, NULL, span->config.timeout_command);
 
 	wat_cmd_enqueue(span, NULL, wat_response_post_start_complete, NULL, 0);
 
-	wat_sched_timer(span->sched, "signal_monitor", span->config.signal_poll_interval, wat_scheduled_csq, (void*) span, NULL);
+	wat_sched_timer_slack(span->sched, "signal_monitor", span->config.signal_poll_interval, WAT_PERIODIC_TIMER_SLACK, wat_scheduled_csq, (void*) span, NULL);
 	return WAT_SUCCESS;
 }
 
 static wat_status_t wat_span_perform_stop(wat_span_t *span)
 {
-	wat_iterator_t *iter = NULL;
-	wat_iterator_t *curr = NULL;
+	int i;
+
+	/* Before the scheduler, and its wakeup fd, are destroyed */
+	wat_reactor_span_stopped(span);
 
 	span->module.shutdown(span);
 
-	wat_sched_destroy(&span->sched);
+	/* Learned from the module while running, asked again on the next start */
+	wat_clear_flag(&span->module, WAT_MODFLAG_CALL_PROGRESS_URC);
+
+	if (span->config.shared_scheduler == WAT_TRUE) {
+		/* Timers only ever carry the span or one of its calls */
+		wat_sched_cancel_timers_by_data(span->sched, span);
+		for (i = 0; i < wat_array_len(span->calls); i++) {
+			if (span->calls[i]) {
+				wat_sched_cancel_timers_by_data(span->sched, span->calls[i]);
+			}
+		}
+		span->sched = NULL;
+		wat_mutex_lock(g_shared_sched_mutex);
+		if (!--g_shared_sched_users) {
+			wat_sched_destroy(&g_shared_sched);
+		}
+		wat_mutex_unlock(g_shared_sched_mutex);
+	} else {
+		wat_sched_destroy(&span->sched);
+	}
 	wat_buffer_destroy(&span->buffer);
+	wat_buffer_destroy(&span->tx_buffer);
+	wat_safe_free(span->token_arena.data);
+	wat_safe_free(span->token_arena.spans);
+	wat_safe_free(span->token_arena.tokens);
+	span->token_arena.capacity = 0;
+	span->token_arena.size = 0;
 	wat_queue_destroy(&span->sms_queue);
 	wat_queue_destroy(&span->event_queue);
-	wat_queue_destroy(&span->cmd_queue);
-
-	iter = wat_span_get_notify_iterator(span, iter);
-	for (curr = iter; curr; curr = wat_iterator_next(curr)) {
-		wat_notify_t *notify = wat_iterator_current(curr);
-		wat_safe_free(notify->prefix);
-		wat_safe_free(notify);
+	wat_cmd_flush_all(span);
+	for (i = 0; i < WAT_CMD_PRIO_SZ; i++) {
+		wat_queue_destroy(&span->cmd_queues[i]);
 	}
-	wat_iterator_free(iter);
+	wat_mutex_destroy(&span->cmd_mutex);
+
+	wat_cmd_unregister_all(span);
 	return WAT_SUCCESS;
 }
 
@@ -626,6 +682,10 @@ wat_status_t _wat_span_set_state(const char *func, int line, wat_span_t *span, w
 
 	if (status == WAT_SUCCESS) {
 		span->state = new_state;
+		if (new_state == WAT_SPAN_STATE_START) {
+			/* The scheduler and its wakeup fd are new on every start */
+			wat_reactor_span_started(span);
+		}
 	}
 	return status;
 }
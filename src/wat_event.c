@@ -53,6 +53,9 @@ wat_status_t wat_event_enqueue(wat_span_t *span, wat_event_t *in_event)
 		wat_assert("Failed to enqueue new event\n");
 		return WAT_FAIL;
 	}
+	if (span->sched) {
+		wat_sched_wakeup(span->sched);
+	}
 	return WAT_SUCCESS;
 }
 
@@ -123,6 +123,32 @@ done:
 	return obj;
 }
 
+/* Returns the oldest queued object for which match returns WAT_TRUE, the object stays in the queue */
+void *wat_queue_find(wat_queue_t *queue, wat_queue_match_func match, void *data)
+{
+	void *obj = NULL;
+	uint32_t index;
+	uint32_t i;
+
+	wat_assert_return(queue, NULL, "Queue is null!");
+	wat_mutex_lock(queue->mutex);
+
+	index = queue->rindex;
+	for (i = 0; i < queue->size; i++) {
+		if (index == queue->capacity) {
+			index = 0;
+		}
+		if (match(queue->elements[index], data) == WAT_TRUE) {
+			obj = queue->elements[index];
+			break;
+		}
+		index++;
+	}
+
+	wat_mutex_unlock(queue->mutex);
+	return obj;
+}
+
 wat_status_t wat_queue_destroy(wat_queue_t **inqueue)
 {
 	wat_queue_t *queue = NULL;
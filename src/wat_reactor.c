@@ -0,0 +1,415 @@
+/*
+ * libwat: Wireless AT commands library
+ *
+ * David Yat Sin <dyatsin@sangoma.com>
+ * Copyright (C) 2011, Sangoma Technologies.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+
+/* Optional I/O mode where libwat is given the span file descriptors and services
+   all the spans from a single thread, instead of the application running one
+   poll/wat_span_schedule_next/wat_span_run loop per span. Writes that the device
+   does not accept right away are resumed when it becomes writable.
+   All the reactor functions must be called from the same thread */
+
+#include "libwat.h"
+#include "wat_internal.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+/* Set in the epoll data of the span wakeup fds, next to the span id */
+#define WAT_REACTOR_WAKEUP 0x100
+
+#define WAT_REACTOR_READ_SZ 1024
+
+typedef struct wat_reactor {
+	int epfd;
+	unsigned span_count;
+	int fds[WAT_MAX_SPANS];
+	int wakeup_fds[WAT_MAX_SPANS];		/* Span wakeup fd, -1 to compute the poll timeout instead */
+	uint8_t registered[WAT_MAX_SPANS];
+	uint8_t polled[WAT_MAX_SPANS];		/* The device fd is in the epoll set */
+	uint32_t events[WAT_MAX_SPANS];		/* Events we are waiting for on the device fd */
+	uint8_t rx_full[WAT_MAX_SPANS];		/* The read buffer is full (back-pressure), the device is not read until the span runs */
+} wat_reactor_t;
+
+static wat_reactor_t g_reactor = { .epfd = -1 };
+
+/* Spans stay in the reactor while stopped, until they are removed or started again */
+static wat_bool_t wat_reactor_span_running(uint8_t span_id)
+{
+	wat_span_t *span = wat_get_span(span_id);
+
+	if (span->state < WAT_SPAN_STATE_START || span->state >= WAT_SPAN_STATE_STOP) {
+		return WAT_FALSE;
+	}
+	return WAT_TRUE;
+}
+
+/* Lets the span wake us up for its timers and pending work, we fall back to
+   computing the poll timeout on each run if it has no wakeup fd */
+static void wat_reactor_add_wakeup(wat_span_t *span)
+{
+	struct epoll_event event;
+	int wakeup_fd;
+
+	g_reactor.wakeup_fds[span->id] = -1;
+	if (wat_reactor_span_running(span->id) == WAT_FALSE) {
+		return;
+	}
+
+	wakeup_fd = wat_span_get_wakeup_fd(span->id);
+	if (wakeup_fd < 0) {
+		return;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u32 = span->id | WAT_REACTOR_WAKEUP;
+	if (epoll_ctl(g_reactor.epfd, EPOLL_CTL_ADD, wakeup_fd, &event) < 0) {
+		wat_log_span(span, WAT_LOG_WARNING, "Failed to add wakeup fd %d to reactor (%s)\n", wakeup_fd, strerror(errno));
+		return;
+	}
+	g_reactor.wakeup_fds[span->id] = wakeup_fd;
+}
+
+static void wat_reactor_del_wakeup(wat_span_t *span)
+{
+	if (g_reactor.wakeup_fds[span->id] < 0) {
+		return;
+	}
+	epoll_ctl(g_reactor.epfd, EPOLL_CTL_DEL, g_reactor.wakeup_fds[span->id], NULL);
+	g_reactor.wakeup_fds[span->id] = -1;
+}
+
+/* The device fd is only polled while the span runs, a stopped span has no buffers to read into */
+static wat_status_t wat_reactor_add_device(wat_span_t *span)
+{
+	struct epoll_event event;
+
+	if (wat_reactor_span_running(span->id) == WAT_FALSE) {
+		return WAT_SUCCESS;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u32 = span->id;
+	if (epoll_ctl(g_reactor.epfd, EPOLL_CTL_ADD, g_reactor.fds[span->id], &event) < 0) {
+		wat_log_span(span, WAT_LOG_ERROR, "Failed to add fd %d to reactor (%s)\n", g_reactor.fds[span->id], strerror(errno));
+		return WAT_FAIL;
+	}
+	g_reactor.polled[span->id] = 1;
+	g_reactor.events[span->id] = EPOLLIN;
+	g_reactor.rx_full[span->id] = 0;
+	if (span->alarm == WAT_ALARM_DEVICE_FAIL) {
+		wat_span_update_alarm_status(span, WAT_ALARM_NONE);
+	}
+	return WAT_SUCCESS;
+}
+
+static void wat_reactor_del_device(wat_span_t *span)
+{
+	g_reactor.rx_full[span->id] = 0;
+	if (!g_reactor.polled[span->id]) {
+		return;
+	}
+	epoll_ctl(g_reactor.epfd, EPOLL_CTL_DEL, g_reactor.fds[span->id], NULL);
+	g_reactor.polled[span->id] = 0;
+}
+
+/* The device will not give us anything else, stop polling it so the reactor does not spin
+   on the hangup. It is polled again when the span restarts or is added back */
+static void wat_reactor_hangup(wat_span_t *span, const char *reason)
+{
+	wat_log_span(span, WAT_LOG_ERROR, "Lost device fd %d (%s)\n", g_reactor.fds[span->id], reason);
+	wat_reactor_del_device(span);
+	wat_span_update_alarm_status(span, WAT_ALARM_DEVICE_FAIL);
+}
+
+/* Received data is read straight into the free space of the span read buffer. When the
+   buffer is full, back-pressure stops reading the device until the span runs, the other
+   policies read it anyway and let wat_span_process_read grow the buffer or drop the data */
+static void wat_reactor_read(wat_span_t *span, int fd)
+{
+	uint8_t scratch[WAT_REACTOR_READ_SZ];
+	uint8_t *data;
+	wat_size_t len;
+	ssize_t res;
+
+	if (wat_buffer_reserve(span->buffer, &data, &len) != WAT_SUCCESS) {
+		if (span->config.rx_buffer_policy == WAT_BUFFER_POLICY_BACKPRESSURE) {
+			span->rx_refused_count++;
+			g_reactor.rx_full[span->id] = 1;
+			return;
+		}
+		data = scratch;
+		len = sizeof(scratch);
+	}
+
+	res = read(fd, data, len);
+	if (res < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			wat_reactor_hangup(span, strerror(errno));
+		}
+		return;
+	}
+	if (!res) {
+		wat_reactor_hangup(span, "end of file");
+		return;
+	}
+
+	if (data == scratch) {
+		wat_span_process_read(span->id, scratch, res);
+		return;
+	}
+
+	if (span->config.debug_mask & WAT_DEBUG_UART_RAW) {
+		char mydata[WAT_MAX_CMD_SZ];
+		wat_log_span(span, WAT_LOG_DEBUG, "[RX RAW] %s (len:%d)\n", format_at_data(mydata, data, res), res);
+	}
+	wat_buffer_commit(span->buffer, res);
+}
+
+/* Once the span consumed some of its read buffer, the device can be read again */
+static void wat_reactor_check_rx(wat_span_t *span)
+{
+	uint8_t *data;
+	wat_size_t len;
+
+	if (g_reactor.rx_full[span->id] && wat_buffer_reserve(span->buffer, &data, &len) == WAT_SUCCESS) {
+		g_reactor.rx_full[span->id] = 0;
+	}
+}
+
+void wat_reactor_span_started(wat_span_t *span)
+{
+	if (g_reactor.registered[span->id]) {
+		wat_reactor_add_device(span);
+		wat_reactor_add_wakeup(span);
+	}
+}
+
+void wat_reactor_span_stopped(wat_span_t *span)
+{
+	if (g_reactor.registered[span->id]) {
+		wat_reactor_del_device(span);
+		wat_reactor_del_wakeup(span);
+	}
+}
+
+/* Only wait for the device to be writable while the span has data it could not write, and
+   for it to be readable while the span is not refusing data */
+static void wat_reactor_update_events(uint8_t span_id)
+{
+	struct epoll_event event;
+	uint32_t events = 0;
+
+	if (!g_reactor.polled[span_id]) {
+		return;
+	}
+	if (!g_reactor.rx_full[span_id]) {
+		events |= EPOLLIN;
+	}
+	if (wat_span_want_write(span_id) == WAT_TRUE) {
+		events |= EPOLLOUT;
+	}
+	if (events == g_reactor.events[span_id]) {
+		return;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.u32 = span_id;
+
+	if (epoll_ctl(g_reactor.epfd, EPOLL_CTL_MOD, g_reactor.fds[span_id], &event) < 0) {
+		wat_log(WAT_LOG_ERROR, "[span:%d] Failed to update reactor events (%s)\n", span_id, strerror(errno));
+		return;
+	}
+	g_reactor.events[span_id] = events;
+}
+
+WAT_DECLARE(wat_status_t) wat_reactor_add_span(uint8_t span_id, int fd)
+{
+	wat_span_t *span;
+
+	span = wat_get_span(span_id);
+	wat_assert_return(span, WAT_FAIL, "Invalid span");
+
+	if (g_reactor.registered[span_id]) {
+		wat_log_span(span, WAT_LOG_ERROR, "Span is already in the reactor\n");
+		return WAT_FAIL;
+	}
+
+	if (g_reactor.epfd < 0) {
+		g_reactor.epfd = epoll_create(WAT_MAX_SPANS);
+		if (g_reactor.epfd < 0) {
+			wat_log(WAT_LOG_CRIT, "Failed to create reactor (%s)\n", strerror(errno));
+			return WAT_FAIL;
+		}
+	}
+
+	/* Spans not started yet are polled from wat_reactor_span_started */
+	g_reactor.fds[span_id] = fd;
+	if (wat_reactor_add_device(span) != WAT_SUCCESS) {
+		return WAT_FAIL;
+	}
+	wat_reactor_add_wakeup(span);
+
+	g_reactor.registered[span_id] = 1;
+	g_reactor.span_count++;
+	return WAT_SUCCESS;
+}
+
+WAT_DECLARE(wat_status_t) wat_reactor_remove_span(uint8_t span_id)
+{
+	wat_span_t *span;
+
+	span = wat_get_span(span_id);
+	wat_assert_return(span, WAT_FAIL, "Invalid span");
+
+	if (!g_reactor.registered[span_id]) {
+		wat_log_span(span, WAT_LOG_ERROR, "Span is not in the reactor\n");
+		return WAT_FAIL;
+	}
+
+	wat_reactor_del_device(span);
+	wat_reactor_del_wakeup(span);
+
+	g_reactor.registered[span_id] = 0;
+	g_reactor.span_count--;
+
+	if (!g_reactor.span_count) {
+		close(g_reactor.epfd);
+		g_reactor.epfd = -1;
+	}
+	return WAT_SUCCESS;
+}
+
+/* Waits for at most timeout_ms (-1 to wait forever) or until the next span timer expires,
+   then runs the spans that received data or have work pending. Spans with a wakeup fd
+   tell the reactor themselves, others have their poll timeout computed on each run */
+WAT_DECLARE(wat_status_t) wat_reactor_run(int32_t timeout_ms)
+{
+	struct epoll_event events[WAT_MAX_SPANS];
+	uint8_t ready[WAT_MAX_SPANS];
+	int32_t timeout = timeout_ms;
+	int num_events;
+	int i;
+
+	wat_assert_return(g_reactor.epfd >= 0, WAT_FAIL, "No spans in reactor");
+
+	for (i = 0; i < WAT_MAX_SPANS; i++) {
+		if (g_reactor.registered[i] && g_reactor.wakeup_fds[i] < 0 && wat_reactor_span_running(i) == WAT_TRUE) {
+			int32_t next = (int32_t)wat_span_schedule_next(i);
+			if (next >= 0 && (timeout < 0 || next < timeout)) {
+				timeout = next;
+			}
+		}
+	}
+
+	num_events = epoll_wait(g_reactor.epfd, events, wat_array_len(events), timeout);
+	if (num_events < 0) {
+		if (errno == EINTR) {
+			return WAT_SUCCESS;
+		}
+		wat_log(WAT_LOG_ERROR, "Failed to wait for reactor events (%s)\n", strerror(errno));
+		return WAT_FAIL;
+	}
+
+	memset(ready, 0, sizeof(ready));
+	for (i = 0; i < num_events; i++) {
+		uint8_t span_id = events[i].data.u32 & ~WAT_REACTOR_WAKEUP;
+
+		if (!g_reactor.registered[span_id]) {
+			continue;
+		}
+
+		if (events[i].data.u32 & WAT_REACTOR_WAKEUP) {
+			/* wat_span_run consumes the wakeup */
+			ready[span_id] = 1;
+			continue;
+		}
+
+		if (events[i].events & EPOLLOUT) {
+			wat_span_process_write(span_id);
+		}
+
+		if (events[i].events & EPOLLIN) {
+			/* Whatever is left before a hangup is read first, the read then sees the end of file */
+			wat_reactor_read(wat_get_span(span_id), g_reactor.fds[span_id]);
+			ready[span_id] = 1;
+		} else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+			wat_reactor_hangup(wat_get_span(span_id), (events[i].events & EPOLLERR) ? "error" : "hangup");
+			ready[span_id] = 1;
+		}
+	}
+
+	for (i = 0; i < WAT_MAX_SPANS; i++) {
+		if (!g_reactor.registered[i] || wat_reactor_span_running(i) == WAT_FALSE) {
+			continue;
+		}
+		if (ready[i] || (g_reactor.wakeup_fds[i] < 0 && !wat_span_schedule_next(i))) {
+			wat_span_run(i);
+		}
+		wat_reactor_check_rx(wat_get_span(i));
+		wat_reactor_update_events(i);
+	}
+	return WAT_SUCCESS;
+}
+
+#else
+
+void wat_reactor_span_started(wat_span_t *span)
+{
+}
+
+void wat_reactor_span_stopped(wat_span_t *span)
+{
+}
+
+WAT_DECLARE(wat_status_t) wat_reactor_add_span(uint8_t span_id, int fd)
+{
+	wat_log(WAT_LOG_ERROR, "Reactor is not supported on this platform\n");
+	return WAT_FAIL;
+}
+
+WAT_DECLARE(wat_status_t) wat_reactor_remove_span(uint8_t span_id)
+{
+	return WAT_FAIL;
+}
+
+WAT_DECLARE(wat_status_t) wat_reactor_run(int32_t timeout_ms)
+{
+	return WAT_FAIL;
+}
+
+#endif
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4:
+ */
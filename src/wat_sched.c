@@ -20,65 +20,214 @@
  * Contributors:
  *
  */
-#include <sys/time.h>
+#include <time.h>
 #include "wat_internal.h"
 
-#ifdef __WINDOWS__
-struct wat_timezone {
-    int tz_minuteswest;         /* minutes W of Greenwich */
-    int tz_dsttime;             /* type of dst correction */
-};
-int gettimeofday(struct timeval *tv, struct wat_timezone *tz)
-{
-    FILETIME ft;
-    unsigned __int64 tmpres = 0;
-    static int tzflag;
-    if (NULL != tv) {
-        GetSystemTimeAsFileTime(&ft);
-        tmpres |= ft.dwHighDateTime;
-        tmpres <<= 32;
-        tmpres |= ft.dwLowDateTime;
-
-        /*converting file time to unix epoch */
-        tmpres /= 10;           /*convert into microseconds */
-        tmpres -= DELTA_EPOCH_IN_MICROSECS;
-        tv->tv_sec = (long) (tmpres / 1000000UL);
-        tv->tv_usec = (long) (tmpres % 1000000UL);
-    }
-    if (NULL != tz) {
-        if (!tzflag) {
-            _tzset();
-            tzflag++;
-        }
-        tz->tz_minuteswest = _timezone / 60;
-        tz->tz_dsttime = _daylight;
-    }
-    return 0;
-}
-#endif /* __WINDOWS__ */
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#endif
+
+static uint64_t wat_sched_monotonic_ms(void);
+
+/* Clock used by all the schedules, only replaced by tests */
+static wat_sched_clock_t sched_clock = wat_sched_monotonic_ms;
 
 typedef struct wat_timer wat_timer_t;
 
+#define WAT_SCHED_MIN_TIMERS 16
+
+/* heap_index of a timer slot that is not in use */
+#define WAT_TIMER_FREE 0xFFFFFFFF
+
+/* A timer id carries the slot of the timer in the low 32 bits (plus one, so 0 is never a
+   valid id) and the generation of the slot in the high 32 bits. The generation changes every
+   time the slot is released, so a stale id never matches a timer that reused the slot */
+#define WAT_TIMER_ID(slot, generation) ((((wat_timer_id_t) (generation)) << 32) | ((slot) + 1))
+#define WAT_TIMER_ID_SLOT(id) ((uint32_t) ((id) & 0xFFFFFFFF) - 1)
+#define WAT_TIMER_ID_GENERATION(id) ((uint32_t) ((id) >> 32))
+
+/* Timer nodes are preallocated in the timers array and recycled through a free list, the
+   heap holds the slots of the armed timers ordered by expiration time, the next timer to
+   expire is always heap[0] */
 struct wat_sched {
 	char name[80];
-	wat_timer_id_t currid;
 	wat_mutex_t *mutex;
-	wat_timer_t *timers;
+	wat_timer_t *timers;		/* Timer nodes, indexed by slot */
+	uint32_t *heap;				/* Slots of the armed timers */
+	uint32_t heap_len;			/* Number of armed timers */
+	uint32_t size;				/* Number of slots in the timers and heap arrays */
+	uint32_t free_slot;			/* First unused slot, WAT_TIMER_FREE if all are in use */
+	int fd;						/* timerfd following the earliest timer, -1 until requested */
+	uint64_t fd_armed;			/* Expiration the fd is armed for, 0 if disarmed */
+	wat_bool_t fd_wakeup;		/* The fd must stay readable until wat_sched_clear_fd */
 	int freerun;
 	wat_sched_t *next;
 	wat_sched_t *prev;
 };
 
 struct wat_timer {
-	char name[80];
-	wat_timer_id_t id;
-	struct timeval time;
+	const char *name;			/* Static string, not copied */
+	uint32_t generation;
+	uint32_t heap_index;		/* Position of the timer in the heap, WAT_TIMER_FREE if unused */
+	uint32_t next_free;			/* Next unused slot while in the free list */
+	uint64_t expires;			/* Expiration time in milliseconds, on the scheduler clock */
 	void *usrdata;
 	wat_sched_callback_t callback;
-	wat_timer_t *next;
-	wat_timer_t *prev;
 };
 
+static int timer_before(const wat_sched_t *sched, uint32_t a, uint32_t b)
+{
+	return sched->timers[a].expires < sched->timers[b].expires;
+}
+
+static void heap_set(wat_sched_t *sched, uint32_t index, uint32_t slot)
+{
+	sched->heap[index] = slot;
+	sched->timers[slot].heap_index = index;
+}
+
+static void heap_sift_up(wat_sched_t *sched, uint32_t index)
+{
+	uint32_t slot = sched->heap[index];
+
+	while (index > 0) {
+		uint32_t parent = (index - 1) / 2;
+		if (!timer_before(sched, slot, sched->heap[parent])) {
+			break;
+		}
+		heap_set(sched, index, sched->heap[parent]);
+		index = parent;
+	}
+	heap_set(sched, index, slot);
+}
+
+static void heap_sift_down(wat_sched_t *sched, uint32_t index)
+{
+	uint32_t slot = sched->heap[index];
+
+	while (1) {
+		uint32_t child = (2 * index) + 1;
+		if (child >= sched->heap_len) {
+			break;
+		}
+		if (child + 1 < sched->heap_len && timer_before(sched, sched->heap[child + 1], sched->heap[child])) {
+			child++;
+		}
+		if (!timer_before(sched, sched->heap[child], slot)) {
+			break;
+		}
+		heap_set(sched, index, sched->heap[child]);
+		index = child;
+	}
+	heap_set(sched, index, slot);
+}
+
+/* Takes the timer out of the heap, the schedule must be already locked */
+static void heap_remove(wat_sched_t *sched, uint32_t slot)
+{
+	uint32_t index = sched->timers[slot].heap_index;
+	uint32_t last = sched->heap[--sched->heap_len];
+
+	if (last == slot) {
+		return;
+	}
+
+	/* Move the last timer in the hole, then restore the heap order from there */
+	heap_set(sched, index, last);
+	if (index > 0 && timer_before(sched, last, sched->heap[(index - 1) / 2])) {
+		heap_sift_up(sched, index);
+	} else {
+		heap_sift_down(sched, index);
+	}
+}
+
+/* Double the number of slots, nodes are addressed by slot only so they can move.
+ * The schedule must be already locked */
+static wat_status_t timers_grow(wat_sched_t *sched)
+{
+	uint32_t i;
+	uint32_t size = sched->size ? (sched->size * 2) : WAT_SCHED_MIN_TIMERS;
+	wat_timer_t *timers;
+	uint32_t *heap;
+
+	timers = wat_calloc(size, sizeof(*timers));
+	heap = wat_malloc(size * sizeof(*heap));
+	if (!timers || !heap) {
+		wat_safe_free(timers);
+		wat_safe_free(heap);
+		return WAT_ENOMEM;
+	}
+
+	if (sched->size) {
+		memcpy(timers, sched->timers, sched->size * sizeof(*timers));
+		memcpy(heap, sched->heap, sched->heap_len * sizeof(*heap));
+	}
+
+	/* Chain the new slots in front of the free list */
+	for (i = sched->size; i < size; i++) {
+		timers[i].heap_index = WAT_TIMER_FREE;
+		timers[i].next_free = (i + 1 < size) ? (i + 1) : sched->free_slot;
+	}
+	sched->free_slot = sched->size;
+
+	wat_safe_free(sched->timers);
+	wat_safe_free(sched->heap);
+	sched->timers = timers;
+	sched->heap = heap;
+	sched->size = size;
+	return WAT_SUCCESS;
+}
+
+/* Put the slot back in the free list, the timer must be out of the heap already.
+ * The schedule must be already locked */
+static void timer_release(wat_sched_t *sched, uint32_t slot)
+{
+	wat_timer_t *timer = &sched->timers[slot];
+
+	timer->generation++;
+	timer->heap_index = WAT_TIMER_FREE;
+	timer->callback = NULL;
+	timer->usrdata = NULL;
+	timer->next_free = sched->free_slot;
+	sched->free_slot = slot;
+}
+
+/* Arm the fd for the earliest timer, only when it changed. The schedule must be already locked */
+static void sched_arm_fd(wat_sched_t *sched)
+{
+#ifdef __linux__
+	struct itimerspec its;
+	uint64_t expires = 0;
+
+	if (sched->fd < 0) {
+		return;
+	}
+
+	if (sched->fd_wakeup) {
+		/* Any absolute time in the past expires right away */
+		expires = 1;
+	} else if (sched->heap_len) {
+		expires = sched->timers[sched->heap[0]].expires;
+	}
+
+	if (expires == sched->fd_armed) {
+		return;
+	}
+
+	/* A zero value disarms the fd */
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = expires / 1000;
+	its.it_value.tv_nsec = (expires % 1000) * 1000000;
+	if (timerfd_settime(sched->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		wat_log(WAT_LOG_ERROR, "Failed to arm timer fd for sched %s (%s)\n", sched->name, strerror(errno));
+		return;
+	}
+	sched->fd_armed = expires;
+#endif
+}
+
 WAT_DECLARE(wat_status_t) wat_sched_create(wat_sched_t **sched, const char *name)
 {
 	wat_sched_t *newsched = NULL;
@@ -98,7 +247,8 @@ WAT_DECLARE(wat_status_t) wat_sched_create(wat_sched_t **sched, const char *name
 	}
 
 	strncpy(newsched->name, name, sizeof(newsched->name)-1);
-	newsched->currid = 1;
+	newsched->free_slot = WAT_TIMER_FREE;
+	newsched->fd = -1;
 
 	*sched = newsched;
 	wat_log(WAT_LOG_DEBUG, "Created schedule %s\n", name);
@@ -120,68 +270,46 @@ WAT_DECLARE(wat_status_t) wat_sched_run(wat_sched_t *sched)
 {
 	wat_status_t status = WAT_FAIL;
 	wat_timer_t *runtimer;
-	wat_timer_t *timer;
+	uint32_t slot;
 	wat_sched_callback_t callback;
-	int ms = 0;
-	int rc = -1;
 	void *data;
-	struct timeval now;
+	uint64_t now;
 
 	wat_assert_return(sched != NULL, WAT_EINVAL, "sched is null!\n");
 
-tryagain:
+	/* one clock read per run, timers armed by the callbacks expire in the future anyway */
+	now = sched_clock();
 
 	wat_mutex_lock(sched->mutex);
 
-	rc = gettimeofday(&now, NULL);
-	if (rc == -1) {
-		wat_log(WAT_LOG_ERROR, "Failed to retrieve time of day\n");
-		goto done;
-	}
+	while (sched->heap_len) {
+		slot = sched->heap[0];
+		runtimer = &sched->timers[slot];
 
-	timer = sched->timers;
-	while (timer) {
-		runtimer = timer;
-		timer = runtimer->next;
-
-		ms = ((runtimer->time.tv_sec - now.tv_sec) * 1000) +
-		     ((runtimer->time.tv_usec - now.tv_usec) / 1000);
-
-		if (ms <= 0) {
-
-			if (runtimer == sched->timers) {
-				sched->timers = runtimer->next;
-				if (sched->timers) {
-					sched->timers->prev = NULL;
-				}
-			}
-
-			callback = runtimer->callback;
-			data = runtimer->usrdata;
-			if (runtimer->next) {
-				runtimer->next->prev = runtimer->prev;
-			}
-			if (runtimer->prev) {
-				runtimer->prev->next = runtimer->next;
-			}
-
-			runtimer->id = 0;
-			wat_safe_free(runtimer);
-
-			/* avoid deadlocks by releasing the sched lock before triggering callbacks */
-			wat_mutex_unlock(sched->mutex);
-
-			callback(data);
-			/* after calling a callback we must start the scanning again since the
-			 * callback or some other thread may have added or cancelled timers to 
-			 * the linked list */
-			goto tryagain;
+		if (runtimer->expires > now) {
+			/* The earliest timer did not expire yet, neither did the others */
+			break;
 		}
+
+		callback = runtimer->callback;
+		data = runtimer->usrdata;
+
+		heap_remove(sched, slot);
+		timer_release(sched, slot);
+
+		/* avoid deadlocks by releasing the sched lock before triggering callbacks,
+		 * the callback or some other thread may add or cancel timers meanwhile, the heap
+		 * stays ordered so we just look at the earliest timer again */
+		wat_mutex_unlock(sched->mutex);
+
+		callback(data);
+
+		wat_mutex_lock(sched->mutex);
 	}
 
-	status = WAT_SUCCESS;
+	sched_arm_fd(sched);
 
-done:
+	status = WAT_SUCCESS;
 
 	wat_mutex_unlock(sched->mutex);
 #ifdef __WINDOWS__
@@ -193,66 +321,60 @@ done:
 
 WAT_DECLARE(wat_status_t) wat_sched_timer(wat_sched_t *sched, const char *name,
 		int ms, wat_sched_callback_t callback, void *data, wat_timer_id_t *timerid)
+{
+	return wat_sched_timer_slack(sched, name, ms, 0, callback, data, timerid);
+}
+
+WAT_DECLARE(wat_status_t) wat_sched_timer_slack(wat_sched_t *sched, const char *name,
+		int ms, int slack, wat_sched_callback_t callback, void *data, wat_timer_id_t *timerid)
 {
 	wat_status_t status = WAT_FAIL;
-	struct timeval now;
-	int rc = 0;
+	uint64_t now;
+	uint32_t slot;
 	wat_timer_t *newtimer;
 
 	wat_assert_return(sched != NULL, WAT_EINVAL, "sched is null!\n");
 	wat_assert_return(name != NULL, WAT_EINVAL, "timer name is null!\n");
 	wat_assert_return(callback != NULL, WAT_EINVAL, "sched callback is null!\n");
 	wat_assert_return(ms > 0, WAT_EINVAL, "milliseconds must be bigger than 0!\n");
+	wat_assert_return(slack >= 0, WAT_EINVAL, "slack cannot be negative!\n");
 
 	if (timerid) {
 		*timerid = 0;
 	}
 
-	rc = gettimeofday(&now, NULL);
-	if (rc == -1) {
-		wat_log(WAT_LOG_ERROR, "Failed to retrieve time of day\n");
-		return WAT_FAIL;
-	}
+	now = sched_clock();
 
 	wat_mutex_lock(sched->mutex);
 
-	newtimer = wat_calloc(1, sizeof(*newtimer));
-	if (!newtimer) {
+	if (sched->free_slot == WAT_TIMER_FREE && timers_grow(sched) != WAT_SUCCESS) {
+		wat_log(WAT_LOG_CRIT, "Failed to grow timers for sched %s\n", sched->name);
 		goto done;
 	}
-	newtimer->id = sched->currid;
-	sched->currid++;
-	if (!sched->currid) {
-		wat_log(WAT_LOG_NOTICE, "Timer id wrap around for sched %s\n", sched->name);
-		/* we do not want currid to be zero since is an invalid id 
-		 * TODO: check that currid does not exists already in the context, it'd be insane
-		 * though, having a timer to live all that time */
-		sched->currid++;
-	}
 
-	strncpy(newtimer->name, name, sizeof(newtimer->name)-1);
+	slot = sched->free_slot;
+	newtimer = &sched->timers[slot];
+	sched->free_slot = newtimer->next_free;
+
+	newtimer->name = name;
 	newtimer->callback = callback;
 	newtimer->usrdata = data;
-
-	newtimer->time.tv_sec = now.tv_sec + (ms / 1000);
-	newtimer->time.tv_usec = now.tv_usec + (ms % 1000) * 1000;
-	if (newtimer->time.tv_usec >= WAT_MICROSECONDS_PER_SECOND) {
-		newtimer->time.tv_sec += 1;
-		newtimer->time.tv_usec -= WAT_MICROSECONDS_PER_SECOND;
+	newtimer->expires = now + ms;
+	if (slack > 1) {
+		/* Round up to the next multiple of the slack, all the schedules share the same clock
+		   so timers with the same slack expire together and cost a single wakeup */
+		newtimer->expires = ((newtimer->expires + slack - 1) / slack) * slack;
 	}
 
-	if (!sched->timers) {
-		sched->timers = newtimer;
-	}  else {
-		newtimer->next = sched->timers;
-		sched->timers->prev = newtimer;
-		sched->timers = newtimer;
-	}
+	heap_set(sched, sched->heap_len++, slot);
+	heap_sift_up(sched, newtimer->heap_index);
 
 	if (timerid) {
-		*timerid = newtimer->id;
+		*timerid = WAT_TIMER_ID(slot, newtimer->generation);
 	}
 
+	sched_arm_fd(sched);
+
 	status = WAT_SUCCESS;
 done:
 
@@ -261,6 +383,7 @@ done:
 	UNREFERENCED_PARAMETER(sched);
 	UNREFERENCED_PARAMETER(name);
 	UNREFERENCED_PARAMETER(ms);
+	UNREFERENCED_PARAMETER(slack);
 	UNREFERENCED_PARAMETER(callback);
 	UNREFERENCED_PARAMETER(data);
 	UNREFERENCED_PARAMETER(timerid);
@@ -268,87 +391,127 @@ done:
 	return status;
 }
 
+/* Milliseconds since some unspecified point, never affected by changes of the wall clock */
+static uint64_t wat_sched_monotonic_ms(void)
+{
+#ifdef __WINDOWS__
+	return GetTickCount64();
+#else
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+		wat_log(WAT_LOG_ERROR, "Failed to retrieve monotonic time\n");
+		return 0;
+	}
+	return ((uint64_t) now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+#endif
+}
+
+WAT_DECLARE(void) wat_sched_set_clock(wat_sched_clock_t clock)
+{
+	sched_clock = clock ? clock : wat_sched_monotonic_ms;
+}
+
+WAT_DECLARE(uint64_t) wat_sched_time_ms(void)
+{
+	return sched_clock();
+}
+
 WAT_DECLARE(wat_status_t) wat_sched_get_time_to_next_timer(const wat_sched_t *sched, int32_t *timeto)
 {
-	wat_status_t status = WAT_FAIL;
-	int res = -1;
-	int ms = 0;
-	struct timeval currtime;
-	wat_timer_t *current = NULL;
-	wat_timer_t *winner = NULL;
-	
+	uint64_t now;
+	uint64_t expires;
+
 	/* forever by default */
 	*timeto = -1;
 
-	wat_mutex_lock(sched->mutex);
+	now = sched_clock();
 
-	res = gettimeofday(&currtime, NULL);
-	if (-1 == res) {
-		wat_log(WAT_LOG_ERROR, "Failed to get next event time\n");
-		goto done;
-	}
-	status = WAT_SUCCESS;
-	current = sched->timers;
-	while (current) {
-		/* if no winner, set this as winner */
-		if (!winner) {
-			winner = current;
-		}
-		current = current->next;
-		/* if no more timers, return the winner */
-		if (!current) {
-			ms = (((winner->time.tv_sec - currtime.tv_sec) * 1000) + 
-			     ((winner->time.tv_usec - currtime.tv_usec) / 1000));
-
-			/* if the timer is expired already, return 0 to attend immediately */
-			if (ms < 0) {
-				*timeto = 0;
-				break;
-			}
-			*timeto = ms;
-			break;
-		}
+	wat_mutex_lock(sched->mutex);
 
-		/* if the winner timer is after the current timer, then we have a new winner */
-		if (winner->time.tv_sec > current->time.tv_sec
-		    || (winner->time.tv_sec == current->time.tv_sec &&
-		       winner->time.tv_usec > current->time.tv_usec)) {
-			winner = current;
+	/* the earliest timer is always at the top of the heap */
+	if (sched->heap_len) {
+		expires = sched->timers[sched->heap[0]].expires;
+
+		/* if the timer is expired already, return 0 to attend immediately */
+		if (expires <= now) {
+			*timeto = 0;
+		} else if (expires - now > INT32_MAX) {
+			*timeto = INT32_MAX;
+		} else {
+			*timeto = (int32_t) (expires - now);
 		}
 	}
 
-done:
 	wat_mutex_unlock(sched->mutex);
 #ifdef __WINDOWS__
 	UNREFERENCED_PARAMETER(timeto);
 	UNREFERENCED_PARAMETER(sched);
 #endif
 
-	return status;
+	return WAT_SUCCESS;
 }
 
-/* Unconditionally remove the timer from the schedule, 
- * re-arrange pointers and free the timer
- * The schedule must be already locked */
-static void destroy_timer(wat_sched_t *sched, wat_timer_t *timer)
+WAT_DECLARE(int) wat_sched_get_fd(wat_sched_t *sched)
 {
-	if (timer == sched->timers) {
-		/* it's the head timer, put a new head */
-		sched->timers = timer->next;
+	int fd = -1;
+
+	wat_assert_return(sched != NULL, -1, "sched is null!\n");
+
+#ifdef __linux__
+	wat_mutex_lock(sched->mutex);
+	if (sched->fd < 0) {
+		sched->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (sched->fd < 0) {
+			wat_log(WAT_LOG_ERROR, "Failed to create timer fd for sched %s (%s)\n", sched->name, strerror(errno));
+		} else {
+			sched->fd_armed = 0;
+			sched_arm_fd(sched);
+		}
 	}
-	if (timer->prev) {
-		timer->prev->next = timer->next;
+	fd = sched->fd;
+	wat_mutex_unlock(sched->mutex);
+#else
+	wat_log(WAT_LOG_ERROR, "Timer fd is not supported on this platform\n");
+#endif
+	return fd;
+}
+
+WAT_DECLARE(void) wat_sched_wakeup(wat_sched_t *sched)
+{
+	wat_assert_return_void(sched != NULL, "sched is null!\n");
+
+	wat_mutex_lock(sched->mutex);
+	if (sched->fd >= 0 && !sched->fd_wakeup) {
+		sched->fd_wakeup = WAT_TRUE;
+		sched_arm_fd(sched);
 	}
-	if (timer->next) {
-		timer->next->prev = timer->prev;
+	wat_mutex_unlock(sched->mutex);
+}
+
+WAT_DECLARE(void) wat_sched_clear_fd(wat_sched_t *sched)
+{
+#ifdef __linux__
+	uint64_t expirations;
+
+	wat_assert_return_void(sched != NULL, "sched is null!\n");
+
+	wat_mutex_lock(sched->mutex);
+	if (sched->fd >= 0) {
+		/* An expired timerfd is disarmed, wat_sched_run arms it again for the next timer */
+		if (read(sched->fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+			sched->fd_armed = 0;
+		}
+		sched->fd_wakeup = WAT_FALSE;
 	}
-	wat_safe_free(timer);
+	wat_mutex_unlock(sched->mutex);
+#endif
 }
 
 WAT_DECLARE(wat_status_t) wat_sched_cancel_timer(wat_sched_t *sched, wat_timer_id_t timerid)
 {
 	wat_status_t status = WAT_FAIL;
-	wat_timer_t *timer;
+	uint32_t slot = WAT_TIMER_ID_SLOT(timerid);
 
 	wat_assert_return(sched != NULL, WAT_EINVAL, "sched is null!\n");
 
@@ -358,13 +521,14 @@ WAT_DECLARE(wat_status_t) wat_sched_cancel_timer(wat_sched_t *sched, wat_timer_i
 
 	wat_mutex_lock(sched->mutex);
 
-	/* look for the timer and destroy it */
-	for (timer = sched->timers; timer; timer = timer->next) {
-		if (timer->id == timerid) {
-			destroy_timer(sched, timer);
-			status = WAT_SUCCESS;
-			break;
-		}
+	/* the id leads straight to the slot, the generation tells whether it is still our timer */
+	if (slot < sched->size &&
+	    sched->timers[slot].heap_index != WAT_TIMER_FREE &&
+	    sched->timers[slot].generation == WAT_TIMER_ID_GENERATION(timerid)) {
+		heap_remove(sched, slot);
+		timer_release(sched, slot);
+		sched_arm_fd(sched);
+		status = WAT_SUCCESS;
 	}
 
 	wat_mutex_unlock(sched->mutex);
@@ -374,20 +538,30 @@ WAT_DECLARE(wat_status_t) wat_sched_cancel_timer(wat_sched_t *sched, wat_timer_i
 
 WAT_DECLARE(wat_status_t) wat_sched_cancel_timers_by_data(wat_sched_t *sched, void *filter)
 {
-	wat_timer_t *timer = NULL;
+	uint32_t i;
+	uint32_t len = 0;
 
 	wat_assert_return(sched != NULL, WAT_EINVAL, "sched is null!\n");
 
 	wat_mutex_lock(sched->mutex);
 
-	/* look for the any timer matching the filter data and destroy it */
-rescan:
-	for (timer = sched->timers; timer; timer = timer->next) {
-		if (timer->usrdata == filter) {
-			destroy_timer(sched, timer);
-			/* linked list was modified, let's rescan to be safe */
-			goto rescan;
+	/* release any timer matching the filter data and pack the others at the front */
+	for (i = 0; i < sched->heap_len; i++) {
+		uint32_t slot = sched->heap[i];
+		if (sched->timers[slot].usrdata == filter) {
+			timer_release(sched, slot);
+			continue;
 		}
+		heap_set(sched, len++, slot);
+	}
+
+	if (len != sched->heap_len) {
+		/* rebuild the heap order in one pass */
+		sched->heap_len = len;
+		for (i = len / 2; i > 0; i--) {
+			heap_sift_down(sched, i - 1);
+		}
+		sched_arm_fd(sched);
 	}
 
 	wat_mutex_unlock(sched->mutex);
@@ -398,8 +572,6 @@ rescan:
 WAT_DECLARE(wat_status_t) wat_sched_destroy(wat_sched_t **insched)
 {
 	wat_sched_t *sched = NULL;
-	wat_timer_t *timer;
-	wat_timer_t *deltimer;
 	wat_assert_return(insched != NULL, WAT_EINVAL, "sched is null!\n");
 	wat_assert_return(*insched != NULL, WAT_EINVAL, "sched is null!\n");
 
@@ -417,12 +589,17 @@ WAT_DECLARE(wat_status_t) wat_sched_destroy(wat_sched_t **insched)
 	/* now grab the sched mutex */
 	wat_mutex_lock(sched->mutex);
 
-	timer = sched->timers;
-	while (timer) {
-		deltimer = timer;
-		timer = timer->next;
-		wat_safe_free(deltimer);
+	wat_safe_free(sched->timers);
+	wat_safe_free(sched->heap);
+	sched->heap_len = 0;
+	sched->size = 0;
+
+#ifdef __linux__
+	if (sched->fd >= 0) {
+		close(sched->fd);
+		sched->fd = -1;
 	}
+#endif
 
 	wat_log(WAT_LOG_DEBUG, "Destroying schedule %s\n", sched->name);
 
@@ -204,32 +204,20 @@ wat_status_t _wat_sms_set_state(const char *func, int line, wat_sms_t *sms, wat_
 
 wat_status_t wat_sms_send_body(wat_sms_t *sms)
 {	
-	int len;
-	int len_wrote;	
-	char command[WAT_MAX_CMD_SZ];
 	wat_span_t *span = sms->span;
 
 	span->sms_write = 1;
 
-	while (sms->wrote < sms->body_len) {
-		memset(command, 0, sizeof(command));
-		len = sms->body_len - sms->wrote;
-		if (len <= 0) {
-			break;
-		}
-
-		if (len > sizeof(command)) {
-			len = sizeof(command);
-		}
-		
-		memcpy(command, &sms->body[sms->wrote], len);
-		len_wrote = wat_span_write(span, command, len);
-
-		sms->wrote += len_wrote;
+	/* The whole body is queued at once, the transmit queue takes care of
+	   devices that only accept part of it */
+	if (sms->wrote < sms->body_len) {
+		int len = sms->body_len - sms->wrote;
 
-		if (len_wrote <= 0) {
-			/* Some lower level queue is full  */
+		if (wat_span_write(span, &sms->body[sms->wrote], len) != len) {
+			/* Transmit queue is full  */
 			wat_log_span(span, WAT_LOG_ERROR, "Failed to write AT command, sms send fail\n");
+		} else {
+			sms->wrote = sms->body_len;
 		}
 	}
 	span->sms_write = 0;
@@ -239,31 +227,30 @@ wat_status_t wat_sms_send_body(wat_sms_t *sms)
 
 static int wat_decode_sms_text_scts(wat_span_t *span, wat_timestamp_t *ts, char *string)
 {
-	char *sctstokens[3];
+	wat_field_t fields[2];
 
 	/* format: 11/11/23,14:42:17+00 */
 	
-	if (wat_cmd_entry_tokenize(wat_string_clean(string), sctstokens, wat_array_len(sctstokens)) < 2) {
+	if (wat_cmd_entry_fields(string, fields, wat_array_len(fields)) < 2) {
 		wat_log(WAT_LOG_ERROR, "Failed to parse SCTS [%s]\n", string);
 	} else {
-		if (sscanf(sctstokens[0], "%d/%d/%d", &ts->year, &ts->month ,&ts->day) == 3) {
+		/* sscanf stops at the separator, the fields do not need to be null-terminated */
+		if (sscanf(fields[0].str, "%d/%d/%d", &ts->year, &ts->month ,&ts->day) == 3) {
 			if (span->config.debug_mask & WAT_DEBUG_SMS_DECODE) {
 				wat_log(WAT_LOG_DEBUG, "SMS-SCTS: year:%d month:%d day:%d\n", ts->year, ts->month ,ts->day);
 			}
 		} else {
-			wat_log(WAT_LOG_ERROR, "Failed to parse date from SCTS [%s]\n", sctstokens[0]);
+			wat_log(WAT_LOG_ERROR, "Failed to parse date from SCTS [%s]\n", string);
 		}
-		if (sscanf(sctstokens[1], "%d:%d:%d+%d", &ts->hour, &ts->minute ,&ts->second, &ts->timezone) == 4) {
+		if (sscanf(fields[1].str, "%d:%d:%d+%d", &ts->hour, &ts->minute ,&ts->second, &ts->timezone) == 4) {
 			if (span->config.debug_mask & WAT_DEBUG_SMS_DECODE) {
 				wat_log(WAT_LOG_DEBUG, "SMS-SCTS: hour:%d minute:%d second:%d tz:%d\n", ts->hour, ts->minute ,ts->second, ts->timezone);
 			}
 		} else {
-			wat_log(WAT_LOG_ERROR, "Failed to parse time from SCTS [%s]\n", sctstokens[1]);
+			wat_log(WAT_LOG_ERROR, "Failed to parse time from SCTS [%s]\n", string);
 		}
 	}
 
-	wat_free_tokens(sctstokens);
-
 	return 0;
 }
 
@@ -0,0 +1,300 @@
+/*
+ * libwat: Wireless AT commands library
+ *
+ * David Yat Sin <dyatsin@sangoma.com>
+ * Copyright (C) 2011, Sangoma Technologies.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "libwat.h"
+#include "wat_internal.h"
+#include "test_utils.h"
+#include "test_modem.h"
+
+#define TEST_MODEM_IO_SIZE 8192
+
+static char g_modem_rx[TEST_MODEM_IO_SIZE];
+static uint32_t g_modem_rx_len;
+static int g_modem_fd = -1;
+static int g_modem_refuse_writes;
+static int g_modem_fake_clock;
+static uint64_t g_modem_now;
+static unsigned g_modem_commands;
+static int g_modem_ready;
+static test_modem_reply_func_t g_modem_reply;
+
+static const char *test_modem_default_reply(const char *cmd)
+{
+	if (!strncmp(cmd, "AT+CGMM", 7)) return "\r\nGC864-QUAD\r\n\r\nOK\r\n";
+	if (!strncmp(cmd, "AT+CGMI", 7)) return "\r\nTelit\r\n\r\nOK\r\n";
+	if (!strncmp(cmd, "AT+CGMR", 7)) return "\r\n07.02.504\r\n\r\nOK\r\n";
+	if (!strncmp(cmd, "AT+CGSN", 7)) return "\r\n356789012345678\r\n\r\nOK\r\n";
+	if (!strncmp(cmd, "AT+CIMI", 7)) return "\r\n302720123456789\r\n\r\nOK\r\n";
+	if (!strncmp(cmd, "AT+CPIN?", 8)) return "\r\n+CPIN: READY\r\n\r\nOK\r\n";
+	if (!strncmp(cmd, "AT+CREG?", 8)) return "\r\n+CREG: 0,1\r\n\r\nOK\r\n";
+	if (!strncmp(cmd, "AT+CSQ", 6)) return "\r\n+CSQ: 20,0\r\n\r\nOK\r\n";
+	if (!strncmp(cmd, "AT+COPS?", 8)) return "\r\n+COPS: 0,0,\"Operator\"\r\n\r\nOK\r\n";
+	if (!strncmp(cmd, "AT+CNUM", 7)) return "\r\n+CNUM: \"Line 1\",\"+15551234\",145\r\n\r\nOK\r\n";
+	if (!strncmp(cmd, "AT+CSCA?", 8)) return "\r\n+CSCA: \"+15550000\",145\r\n\r\nOK\r\n";
+	if (!strncmp(cmd, "AT#QSS?", 7)) return "\r\n#QSS: 2,1\r\n\r\nOK\r\n";
+	return "\r\nOK\r\n";
+}
+
+static const char *test_modem_reply_one(const char *cmd)
+{
+	const char *reply = NULL;
+
+	if (g_modem_reply) {
+		reply = g_modem_reply(cmd);
+	}
+	return reply ? reply : test_modem_default_reply(cmd);
+}
+
+/* Chained commands (i.e AT+CGMM;+CGMI) get the information lines of every command followed by a single result */
+const char *test_modem_reply(const char *cmd)
+{
+	static char out[TEST_MODEM_IO_SIZE];
+	char chain[TEST_MODEM_IO_SIZE];
+	char one[TEST_MODEM_IO_SIZE];
+	char *p, *save = NULL;
+
+	if (!strchr(cmd, ';') || !strncmp(cmd, "ATD", 3)) {
+		return test_modem_reply_one(cmd);
+	}
+
+	out[0] = '\0';
+	snprintf(chain, sizeof(chain), "%s", cmd + 2);
+	for (p = strtok_r(chain, ";", &save); p; p = strtok_r(NULL, ";", &save)) {
+		const char *reply;
+		size_t len;
+
+		snprintf(one, sizeof(one), "AT%s", p);
+		reply = test_modem_reply_one(one);
+		if (!reply[0] || strstr(reply, "ERROR")) {
+			/* The chip stops at the first command that fails or does not answer */
+			return reply;
+		}
+		len = strlen(reply) - strlen("\r\nOK\r\n");
+		strncat(out, reply, len);
+	}
+	strcat(out, "\r\nOK\r\n");
+	return out;
+}
+
+static uint64_t test_modem_clock(void)
+{
+	return g_modem_now;
+}
+
+static void on_modem_span_status(uint8_t span_id, wat_span_status_t *status)
+{
+	if (status->type == WAT_SPAN_STS_READY) {
+		g_modem_ready = 1;
+	}
+}
+
+static int on_modem_span_write(uint8_t span_id, void *data, uint32_t len)
+{
+	if (g_modem_refuse_writes) {
+		errno = 0;
+		return 0;
+	}
+	if (g_modem_fd >= 0) {
+		return write(g_modem_fd, data, len);
+	}
+
+	if (g_modem_rx_len + len >= sizeof(g_modem_rx)) {
+		errno = EAGAIN;
+		return -1;
+	}
+	memcpy(&g_modem_rx[g_modem_rx_len], data, len);
+	g_modem_rx_len += len;
+	return len;
+}
+
+int test_modem_register(void)
+{
+	wat_interface_t modem_interface;
+
+	g_silent = getenv("TEST_VERBOSE") ? 0 : 1;
+
+	memset(&modem_interface, 0, sizeof(modem_interface));
+	modem_interface.wat_span_sts = on_modem_span_status;
+	modem_interface.wat_span_write = on_modem_span_write;
+	modem_interface.wat_log = on_log;
+	modem_interface.wat_log_span = on_log_span;
+	modem_interface.wat_malloc = on_malloc;
+	modem_interface.wat_calloc = on_calloc;
+	modem_interface.wat_free = on_free;
+	modem_interface.wat_assert = on_assert;
+
+	if (wat_register(&modem_interface)) {
+		fprintf(stderr, "Failed to register WAT Library !!!\n");
+		return -1;
+	}
+	return 0;
+}
+
+int test_modem_start(wat_span_config_t *config, test_modem_reply_func_t reply)
+{
+	wat_span_config_t default_config;
+
+	g_modem_reply = reply;
+	if (test_modem_register()) {
+		return -1;
+	}
+
+	if (!config) {
+		memset(&default_config, 0, sizeof(default_config));
+		default_config.moduletype = WAT_MODULE_TELIT_GC864;
+		config = &default_config;
+	}
+
+	if (wat_span_config(TEST_MODEM_SPAN, config) != WAT_SUCCESS) {
+		fprintf(stderr, "Failed to configure span\n");
+		return -1;
+	}
+
+	if (wat_span_start(TEST_MODEM_SPAN) != WAT_SUCCESS) {
+		fprintf(stderr, "Failed to start span\n");
+		return -1;
+	}
+	return 0;
+}
+
+void test_modem_stop(void)
+{
+	wat_span_stop(TEST_MODEM_SPAN);
+	wat_span_unconfig(TEST_MODEM_SPAN);
+	g_modem_rx_len = 0;
+	g_modem_ready = 0;
+	g_modem_fd = -1;
+	g_modem_refuse_writes = 0;
+	if (g_modem_fake_clock) {
+		wat_sched_set_clock(NULL);
+		g_modem_fake_clock = 0;
+	}
+}
+
+void test_modem_set_fake_clock(void)
+{
+	g_modem_now = 1000;
+	g_modem_fake_clock = 1;
+	wat_sched_set_clock(test_modem_clock);
+}
+
+uint64_t test_modem_now(void)
+{
+	return wat_sched_time_ms();
+}
+
+void test_modem_advance(unsigned ms)
+{
+	unsigned i;
+
+	for (i = 0; i < ms; i++) {
+		test_modem_run();
+		if (g_modem_fake_clock) {
+			g_modem_now++;
+		} else {
+			usleep(1000);
+		}
+	}
+}
+
+void test_modem_set_fd(int fd)
+{
+	g_modem_fd = fd;
+}
+
+void test_modem_refuse_writes(int refuse)
+{
+	g_modem_refuse_writes = refuse;
+}
+
+void test_modem_feed(const char *data, uint32_t len)
+{
+	char rx[TEST_MODEM_IO_SIZE];
+
+	if (len > sizeof(rx)) {
+		len = sizeof(rx);
+	}
+	memcpy(rx, data, len);
+	wat_span_process_read(TEST_MODEM_SPAN, rx, len);
+	wat_span_run(TEST_MODEM_SPAN);
+}
+
+void test_modem_run(void)
+{
+	char *end;
+
+	wat_span_run(TEST_MODEM_SPAN);
+
+	/* A command ends with a carriage return, an SMS body with a Ctrl-Z */
+	while ((end = memchr(g_modem_rx, '\r', g_modem_rx_len)) != NULL ||
+		   (end = memchr(g_modem_rx, 0x1a, g_modem_rx_len)) != NULL) {
+		char cmd[TEST_MODEM_IO_SIZE];
+		uint32_t len = end - g_modem_rx;
+		const char *reply;
+
+		memcpy(cmd, g_modem_rx, len);
+		cmd[len] = '\0';
+		memmove(g_modem_rx, end + 1, g_modem_rx_len - len - 1);
+		g_modem_rx_len -= len + 1;
+
+		if (cmd[0] == '\0') {
+			continue;
+		}
+		g_modem_commands++;
+
+		reply = test_modem_reply(cmd);
+		if (reply[0] != '\0') {
+			test_modem_feed(reply, strlen(reply));
+		}
+	}
+}
+
+int test_modem_wait_ready(unsigned timeout_ms)
+{
+	unsigned elapsed;
+
+	for (elapsed = 0; !g_modem_ready && elapsed < timeout_ms; elapsed++) {
+		test_modem_advance(1);
+	}
+	return g_modem_ready ? 0 : -1;
+}
+
+unsigned test_modem_commands(void)
+{
+	return g_modem_commands;
+}
+
+uint64_t test_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
@@ -0,0 +1,90 @@
+/*
+ * libwat: Wireless AT commands library
+ *
+ * David Yat Sin <dyatsin@sangoma.com>
+ * Copyright (C) 2011, Sangoma Technologies.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+#ifndef _TEST_MODEM_H
+#define _TEST_MODEM_H
+
+/* In-process modem used by the unit tests and benchmarks. Commands written by the span
+   are answered with canned replies fed back through wat_span_process_read, so a span can
+   be brought up and exercised without hardware */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "libwat.h"
+
+#define TEST_MODEM_SPAN 1
+
+/* Returns the reply to a single command (without the ';' chaining), NULL for the default reply
+   and an empty string for no reply at all */
+typedef const char *(*test_modem_reply_func_t)(const char *cmd);
+
+#define test_check(cond) do { \
+			if (!(cond)) { \
+				fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+				exit(1); \
+			} \
+		} while (0)
+
+/* Registers the library, for tests that do not need a span */
+int test_modem_register(void);
+
+/* Registers the library and starts TEST_MODEM_SPAN with config (NULL for a Telit GC864) */
+int test_modem_start(wat_span_config_t *config, test_modem_reply_func_t reply);
+void test_modem_stop(void);
+
+/* Makes the span write to fd instead of the in-process modem, until test_modem_stop. The
+   test then answers from the other end of fd itself, see test_modem_reply */
+void test_modem_set_fd(int fd);
+
+/* Makes the write callback return 0 without setting errno, as a device that went away
+   may do, until test_modem_stop */
+void test_modem_refuse_writes(int refuse);
+
+/* Reply of the in-process modem to a command line */
+const char *test_modem_reply(const char *cmd);
+
+/* Runs the span once and answers whatever it wrote */
+void test_modem_run(void);
+
+/* Makes the timers of the span follow a clock that only test_modem_advance moves, so long
+   timeouts expire right away and at an exact time. Call it before test_modem_start */
+void test_modem_set_fake_clock(void);
+
+/* Current time of the span timers in milliseconds */
+uint64_t test_modem_now(void);
+
+/* Runs the span and answers it for ms milliseconds, on the fake clock if it is set */
+void test_modem_advance(unsigned ms);
+
+/* Runs the span until it reports ready, returns 0 on success */
+int test_modem_wait_ready(unsigned timeout_ms);
+
+/* Gives data to the span as if it was received from the chip */
+void test_modem_feed(const char *data, uint32_t len);
+
+/* Number of commands the span sent so far */
+unsigned test_modem_commands(void);
+
+uint64_t test_time_us(void);
+
+#endif /* _TEST_MODEM_H */
@@ -0,0 +1,358 @@
+/*
+ * libwat: Wireless AT commands library
+ *
+ * David Yat Sin <dyatsin@sangoma.com>
+ * Copyright (C) 2011, Sangoma Technologies.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+
+/* Checks that the lock-free read buffer keeps the data in order when its counters wrap
+   around, that fragments which do not all fit are not enqueued at all, that a mirrored
+   buffer can grow twice while the consumer still looks at its first area, and what a span
+   does with reads that do not fit with each read buffer policy, then times one producer and
+   one consumer thread going through the lock-free and the locked buffer.
+   Usage: wat_buffer_bench [megabytes] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/uio.h>
+
+#include "libwat.h"
+#include "wat_internal.h"
+#include "test_utils.h"
+#include "test_modem.h"
+
+#define BUFFER_CAPACITY 10000	/* Same as the span read buffer, not a power of two */
+#define CHUNK_SZ 61				/* Does not divide the capacity either, so chunks straddle the ring end */
+#define FILL_LINE "\r\n+WFILL: 0123456789012345678901234567890123456789\r\n"	/* 50 bytes */
+
+typedef struct {
+	wat_buffer_t *buffer;
+	wat_size_t total;
+	int errors;
+} bench_ctx_t;
+
+/* Counters a few chunks away from their wrap around */
+static void buffer_near_wrap(wat_buffer_t *buffer)
+{
+	buffer->head = (wat_size_t)0 - (3 * CHUNK_SZ);
+	buffer->tail = buffer->head;
+}
+
+static void test_wrap(void)
+{
+	wat_buffer_t *buffer = NULL;
+	uint8_t chunk[CHUNK_SZ];
+	const uint8_t *data;
+	wat_size_t len;
+	unsigned i, j;
+
+	test_check(wat_buffer_create_lockfree(&buffer, BUFFER_CAPACITY) == WAT_SUCCESS);
+	test_check(buffer->capacity >= BUFFER_CAPACITY);
+	test_check((buffer->capacity & (buffer->capacity - 1)) == 0);
+
+	buffer_near_wrap(buffer);
+	for (i = 0; i < 10; i++) {
+		for (j = 0; j < CHUNK_SZ; j++) {
+			chunk[j] = (uint8_t)(i + j);
+		}
+		test_check(wat_buffer_enqueue(buffer, chunk, CHUNK_SZ) == WAT_SUCCESS);
+		test_check(wat_buffer_view(buffer, &data, &len) == WAT_SUCCESS);
+		test_check(len == CHUNK_SZ);
+		test_check(!memcmp(data, chunk, CHUNK_SZ));
+		test_check(wat_buffer_flush(buffer, CHUNK_SZ) == WAT_SUCCESS);
+	}
+	test_check(buffer->head < (wat_size_t)(10 * CHUNK_SZ));
+
+	wat_buffer_destroy(&buffer);
+}
+
+static void fill_pattern(uint8_t *data, wat_size_t len, wat_size_t offset)
+{
+	wat_size_t i;
+
+	for (i = 0; i < len; i++) {
+		data[i] = (uint8_t)((offset + i) * 7);
+	}
+}
+
+static int check_pattern(const uint8_t *data, wat_size_t len, wat_size_t offset)
+{
+	wat_size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (data[i] != (uint8_t)((offset + i) * 7)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Enqueues three fragments of len bytes in total, following the pattern from offset */
+static wat_status_t enqueue_fragments(wat_buffer_t *buffer, uint8_t *data, wat_size_t len, wat_size_t offset)
+{
+	struct iovec iov[3];
+
+	fill_pattern(data, len, offset);
+	iov[0].iov_base = data;
+	iov[0].iov_len = len / 3;
+	iov[1].iov_base = &data[iov[0].iov_len];
+	iov[1].iov_len = len / 3;
+	iov[2].iov_base = &data[iov[0].iov_len + iov[1].iov_len];
+	iov[2].iov_len = len - iov[0].iov_len - iov[1].iov_len;
+	return wat_buffer_enqueuev(buffer, iov, 3);
+}
+
+/* The data starts 60 bytes in the ring, so the fragments go past its end */
+static void test_readv(wat_buffer_t *buffer)
+{
+	uint8_t *data;
+	const uint8_t *view;
+	wat_size_t free_len, len;
+
+	data = malloc(buffer->capacity + 1);
+	test_check(data != NULL);
+
+	fill_pattern(data, 100, 0);
+	test_check(wat_buffer_enqueue(buffer, data, 100) == WAT_SUCCESS);
+	test_check(wat_buffer_flush(buffer, 60) == WAT_SUCCESS);
+	free_len = buffer->capacity - 40;
+
+	/* One byte too many, none of them is enqueued */
+	test_check(enqueue_fragments(buffer, data, free_len + 1, 100) == WAT_EBUSY);
+	test_check(wat_buffer_view(buffer, &view, &len) == WAT_SUCCESS);
+	test_check(len == 40 && check_pattern(view, len, 60));
+
+	/* All of them fit */
+	test_check(enqueue_fragments(buffer, data, free_len, 100) == WAT_SUCCESS);
+	test_check(wat_buffer_view(buffer, &view, &len) == WAT_SUCCESS);
+	test_check(len == buffer->capacity && check_pattern(view, len, 60));
+
+	free(data);
+}
+
+static void test_grow_twice(void)
+{
+	wat_buffer_t *buffer = NULL;
+	uint8_t chunk[400];
+	const uint8_t *first, *data;
+	wat_size_t first_len, len;
+
+	test_check(wat_buffer_create_mirrored(&buffer, 100) == WAT_SUCCESS);
+	test_check(wat_buffer_set_max_capacity(buffer, 1000) == WAT_SUCCESS);
+
+	fill_pattern(chunk, 80, 0);
+	test_check(wat_buffer_enqueue(buffer, chunk, 80) == WAT_SUCCESS);
+	test_check(wat_buffer_view(buffer, &first, &first_len) == WAT_SUCCESS);
+
+	/* Grows to 200 then 400 bytes, the consumer does not look at the buffer in between */
+	fill_pattern(chunk, 60, 80);
+	test_check(wat_buffer_enqueue(buffer, chunk, 60) == WAT_SUCCESS);
+	fill_pattern(chunk, 200, 140);
+	test_check(wat_buffer_enqueue(buffer, chunk, 200) == WAT_SUCCESS);
+	test_check(buffer->grow_count == 2);
+	test_check(buffer->capacity == 400);
+
+	/* The first view is still readable */
+	test_check(first_len == 80 && check_pattern(first, first_len, 0));
+
+	test_check(wat_buffer_view(buffer, &data, &len) == WAT_SUCCESS);
+	test_check(len == 340 && check_pattern(data, len, 0));
+	test_check(buffer->retired_data == NULL);
+
+	/* Up to the maximum, not past it */
+	fill_pattern(chunk, 400, 340);
+	test_check(wat_buffer_enqueue(buffer, chunk, 400) == WAT_SUCCESS);
+	fill_pattern(chunk, 200, 740);
+	test_check(wat_buffer_enqueue(buffer, chunk, 200) == WAT_SUCCESS);
+	test_check(buffer->capacity == 1000);
+	test_check(wat_buffer_enqueue(buffer, chunk, 100) == WAT_EBUSY);
+
+	test_check(wat_buffer_view(buffer, &data, &len) == WAT_SUCCESS);
+	test_check(len == 940 && check_pattern(data, len, 0));
+
+	wat_buffer_destroy(&buffer);
+}
+
+static WAT_NOTIFY_FUNC(on_notify_fill)
+{
+	return 1;
+}
+
+/* Fills the read buffer of a span that does not run, then lets it parse */
+static void test_policy(wat_buffer_policy_t policy)
+{
+	unsigned lines = (2 * WAT_DEFAULT_RX_BUFFER_MAX_SIZE) / (sizeof(FILL_LINE) - 1);
+	wat_span_config_t config;
+	wat_rx_stats_t stats;
+	wat_span_t *span;
+	unsigned accepted = 0;
+	unsigned refused = 0;
+	wat_size_t pending;
+	wat_status_t expected_refusal;
+	wat_status_t status;
+	unsigned i;
+
+	memset(&config, 0, sizeof(config));
+	config.moduletype = WAT_MODULE_TELIT_GC864;
+	config.rx_buffer_policy = policy;
+	test_check(test_modem_start(&config, NULL) == 0);
+	test_check(test_modem_wait_ready(5000) == 0);
+
+	span = wat_get_span(TEST_MODEM_SPAN);
+	test_check(span != NULL);
+	test_check(wat_cmd_register(span, "+WFILL", on_notify_fill) == WAT_SUCCESS);
+
+	/* Whatever the span did not parse yet counts in the buffer too */
+	pending = span->buffer->size;
+
+	expected_refusal = (policy == WAT_BUFFER_POLICY_BACKPRESSURE) ? WAT_EBUSY : WAT_FAIL;
+	for (i = 0; i < lines; i++) {
+		status = wat_span_process_read(TEST_MODEM_SPAN, FILL_LINE, sizeof(FILL_LINE) - 1);
+		if (status == WAT_SUCCESS) {
+			test_check(!refused);
+			accepted++;
+		} else {
+			test_check(status == expected_refusal);
+			refused++;
+		}
+	}
+
+	test_check(wat_span_get_rx_stats(TEST_MODEM_SPAN, &stats) == WAT_SUCCESS);
+	test_check(stats.refused_count == refused);
+	test_check(stats.high_watermark == pending + (accepted * (sizeof(FILL_LINE) - 1)));
+	test_check(stats.high_watermark + (sizeof(FILL_LINE) - 1) > stats.size);
+	if (policy == WAT_BUFFER_POLICY_GROW) {
+		/* Twice, without the span parsing in between */
+		test_check(stats.size == WAT_DEFAULT_RX_BUFFER_MAX_SIZE);
+		test_check(stats.grow_count == 2);
+	} else {
+		test_check(stats.size == WAT_BUFFER_SZ);
+		test_check(stats.grow_count == 0);
+	}
+
+	/* Room again once the span parsed what it had */
+	wat_span_run(TEST_MODEM_SPAN);
+	test_check(span->buffer->size == 0);
+	test_check(wat_span_process_read(TEST_MODEM_SPAN, FILL_LINE, sizeof(FILL_LINE) - 1) == WAT_SUCCESS);
+
+	printf("%s policy: %u reads accepted, %u refused\n", wat_buffer_policy2str(policy), accepted, refused);
+	test_modem_stop();
+}
+
+static void *bench_producer(void *arg)
+{
+	bench_ctx_t *ctx = arg;
+	uint8_t chunk[CHUNK_SZ];
+	wat_size_t sent = 0;
+	unsigned i;
+
+	while (sent < ctx->total) {
+		for (i = 0; i < CHUNK_SZ; i++) {
+			chunk[i] = (uint8_t)(sent + i);
+		}
+		if (wat_buffer_enqueue(ctx->buffer, chunk, CHUNK_SZ) != WAT_SUCCESS) {
+			/* Full, let the consumer run */
+			sched_yield();
+			continue;
+		}
+		sent += CHUNK_SZ;
+	}
+	return NULL;
+}
+
+static void *bench_consumer(void *arg)
+{
+	bench_ctx_t *ctx = arg;
+	wat_size_t received = 0;
+	const uint8_t *data;
+	wat_size_t len;
+	wat_size_t i;
+
+	while (received < ctx->total) {
+		if (wat_buffer_view(ctx->buffer, &data, &len) != WAT_SUCCESS) {
+			sched_yield();
+			continue;
+		}
+		for (i = 0; i < len; i++) {
+			if (data[i] != (uint8_t)(received + i)) {
+				ctx->errors++;
+			}
+		}
+		wat_buffer_flush(ctx->buffer, len);
+		received += len;
+	}
+	return NULL;
+}
+
+static void bench_buffer(const char *name, wat_buffer_t *buffer, wat_size_t total)
+{
+	pthread_t producer, consumer;
+	bench_ctx_t ctx;
+	uint64_t start, elapsed;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.buffer = buffer;
+	ctx.total = (total / CHUNK_SZ) * CHUNK_SZ;
+
+	start = test_time_us();
+	pthread_create(&consumer, NULL, bench_consumer, &ctx);
+	pthread_create(&producer, NULL, bench_producer, &ctx);
+	pthread_join(producer, NULL);
+	pthread_join(consumer, NULL);
+	elapsed = test_time_us() - start;
+
+	printf("%s: %.1f MB/s\n", name, elapsed ? (double)ctx.total / elapsed : 0.0);
+	test_check(ctx.errors == 0);
+}
+
+int main(int argc, char *argv[])
+{
+	wat_size_t total = ((argc > 1) ? atoi(argv[1]) : 64) * 1024 * 1024;
+	wat_buffer_t *buffer = NULL;
+
+	test_check(test_modem_register() == 0);
+
+	test_wrap();
+
+	test_check(wat_buffer_create_lockfree(&buffer, 1000) == WAT_SUCCESS);
+	buffer_near_wrap(buffer);
+	test_readv(buffer);
+	wat_buffer_destroy(&buffer);
+	test_check(wat_buffer_create_mirrored(&buffer, 1000) == WAT_SUCCESS);
+	test_readv(buffer);
+	wat_buffer_destroy(&buffer);
+
+	test_grow_twice();
+	test_policy(WAT_BUFFER_POLICY_DROP);
+	test_policy(WAT_BUFFER_POLICY_GROW);
+	test_policy(WAT_BUFFER_POLICY_BACKPRESSURE);
+
+	test_check(wat_buffer_create_lockfree(&buffer, BUFFER_CAPACITY) == WAT_SUCCESS);
+	buffer_near_wrap(buffer);
+	bench_buffer("lock-free", buffer, total);
+	wat_buffer_destroy(&buffer);
+
+	test_check(wat_buffer_create_mirrored(&buffer, BUFFER_CAPACITY) == WAT_SUCCESS);
+	bench_buffer("locked", buffer, total);
+	wat_buffer_destroy(&buffer);
+	return 0;
+}
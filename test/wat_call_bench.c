@@ -0,0 +1,155 @@
+/*
+ * libwat: Wireless AT commands library
+ *
+ * David Yat Sin <dyatsin@sangoma.com>
+ * Copyright (C) 2011, Sangoma Technologies.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+
+/* Places an outbound call on a Telit GC864 of the test modem, on its fake clock, and drives
+   it with #ECAM notifications: calling, connecting, active, then idle. Checks the call state
+   after each of them and that the call status is never polled with AT+CLCC meanwhile.
+   Prints how many commands the call took.
+   Usage: wat_call_bench */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libwat.h"
+#include "wat_internal.h"
+#include "test_utils.h"
+#include "test_modem.h"
+
+#define TEST_CALL_ID 8
+#define TEST_CCID 1
+
+static unsigned g_clcc_count;
+static unsigned g_atd_count;
+
+static const char *call_reply(const char *cmd)
+{
+	if (!strncmp(cmd, "AT+CLCC", 7)) {
+		g_clcc_count++;
+	} else if (!strncmp(cmd, "ATD", 3)) {
+		g_atd_count++;
+	}
+	return NULL;
+}
+
+static wat_call_t *find_call(wat_span_t *span, uint8_t id)
+{
+	int i;
+
+	for (i = 0; i < wat_array_len(span->calls); i++) {
+		if (span->calls[i] && span->calls[i]->id == id) {
+			return span->calls[i];
+		}
+	}
+	return NULL;
+}
+
+static void wait_idle(wat_span_t *span)
+{
+	unsigned elapsed;
+
+	for (elapsed = 0; (span->cmd || span->cmd_busy || wat_cmd_pending(span) == WAT_TRUE) && elapsed < 60000; elapsed++) {
+		test_modem_advance(1);
+	}
+	test_check(!span->cmd && !span->cmd_busy);
+}
+
+/* Sends the notification, then leaves the span running long enough for a few CLCC polls */
+static void ecam(wat_span_t *span, unsigned ccstatus)
+{
+	char line[64];
+
+	snprintf(line, sizeof(line), "\r\n#ECAM: %d,%u,1,,,5551234,129\r\n", TEST_CCID, ccstatus);
+	test_modem_feed(line, strlen(line));
+	test_modem_advance(4 * span->config.progress_poll_interval);
+}
+
+int main(int argc, char *argv[])
+{
+	wat_span_config_t config;
+	wat_con_event_t con_event;
+	wat_timer_id_t progress_monitor;
+	wat_span_t *span;
+	wat_call_t *call;
+	unsigned commands;
+
+	memset(&config, 0, sizeof(config));
+	config.moduletype = WAT_MODULE_TELIT_GC864;
+	config.signal_poll_interval = 3600 * 1000;
+
+	test_modem_set_fake_clock();
+	test_check(test_modem_start(&config, call_reply) == 0);
+	test_check(test_modem_wait_ready(10000) == 0);
+
+	span = wat_get_span(TEST_MODEM_SPAN);
+	test_check(span != NULL);
+	wait_idle(span);
+	test_check(wat_test_flag(&span->module, WAT_MODFLAG_CALL_PROGRESS_URC));
+
+	g_clcc_count = 0;
+	commands = test_modem_commands();
+	progress_monitor = span->timeouts[WAT_PROGRESS_MONITOR];
+
+	memset(&con_event, 0, sizeof(con_event));
+	con_event.type = WAT_CALL_TYPE_VOICE;
+	strcpy(con_event.called_num.digits, "5551234");
+	test_check(wat_con_req(TEST_MODEM_SPAN, TEST_CALL_ID, &con_event) == WAT_SUCCESS);
+	/* Runs the request, then the ATD it queued */
+	test_modem_advance(1);
+	wait_idle(span);
+
+	call = find_call(span, TEST_CALL_ID);
+	test_check(call != NULL);
+	test_check(call->state == WAT_CALL_STATE_DIALING);
+	test_check(g_atd_count == 1);
+
+	/* The progress monitor was not armed for the call */
+	test_check(span->timeouts[WAT_PROGRESS_MONITOR] == progress_monitor);
+
+	ecam(span, 1);
+	test_check(call->state == WAT_CALL_STATE_DIALED);
+	test_check(call->modid == TEST_CCID);
+
+	ecam(span, 2);
+	test_check(call->state == WAT_CALL_STATE_RINGING);
+
+	ecam(span, 3);
+	test_check(call->state == WAT_CALL_STATE_UP);
+
+	ecam(span, 0);
+	test_check(call->state == WAT_CALL_STATE_TERMINATING);
+
+	test_check(wat_rel_cfm(TEST_MODEM_SPAN, TEST_CALL_ID) == WAT_SUCCESS);
+	test_modem_advance(10);
+	test_check(find_call(span, TEST_CALL_ID) == NULL);
+
+	test_check(g_clcc_count == 0);
+	test_check(span->timeouts[WAT_PROGRESS_MONITOR] == progress_monitor);
+
+	printf("outbound call with #ECAM: %u commands over %llu ms (CLCC polls every %d ms otherwise)\n",
+		test_modem_commands() - commands, (unsigned long long)(16 * span->config.progress_poll_interval),
+		span->config.progress_poll_interval);
+
+	test_modem_stop();
+	return 0;
+}
@@ -0,0 +1,350 @@
+/*
+ * libwat: Wireless AT commands library
+ *
+ * David Yat Sin <dyatsin@sangoma.com>
+ * Copyright (C) 2011, Sangoma Technologies.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+
+/* Checks that commands leave the priority lanes highest lane first and in order within
+   a lane, that the command pool only allocates past its size and that identical queries
+   queued at once are sent once, even when several threads race to queue them, then times
+   how long a call command waits behind queued commands.
+   Usage: wat_cmd_bench [queued commands] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libwat.h"
+#include "wat_internal.h"
+#include "test_utils.h"
+#include "test_modem.h"
+
+#define MAX_SENT 256
+/* Commands queued past the size of the pool */
+#define POOL_EXTRA 20
+#define COALESCE_THREADS 4
+/* Each round the threads race to queue the same query once */
+#define COALESCE_ROUNDS 2000
+
+/* Only the commands of the test are recorded, not the polls of the span */
+#define TEST_CMD_PREFIX "AT+W"
+
+static char g_sent[MAX_SENT][32];
+static unsigned g_sent_count;
+static unsigned g_answered;
+static pthread_barrier_t g_round_barrier;
+
+static const char *cmd_reply(const char *cmd)
+{
+	if (!strncmp(cmd, TEST_CMD_PREFIX, strlen(TEST_CMD_PREFIX)) && g_sent_count < MAX_SENT) {
+		snprintf(g_sent[g_sent_count++], sizeof(g_sent[0]), "%s", cmd);
+	}
+	return NULL;
+}
+
+static WAT_RESPONSE_FUNC(on_cmd_response)
+{
+	int i;
+
+	for (i = 0; tokens[i]; i++);
+	g_answered++;
+	return i;
+}
+
+static void run_until_answered(unsigned answered)
+{
+	unsigned elapsed;
+
+	for (elapsed = 0; g_answered < answered && elapsed < 10000; elapsed++) {
+		test_modem_run();
+		usleep(1000);
+	}
+	test_check(g_answered == answered);
+}
+
+static void enqueue(wat_span_t *span, wat_cmd_prio_t prio, const char *cmd)
+{
+	test_check(wat_cmd_enqueue_prio(span, prio, cmd, on_cmd_response, NULL, span->config.timeout_command) == WAT_SUCCESS);
+}
+
+static void test_lanes(wat_span_t *span)
+{
+	const char *expected[] = { "AT+WNEXT", "AT+WCALL=1", "AT+WCALL=2", "AT+WNORMAL=1", "AT+WNORMAL=2", "AT+WPOLL" };
+	unsigned i;
+
+	g_sent_count = 0;
+	g_answered = 0;
+
+	/* Queued before the span runs, lowest lane first */
+	enqueue(span, WAT_CMD_PRIO_POLL, "AT+WPOLL");
+	enqueue(span, WAT_CMD_PRIO_NORMAL, "AT+WNORMAL=1");
+	enqueue(span, WAT_CMD_PRIO_NORMAL, "AT+WNORMAL=2");
+	enqueue(span, WAT_CMD_PRIO_CALL, "AT+WCALL=1");
+	enqueue(span, WAT_CMD_PRIO_CALL, "AT+WCALL=2");
+	enqueue(span, WAT_CMD_PRIO_NEXT, "AT+WNEXT");
+
+	run_until_answered(wat_array_len(expected));
+	test_check(g_sent_count == wat_array_len(expected));
+	for (i = 0; i < wat_array_len(expected); i++) {
+		test_check(!strcmp(g_sent[i], expected[i]));
+	}
+}
+
+static unsigned pool_size(wat_span_t *span)
+{
+	wat_cmd_t *cmd;
+	unsigned size = 0;
+
+	for (cmd = span->cmd_pool; cmd; cmd = cmd->next_free) {
+		size++;
+	}
+	return size;
+}
+
+static void wait_idle(wat_span_t *span)
+{
+	unsigned elapsed;
+
+	for (elapsed = 0; (span->cmd || span->cmd_busy || wat_cmd_pending(span) == WAT_TRUE) && elapsed < 10000; elapsed++) {
+		test_modem_run();
+		usleep(1000);
+	}
+	test_check(!span->cmd && !span->cmd_busy);
+}
+
+/* Queues count commands and checks how many came from the pool and how many from the heap */
+static void enqueue_pooled(wat_span_t *span, unsigned count, unsigned expect_allocated, unsigned expect_reused)
+{
+	wat_cmd_stats_t before, after;
+	uint64_t allocs_before, frees_before;
+	uint64_t allocs, frees;
+	char cmd[32];
+	unsigned i;
+
+	test_check(wat_span_get_cmd_stats(TEST_MODEM_SPAN, &before) == WAT_SUCCESS);
+	wat_mem_get_counters(&allocs_before, &frees_before);
+
+	g_answered = 0;
+	for (i = 0; i < count; i++) {
+		snprintf(cmd, sizeof(cmd), "AT+WPOOL=%u", i);
+		enqueue(span, WAT_CMD_PRIO_NORMAL, cmd);
+	}
+
+	test_check(wat_span_get_cmd_stats(TEST_MODEM_SPAN, &after) == WAT_SUCCESS);
+	wat_mem_get_counters(&allocs, &frees);
+	test_check(after.allocated == before.allocated + expect_allocated);
+	test_check(after.reused == before.reused + expect_reused);
+	test_check(after.spilled == before.spilled);
+	test_check(allocs == allocs_before + expect_allocated);
+	test_check(frees == frees_before);
+
+	run_until_answered(count);
+	wait_idle(span);
+}
+
+static void test_pool(wat_span_t *span)
+{
+	wat_cmd_stats_t before, after;
+	uint64_t allocs_before, frees_before;
+	uint64_t allocs, frees;
+	char cmd[WAT_CMD_INLINE_SZ + 16];
+	unsigned size;
+
+	wait_idle(span);
+	size = pool_size(span);
+	test_check(size + POOL_EXTRA < WAT_CMD_QUEUE_SZ);
+
+	/* The pool runs out, then grows by what it was missing */
+	enqueue_pooled(span, size + POOL_EXTRA, POOL_EXTRA, size);
+	test_check(pool_size(span) == size + POOL_EXTRA);
+
+	/* Now big enough, no allocation at all */
+	enqueue_pooled(span, size + POOL_EXTRA, 0, size + POOL_EXTRA);
+	test_check(pool_size(span) == size + POOL_EXTRA);
+
+	/* Only commands too long for the inline storage go to the heap */
+	test_check(wat_span_get_cmd_stats(TEST_MODEM_SPAN, &before) == WAT_SUCCESS);
+	wat_mem_get_counters(&allocs_before, &frees_before);
+	memset(cmd, 0, sizeof(cmd));
+	strcpy(cmd, "AT+WLONG=");
+	memset(&cmd[strlen(cmd)], '0', WAT_CMD_INLINE_SZ);
+	g_answered = 0;
+	enqueue(span, WAT_CMD_PRIO_NORMAL, cmd);
+	run_until_answered(1);
+	wait_idle(span);
+
+	test_check(wat_span_get_cmd_stats(TEST_MODEM_SPAN, &after) == WAT_SUCCESS);
+	wat_mem_get_counters(&allocs, &frees);
+	test_check(after.spilled == before.spilled + 1);
+	test_check(after.allocated == before.allocated);
+	test_check(allocs == allocs_before + 1 && frees == frees_before + 1);
+
+	printf("command pool: %u commands, %u allocated, %u reused, %u spilled\n", pool_size(span),
+		after.allocated, after.reused, after.spilled);
+}
+
+static uint32_t coalesced(void)
+{
+	wat_cmd_stats_t stats;
+
+	test_check(wat_span_get_cmd_stats(TEST_MODEM_SPAN, &stats) == WAT_SUCCESS);
+	return stats.coalesced;
+}
+
+static unsigned sent_count(const char *cmd)
+{
+	unsigned count = 0;
+	unsigned i;
+
+	for (i = 0; i < g_sent_count; i++) {
+		if (!strcmp(g_sent[i], cmd)) {
+			count++;
+		}
+	}
+	return count;
+}
+
+static void *coalesce_thread(void *arg)
+{
+	wat_span_t *span = arg;
+	unsigned i;
+
+	for (i = 0; i < COALESCE_ROUNDS; i++) {
+		pthread_barrier_wait(&g_round_barrier);
+		test_check(wat_cmd_enqueue_coalesced(span, WAT_CMD_PRIO_POLL, "AT+WRACE", on_cmd_response, NULL, span->config.timeout_command) == WAT_SUCCESS);
+		pthread_barrier_wait(&g_round_barrier);
+	}
+	return NULL;
+}
+
+/* Takes the commands out of the lane without sending them */
+static unsigned drain_lane(wat_span_t *span, wat_cmd_prio_t prio)
+{
+	wat_cmd_t *cmd;
+	unsigned count = 0;
+
+	while ((cmd = wat_queue_dequeue(span->cmd_queues[prio])) != NULL) {
+		wat_cmd_release(span, cmd);
+		count++;
+	}
+	return count;
+}
+
+static void test_coalesce(wat_span_t *span)
+{
+	pthread_t threads[COALESCE_THREADS];
+	uint32_t coalesced_before;
+	unsigned i;
+
+	wait_idle(span);
+	g_sent_count = 0;
+	g_answered = 0;
+
+	/* Queued while the span does not run, the first one is waiting for the others */
+	coalesced_before = coalesced();
+	for (i = 0; i < 5; i++) {
+		test_check(wat_cmd_enqueue_coalesced(span, WAT_CMD_PRIO_NORMAL, "AT+WCOAL", on_cmd_response, NULL, span->config.timeout_command) == WAT_SUCCESS);
+	}
+	test_check(coalesced() == coalesced_before + 4);
+
+	/* A different response handler is a different query */
+	test_check(wat_cmd_enqueue_coalesced(span, WAT_CMD_PRIO_NORMAL, "AT+WCOAL", NULL, NULL, span->config.timeout_command) == WAT_SUCCESS);
+	test_check(coalesced() == coalesced_before + 4);
+
+	run_until_answered(1);
+	wait_idle(span);
+	test_check(sent_count("AT+WCOAL") == 2);
+
+	/* Only one of the threads gets to queue it, every round */
+	coalesced_before = coalesced();
+	test_check(pthread_barrier_init(&g_round_barrier, NULL, COALESCE_THREADS + 1) == 0);
+	for (i = 0; i < COALESCE_THREADS; i++) {
+		test_check(pthread_create(&threads[i], NULL, coalesce_thread, span) == 0);
+	}
+	for (i = 0; i < COALESCE_ROUNDS; i++) {
+		pthread_barrier_wait(&g_round_barrier);
+		pthread_barrier_wait(&g_round_barrier);
+		test_check(drain_lane(span, WAT_CMD_PRIO_POLL) == 1);
+	}
+	for (i = 0; i < COALESCE_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_barrier_destroy(&g_round_barrier);
+	test_check(coalesced() == coalesced_before + COALESCE_ROUNDS * (COALESCE_THREADS - 1));
+}
+
+/* A call command waits for the command already sent, not for the ones queued behind it */
+static void bench_call_latency(wat_span_t *span, unsigned queued)
+{
+	char cmd[32];
+	uint64_t start;
+	unsigned i;
+
+	/* Wait out the grace period after the previous command */
+	while (span->cmd_busy) {
+		test_modem_run();
+		usleep(100);
+	}
+
+	g_sent_count = 0;
+	g_answered = 0;
+
+	for (i = 0; i < queued; i++) {
+		snprintf(cmd, sizeof(cmd), "AT+WNORMAL=%u", i);
+		enqueue(span, WAT_CMD_PRIO_NORMAL, cmd);
+	}
+
+	/* Send the first one */
+	wat_span_run(TEST_MODEM_SPAN);
+
+	start = test_time_us();
+	enqueue(span, WAT_CMD_PRIO_CALL, "AT+WCALL");
+	while (g_sent_count < 2) {
+		test_modem_run();
+		usleep(100);
+	}
+	printf("call command behind %u queued commands: sent after %.3f ms\n", queued, (double)(test_time_us() - start) / 1000);
+	test_check(!strcmp(g_sent[0], "AT+WNORMAL=0"));
+	test_check(!strcmp(g_sent[1], "AT+WCALL"));
+
+	run_until_answered(queued + 1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned queued = (argc > 1) ? atoi(argv[1]) : 50;
+	wat_span_t *span;
+
+	test_check(test_modem_start(NULL, cmd_reply) == 0);
+	test_check(test_modem_wait_ready(5000) == 0);
+
+	span = wat_get_span(TEST_MODEM_SPAN);
+	test_check(span != NULL);
+
+	test_lanes(span);
+	test_pool(span);
+	test_coalesce(span);
+	bench_call_latency(span, queued);
+
+	test_modem_stop();
+	return 0;
+}
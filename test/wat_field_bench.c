@@ -0,0 +1,227 @@
+/*
+ * libwat: Wireless AT commands library
+ *
+ * David Yat Sin <dyatsin@sangoma.com>
+ * Copyright (C) 2011, Sangoma Technologies.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+
+/* Checks how response entries are split into fields (empty fields, quotes, blanks,
+   truncated entries) and parsed through schema tables, including the built-in ones on
+   the start up responses of a span, then times splitting and parsing a +CLCC entry.
+   Usage: wat_field_bench [iterations] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libwat.h"
+#include "wat_internal.h"
+#include "test_utils.h"
+#include "test_modem.h"
+
+#define MAX_FIELDS 8
+
+static const char g_clcc_entry[] = "1,0,3,0,0,\"+15551234\",145";
+
+typedef struct {
+	int id;
+	int dir;
+	int stat;
+	char number[8];
+	int type;
+} test_entry_t;
+
+static const wat_schema_field_t test_schema_fields[] = {
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, test_entry_t, id),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, test_entry_t, dir),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, test_entry_t, stat),
+	WAT_SCHEMA_FIELD_SKIP,
+	WAT_SCHEMA_FIELD_SKIP,
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_STR, test_entry_t, number),
+	WAT_SCHEMA_FIELD(WAT_SCHEMA_INT, test_entry_t, type),
+};
+static const wat_schema_t test_schema = WAT_SCHEMA("+CLCC: ", test_entry_t, 3, test_schema_fields);
+
+/* Splits the entry and checks every field against the expected strings */
+static void check_fields(const char *entry, int expected_count, const char *expected[])
+{
+	wat_field_t fields[MAX_FIELDS];
+	char copy[64];
+	int count;
+	int i;
+
+	count = wat_cmd_entry_fields(entry, fields, MAX_FIELDS);
+	if (count != expected_count) {
+		fprintf(stderr, "\"%s\": %d fields, expected %d\n", entry, count, expected_count);
+	}
+	test_check(count == expected_count);
+
+	for (i = 0; i < count && i < MAX_FIELDS; i++) {
+		wat_field_copy(copy, sizeof(copy), &fields[i]);
+		if (strcmp(copy, expected[i])) {
+			fprintf(stderr, "\"%s\": field %d is \"%s\", expected \"%s\"\n", entry, i, copy, expected[i]);
+		}
+		test_check(!strcmp(copy, expected[i]));
+	}
+}
+
+static void test_fields(void)
+{
+	const char *clcc[] = { "1", "0", "3", "0", "0", "+15551234", "145" };
+	const char *empty[] = { "", "", "" };
+	const char *cmt[] = { "+15551234", "", "12/03/14,10:20:30-20" };
+	const char *blanks[] = { "1", "a b", "2" };
+	const char *unterminated[] = { "1", "abc" };
+	const char *after_quote[] = { "x", "2" };
+	wat_field_t fields[2];
+	char small[4];
+
+	check_fields(g_clcc_entry, 7, clcc);
+
+	/* Empty fields keep their position, including the first and the last */
+	check_fields(",,", 3, empty);
+	check_fields("", 0, NULL);
+	check_fields("  ", 0, NULL);
+
+	/* Commas inside quotes do not split, i.e text mode +CMT: <oa>,,<scts> */
+	check_fields("\"+15551234\",,\"12/03/14,10:20:30-20\"", 3, cmt);
+
+	check_fields(" 1 , a b ,2 ", 3, blanks);
+	check_fields("1,\"abc", 2, unterminated);
+	check_fields("\"x\"junk,2", 2, after_quote);
+
+	/* The real count comes back even if the array is smaller */
+	test_check(wat_cmd_entry_fields(g_clcc_entry, fields, wat_array_len(fields)) == 7);
+	test_check(wat_field_int(&fields[0]) == 1 && wat_field_int(&fields[1]) == 0);
+
+	/* Numbers stop at the end of the field, not at the end of the entry */
+	test_check(wat_cmd_entry_fields("-12,+5,7abc,,42", fields, 1) == 5);
+	test_check(wat_field_int(&fields[0]) == -12);
+	test_check(wat_cmd_entry_fields("42,1", fields, 1) == 2);
+	test_check(wat_field_int(&fields[0]) == 42);
+
+	test_check(wat_cmd_entry_fields("\"abcdef\"", fields, 1) == 1);
+	test_check(!strcmp(wat_field_copy(small, sizeof(small), &fields[0]), "abc"));
+}
+
+static void test_schema_parse(void)
+{
+	test_entry_t entry;
+
+	/* With or without the prefix, skipped fields keep the positions */
+	test_check(wat_schema_parse(&test_schema, "+CLCC: 1,0,3,0,0,\"+1555\",145", &entry) == 7);
+	test_check(entry.id == 1 && entry.dir == 0 && entry.stat == 3 && entry.type == 145);
+	test_check(!strcmp(entry.number, "+1555"));
+	test_check(wat_schema_parse(&test_schema, g_clcc_entry, &entry) == 7);
+
+	/* Strings are truncated to the member */
+	test_check(!strcmp(entry.number, "+155512"));
+
+	/* Missing fields are zeroed, not left over from a previous entry */
+	test_check(wat_schema_parse(&test_schema, "2,1,4", &entry) == 3);
+	test_check(entry.id == 2 && entry.dir == 1 && entry.stat == 4);
+	test_check(entry.number[0] == '\0' && entry.type == 0);
+
+	/* Extra fields are counted and ignored */
+	test_check(wat_schema_parse(&test_schema, "1,0,3,0,0,\"+1555\",145,\"Alice\",0", &entry) == 9);
+	test_check(entry.type == 145);
+
+	test_check(wat_schema_parse(&test_schema, "1,0", &entry) == -1);
+	test_check(wat_schema_parse(&test_schema, "", &entry) == -1);
+}
+
+/* The built-in tables on the default answers of the test modem, see test_modem.c */
+static void test_builtin_schemas(void)
+{
+	const wat_net_info_t *net_info;
+	const wat_sim_info_t *sim_info;
+	const wat_sig_info_t *sig_info;
+	unsigned elapsed;
+
+	test_check(test_modem_start(NULL, NULL) == 0);
+	test_check(test_modem_wait_ready(5000) == 0);
+
+	net_info = wat_span_get_net_info(TEST_MODEM_SPAN);
+	sim_info = wat_span_get_sim_info(TEST_MODEM_SPAN);
+	sig_info = wat_span_get_sig_info(TEST_MODEM_SPAN);
+	test_check(net_info && sim_info && sig_info);
+
+	/* The operator and the numbers are queried once the signaling is up, the SMSC last */
+	for (elapsed = 0; sim_info->smsc.digits[0] == '\0' && elapsed < 5000; elapsed++) {
+		test_modem_run();
+		usleep(1000);
+	}
+
+	test_check(!strcmp(net_info->operator_name, "Operator"));
+	test_check(net_info->stat == WAT_NET_REGISTERED_HOME);
+	test_check(!strcmp(sim_info->subscriber.digits, "+15551234"));
+	test_check(!strcmp(sim_info->smsc.digits, "+15550000"));
+	test_check(sig_info->rssi == 20 && sig_info->ber == 0);
+
+	/* The notify has a single field, the response two */
+	test_modem_feed("\r\n+CREG: 5\r\n", strlen("\r\n+CREG: 5\r\n"));
+	test_check(net_info->stat == WAT_NET_REGISTERED_ROAMING);
+
+	test_modem_stop();
+}
+
+static void bench_fields(unsigned iterations)
+{
+	wat_field_t fields[MAX_FIELDS];
+	uint64_t start;
+	unsigned total = 0;
+	unsigned i;
+
+	start = test_time_us();
+	for (i = 0; i < iterations; i++) {
+		total += wat_cmd_entry_fields(g_clcc_entry, fields, MAX_FIELDS);
+	}
+	printf("+CLCC entry: %.3f us/entry\n", (double)(test_time_us() - start) / iterations);
+	test_check(total == 7 * iterations);
+}
+
+static void bench_schema(unsigned iterations)
+{
+	test_entry_t entry;
+	uint64_t start;
+	unsigned total = 0;
+	unsigned i;
+
+	start = test_time_us();
+	for (i = 0; i < iterations; i++) {
+		total += wat_schema_parse(&test_schema, g_clcc_entry, &entry);
+	}
+	printf("+CLCC schema: %.3f us/entry\n", (double)(test_time_us() - start) / iterations);
+	test_check(total == 7 * iterations);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned iterations = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+	test_check(test_modem_register() == 0);
+
+	test_fields();
+	test_schema_parse();
+	test_builtin_schemas();
+	bench_fields(iterations);
+	bench_schema(iterations);
+	return 0;
+}
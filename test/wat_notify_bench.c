@@ -0,0 +1,154 @@
+/*
+ * libwat: Wireless AT commands library
+ *
+ * David Yat Sin <dyatsin@sangoma.com>
+ * Copyright (C) 2011, Sangoma Technologies.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+
+/* Checks that notifications reach the handler of the longest matching prefix, whatever
+   their case and including bytes outside of ASCII, then times the prefix lookup with
+   many prefixes registered.
+   Usage: wat_notify_bench [iterations] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libwat.h"
+#include "wat_internal.h"
+#include "test_utils.h"
+#include "test_modem.h"
+
+#define EXTRA_PREFIXES 200
+#define BURST_LINES 32
+
+static unsigned g_short_count;
+static unsigned g_long_count;
+static unsigned g_latin_count;
+
+static WAT_NOTIFY_FUNC(on_notify_short)
+{
+	g_short_count++;
+	return 1;
+}
+
+static WAT_NOTIFY_FUNC(on_notify_long)
+{
+	g_long_count++;
+	return 1;
+}
+
+static WAT_NOTIFY_FUNC(on_notify_latin)
+{
+	g_latin_count++;
+	return 1;
+}
+
+static void feed_line(const char *line)
+{
+	char data[128];
+
+	snprintf(data, sizeof(data), "\r\n%s\r\n", line);
+	test_modem_feed(data, strlen(data));
+}
+
+static void test_lookup(wat_span_t *span)
+{
+	test_check(wat_cmd_register(span, "+WTEST", on_notify_short) == WAT_SUCCESS);
+	test_check(wat_cmd_register(span, "+WTESTLONG", on_notify_long) == WAT_SUCCESS);
+	test_check(wat_cmd_register(span, "#W\xc9T", on_notify_latin) == WAT_SUCCESS);
+
+	feed_line("+WTEST: 1");
+	test_check(g_short_count == 1 && g_long_count == 0);
+
+	/* The longest prefix wins, the case does not matter */
+	feed_line("+wTestLong: 1");
+	test_check(g_short_count == 1 && g_long_count == 1);
+
+	/* A prefix of a longer one still matches on its own */
+	feed_line("+WTESTLO: 1");
+	test_check(g_short_count == 2 && g_long_count == 1);
+
+	/* Bytes above 0x7f are looked up as they are */
+	feed_line("#W\xc9T: 1");
+	test_check(g_latin_count == 1);
+	feed_line("#w\xc9t: 1");
+	test_check(g_latin_count == 2);
+}
+
+/* Lines nobody registered for stay in the buffer in case they belong to a response, so this runs last */
+static void test_no_match(void)
+{
+	unsigned short_count = g_short_count;
+	unsigned long_count = g_long_count;
+	unsigned latin_count = g_latin_count;
+
+	feed_line("+WTES: 1");
+	feed_line("\xff\xfe\xfd");
+	test_check(g_short_count == short_count && g_long_count == long_count && g_latin_count == latin_count);
+}
+
+static void bench_lookup(wat_span_t *span, unsigned iterations)
+{
+	char burst[BURST_LINES * sizeof("\r\n+WTESTLONG: 1\r\n")];
+	char prefix[16];
+	uint64_t start;
+	unsigned expected;
+	unsigned i;
+
+	/* Siblings of the benchmarked prefixes, on every level of the trie */
+	for (i = 0; i < EXTRA_PREFIXES; i++) {
+		snprintf(prefix, sizeof(prefix), "+W%03u", i);
+		test_check(wat_cmd_register(span, prefix, on_notify_short) == WAT_SUCCESS);
+		snprintf(prefix, sizeof(prefix), "+WTEST%03u", i);
+		test_check(wat_cmd_register(span, prefix, on_notify_short) == WAT_SUCCESS);
+	}
+
+	burst[0] = '\0';
+	for (i = 0; i < BURST_LINES; i++) {
+		strcat(burst, "\r\n+WTESTLONG: 1\r\n");
+	}
+
+	expected = g_long_count + (iterations * BURST_LINES);
+	start = test_time_us();
+	for (i = 0; i < iterations; i++) {
+		test_modem_feed(burst, strlen(burst));
+	}
+	printf("%d prefixes: %.3f us/notification\n", (2 * EXTRA_PREFIXES) + 3, (double)(test_time_us() - start) / ((double)iterations * BURST_LINES));
+	test_check(g_long_count == expected);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned iterations = (argc > 1) ? atoi(argv[1]) : 2000;
+	wat_span_t *span;
+
+	test_check(test_modem_start(NULL, NULL) == 0);
+	test_check(test_modem_wait_ready(5000) == 0);
+
+	span = wat_get_span(TEST_MODEM_SPAN);
+	test_check(span != NULL);
+
+	test_lookup(span);
+	bench_lookup(span, iterations);
+	test_no_match();
+
+	test_modem_stop();
+	return 0;
+}
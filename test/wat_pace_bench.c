@@ -0,0 +1,174 @@
+/*
+ * libwat: Wireless AT commands library
+ *
+ * David Yat Sin <dyatsin@sangoma.com>
+ * Copyright (C) 2011, Sangoma Technologies.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+
+/* Checks the adaptive command interval on the fake clock of the test modem: the gap after
+   a response shrinks down to the minimum of the module while the chip answers, goes back to
+   the configured interval when a command times out and stays fixed without the option.
+   Prints how long the start up of the span takes with and without it.
+   Usage: wat_pace_bench */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libwat.h"
+#include "wat_internal.h"
+#include "test_utils.h"
+#include "test_modem.h"
+
+#define TEST_TIMEOUT 1000
+#define MAX_SENT 8
+
+static uint64_t g_sent[MAX_SENT];
+static unsigned g_sent_count;
+
+/* Records when the commands of the test are sent, AT+WSLOW is never answered */
+static const char *pace_reply(const char *cmd)
+{
+	if (strncmp(cmd, "AT+W", 4)) {
+		return NULL;
+	}
+	if (g_sent_count < MAX_SENT) {
+		g_sent[g_sent_count++] = test_modem_now();
+	}
+	if (!strcmp(cmd, "AT+WSLOW")) {
+		return "";
+	}
+	return NULL;
+}
+
+static void wait_idle(wat_span_t *span)
+{
+	unsigned elapsed;
+
+	for (elapsed = 0; (span->cmd || span->cmd_busy || wat_cmd_pending(span) == WAT_TRUE) && elapsed < 60000; elapsed++) {
+		test_modem_advance(1);
+	}
+	test_check(!span->cmd && !span->cmd_busy);
+	g_sent_count = 0;
+}
+
+static uint32_t interval(void)
+{
+	wat_cmd_stats_t stats;
+
+	test_check(wat_span_get_cmd_stats(TEST_MODEM_SPAN, &stats) == WAT_SUCCESS);
+	return stats.interval;
+}
+
+/* Starts the span and returns how long it took to get ready and send its start up queries */
+static wat_span_t *start_span(wat_moduletype_t moduletype, wat_bool_t adaptive, uint64_t *startup)
+{
+	wat_span_config_t config;
+	wat_span_t *span;
+	uint64_t start;
+
+	memset(&config, 0, sizeof(config));
+	config.moduletype = moduletype;
+	config.timeout_command = TEST_TIMEOUT;
+	config.signal_poll_interval = 3600 * 1000;
+	config.adaptive_cmd_interval = adaptive;
+
+	test_modem_set_fake_clock();
+	start = test_modem_now();
+	test_check(test_modem_start(&config, pace_reply) == 0);
+	test_check(test_modem_wait_ready(10000) == 0);
+
+	span = wat_get_span(TEST_MODEM_SPAN);
+	test_check(span != NULL);
+	wait_idle(span);
+	*startup = test_modem_now() - start;
+	return span;
+}
+
+/* Time between the sends of two commands queued together, the first one answered right away */
+static uint64_t gap(wat_span_t *span)
+{
+	test_check(wat_cmd_enqueue(span, "AT+WP1", NULL, NULL, TEST_TIMEOUT) == WAT_SUCCESS);
+	test_check(wat_cmd_enqueue(span, "AT+WP2", NULL, NULL, TEST_TIMEOUT) == WAT_SUCCESS);
+	test_modem_advance(1);
+	while (g_sent_count < 2) {
+		test_modem_advance(1);
+	}
+	return g_sent[1] - g_sent[0];
+}
+
+static void test_fixed(void)
+{
+	wat_span_t *span;
+	uint64_t startup;
+
+	span = start_span(WAT_MODULE_TELIT_GC864, WAT_FALSE, &startup);
+	test_check(interval() == WAT_DEFAULT_COMMAND_INTERVAL);
+
+	test_check(gap(span) >= WAT_DEFAULT_COMMAND_INTERVAL);
+	wait_idle(span);
+	test_check(interval() == WAT_DEFAULT_COMMAND_INTERVAL);
+
+	printf("start up with a fixed %dms interval: %llu ms\n", WAT_DEFAULT_COMMAND_INTERVAL, (unsigned long long)startup);
+	test_modem_stop();
+}
+
+static void test_adaptive(wat_moduletype_t moduletype, const char *name)
+{
+	wat_span_t *span;
+	uint64_t startup;
+	uint32_t minimum;
+	uint32_t expected;
+
+	span = start_span(moduletype, WAT_TRUE, &startup);
+	minimum = span->module.min_cmd_interval;
+	test_check(minimum < WAT_DEFAULT_COMMAND_INTERVAL);
+
+	/* The start up queries were all answered */
+	test_check(interval() == minimum);
+	test_check(gap(span) <= minimum + 1);
+	wait_idle(span);
+
+	/* A timeout goes back to the configured interval */
+	test_check(wat_cmd_enqueue(span, "AT+WSLOW", NULL, NULL, TEST_TIMEOUT) == WAT_SUCCESS);
+	test_modem_advance(TEST_TIMEOUT + 1);
+	test_check(interval() == WAT_DEFAULT_COMMAND_INTERVAL);
+	wait_idle(span);
+
+	/* And halves it again with every answer */
+	for (expected = WAT_DEFAULT_COMMAND_INTERVAL; expected > minimum; ) {
+		expected = (expected / 2 > minimum) ? expected / 2 : minimum;
+		test_check(wat_cmd_enqueue(span, "AT+WP1", NULL, NULL, TEST_TIMEOUT) == WAT_SUCCESS);
+		wait_idle(span);
+		test_check(interval() == expected);
+	}
+	test_check(gap(span) <= minimum + 1);
+	wait_idle(span);
+
+	printf("start up with the adaptive interval on a %s (%ums minimum): %llu ms\n", name, minimum, (unsigned long long)startup);
+	test_modem_stop();
+}
+
+int main(int argc, char *argv[])
+{
+	test_fixed();
+	test_adaptive(WAT_MODULE_TELIT_GC864, "GC864");
+	test_adaptive(WAT_MODULE_TELIT_HE910, "HE910");
+	return 0;
+}
@@ -0,0 +1,287 @@
+/*
+ * libwat: Wireless AT commands library
+ *
+ * David Yat Sin <dyatsin@sangoma.com>
+ * Copyright (C) 2011, Sangoma Technologies.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+
+/* Checks that responses longer than the initial token list reach their handler, that
+   signal polls on a running span do not touch the heap once it is warmed up and that
+   a lock-free read buffer filled past its requested size is parsed in one pass, then
+   times the parser on notifications received in one burst and one byte at a time, and on
+   a long response received one byte at a time as the backlog of unparsed bytes grows.
+   Usage: wat_parser_bench [iterations] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libwat.h"
+#include "wat_internal.h"
+#include "test_utils.h"
+#include "test_modem.h"
+
+#define CMGL_ENTRIES 40
+#define BURST_LINES 32
+#define BACKLOG_LINES 200
+#define POLL_WARMUP 5
+#define POLL_CYCLES 50
+/* Fits in the read buffer, the response is only complete once its last byte is received */
+#define BYTEWISE_ENTRIES 90
+#define BYTEWISE_STEP 1024
+#define BYTEWISE_STEPS 8
+
+static unsigned g_backlog_count;
+
+static char g_cmgl_reply[CMGL_ENTRIES * 128];
+static char g_bytewise_reply[BYTEWISE_ENTRIES * 128];
+static int g_cmgl_tokens = -1;
+static wat_bool_t g_cmgl_success = WAT_FALSE;
+
+static const char *parser_reply(const char *cmd)
+{
+	/* Fed by bench_bytewise_backlog */
+	if (!strcmp(cmd, "AT+CMGL=5")) {
+		return "";
+	}
+	if (!strncmp(cmd, "AT+CMGL", 7)) {
+		return g_cmgl_reply;
+	}
+	return NULL;
+}
+
+static int on_cmgl_response(uint8_t span_id, char *tokens[], wat_bool_t success, void *obj, char *error)
+{
+	int i;
+
+	for (i = 0; tokens[i]; i++);
+	g_cmgl_tokens = i;
+	g_cmgl_success = success;
+	return i;
+}
+
+/* Two lines per entry */
+static void build_cmgl_reply(char *reply, int entries)
+{
+	int i;
+
+	reply[0] = '\0';
+	for (i = 0; i < entries; i++) {
+		char entry[128];
+
+		snprintf(entry, sizeof(entry), "\r\n+CMGL: %d,1,,23\r\n07911326040000F0040B911346610089F60000208062917314080CC8F71D14969741F977FD07", i + 1);
+		strcat(reply, entry);
+	}
+	strcat(reply, "\r\n\r\nOK\r\n");
+}
+
+static void test_long_response(void)
+{
+	unsigned elapsed;
+
+	/* More than fit in the initial token list */
+	build_cmgl_reply(g_cmgl_reply, CMGL_ENTRIES);
+
+	test_check(wat_cmd_req(TEST_MODEM_SPAN, "AT+CMGL=4", on_cmgl_response, NULL) == WAT_SUCCESS);
+	for (elapsed = 0; g_cmgl_tokens < 0 && elapsed < 5000; elapsed++) {
+		test_modem_run();
+		usleep(1000);
+	}
+
+	test_check(g_cmgl_success == WAT_TRUE);
+	test_check(g_cmgl_tokens == (2 * CMGL_ENTRIES) + 1);
+}
+
+/* One AT+CSQ poll, written, answered, parsed and completed */
+static void poll_cycle(wat_span_t *span)
+{
+	unsigned elapsed;
+
+	test_check(wat_cmd_enqueue_query(span, WAT_CMD_PRIO_NORMAL, "AT+CSQ", wat_response_csq, NULL, span->config.timeout_command) == WAT_SUCCESS);
+	test_modem_run();
+	for (elapsed = 0; (span->cmd || wat_cmd_pending(span) == WAT_TRUE) && elapsed < 5000; elapsed++) {
+		test_modem_run();
+		usleep(1000);
+	}
+	test_check(!span->cmd && wat_cmd_pending(span) == WAT_FALSE);
+}
+
+static void test_steady_state_polls(void)
+{
+	wat_span_t *span = wat_get_span(TEST_MODEM_SPAN);
+	uint64_t allocs_before, frees_before;
+	uint64_t allocs, frees;
+	unsigned i;
+
+	/* The command pool and the token arena get to their working size */
+	for (i = 0; i < POLL_WARMUP; i++) {
+		poll_cycle(span);
+	}
+
+	wat_mem_get_counters(&allocs_before, &frees_before);
+	for (i = 0; i < POLL_CYCLES; i++) {
+		poll_cycle(span);
+	}
+	wat_mem_get_counters(&allocs, &frees);
+
+	printf("%d signal polls: %llu heap allocs, %llu frees\n", POLL_CYCLES,
+		(unsigned long long)(allocs - allocs_before), (unsigned long long)(frees - frees_before));
+	test_check(allocs == allocs_before);
+	test_check(frees == frees_before);
+}
+
+static WAT_NOTIFY_FUNC(on_notify_backlog)
+{
+	g_backlog_count++;
+	return 1;
+}
+
+/* Lock-free buffers are rounded up to a power of two, so they hold more than WAT_BUFFER_SZ */
+static void test_lockfree_backlog(void)
+{
+	wat_span_config_t config;
+	wat_span_t *span;
+	char line[128];
+	unsigned total = 0;
+	unsigned i;
+
+	memset(&config, 0, sizeof(config));
+	config.moduletype = WAT_MODULE_TELIT_GC864;
+	config.lockfree_rx = WAT_TRUE;
+	test_check(test_modem_start(&config, NULL) == 0);
+	test_check(test_modem_wait_ready(5000) == 0);
+
+	span = wat_get_span(TEST_MODEM_SPAN);
+	test_check(span != NULL);
+	test_check(wat_cmd_register(span, "+WBACKLOG", on_notify_backlog) == WAT_SUCCESS);
+
+	/* Received before the span gets to parse any of it */
+	for (i = 0; i < BACKLOG_LINES; i++) {
+		snprintf(line, sizeof(line), "\r\n+WBACKLOG: %03u,0123456789012345678901234567890123456789\r\n", i);
+		test_check(wat_span_process_read(TEST_MODEM_SPAN, line, strlen(line)) == WAT_SUCCESS);
+		total += strlen(line);
+	}
+	test_check(total > WAT_BUFFER_SZ);
+
+	wat_span_run(TEST_MODEM_SPAN);
+	test_check(g_backlog_count == BACKLOG_LINES);
+	test_check(span->token_arena.used <= span->token_arena.size);
+
+	test_modem_stop();
+}
+
+static void bench_burst(unsigned iterations)
+{
+	char burst[BURST_LINES * sizeof("\r\n+CREG: 1\r\n")];
+	uint64_t start;
+	unsigned i;
+
+	burst[0] = '\0';
+	for (i = 0; i < BURST_LINES; i++) {
+		strcat(burst, "\r\n+CREG: 1\r\n");
+	}
+
+	start = test_time_us();
+	for (i = 0; i < iterations; i++) {
+		test_modem_feed(burst, strlen(burst));
+	}
+	printf("burst of %d lines: %.3f us/line\n", BURST_LINES, (double)(test_time_us() - start) / ((double)iterations * BURST_LINES));
+}
+
+static void bench_bytewise(unsigned iterations)
+{
+	const char line[] = "\r\n+CREG: 1\r\n";
+	uint64_t start;
+	unsigned i, j;
+
+	start = test_time_us();
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < sizeof(line) - 1; j++) {
+			test_modem_feed(&line[j], 1);
+		}
+	}
+	printf("one byte at a time: %.3f us/line\n", (double)(test_time_us() - start) / iterations);
+}
+
+/* The whole response stays in the read buffer until its final result arrives, each byte
+   received should only cost the parsing of that byte however many came before it */
+static void bench_bytewise_backlog(unsigned rounds)
+{
+	wat_span_t *span = wat_get_span(TEST_MODEM_SPAN);
+	uint64_t step_us[BYTEWISE_STEPS];
+	uint32_t len;
+	unsigned elapsed;
+	unsigned i, j;
+
+	build_cmgl_reply(g_bytewise_reply, BYTEWISE_ENTRIES);
+	len = strlen(g_bytewise_reply);
+	test_check(len > BYTEWISE_STEP * BYTEWISE_STEPS && len < WAT_BUFFER_SZ);
+
+	memset(step_us, 0, sizeof(step_us));
+	for (i = 0; i < rounds; i++) {
+		g_cmgl_tokens = -1;
+		test_check(wat_cmd_req(TEST_MODEM_SPAN, "AT+CMGL=5", on_cmgl_response, NULL) == WAT_SUCCESS);
+		/* Sent, and not the previous round still active for the command interval */
+		for (elapsed = 0; !(span->cmd && span->cmd_busy && !span->cmd->answered && !strcmp(span->cmd->cmd, "AT+CMGL=5")) && elapsed < 5000; elapsed++) {
+			test_modem_run();
+			usleep(1000);
+		}
+		test_check(span->cmd && !span->cmd->answered && !strcmp(span->cmd->cmd, "AT+CMGL=5"));
+
+		for (j = 0; j < len; j++) {
+			uint64_t start = test_time_us();
+
+			test_modem_feed(&g_bytewise_reply[j], 1);
+			if (j / BYTEWISE_STEP < BYTEWISE_STEPS) {
+				step_us[j / BYTEWISE_STEP] += test_time_us() - start;
+			}
+		}
+		test_check(g_cmgl_success == WAT_TRUE);
+		test_check(g_cmgl_tokens == (2 * BYTEWISE_ENTRIES) + 1);
+	}
+
+	for (i = 0; i < BYTEWISE_STEPS; i++) {
+		printf("one byte at a time, %5u bytes backlog: %.3f us/byte\n", (i + 1) * BYTEWISE_STEP,
+			(double)step_us[i] / ((double)rounds * BYTEWISE_STEP));
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned iterations = (argc > 1) ? atoi(argv[1]) : 2000;
+
+	test_check(test_modem_start(NULL, parser_reply) == 0);
+	test_check(test_modem_wait_ready(5000) == 0);
+
+	test_long_response();
+	test_steady_state_polls();
+	test_modem_stop();
+
+	test_lockfree_backlog();
+
+	test_check(test_modem_start(NULL, parser_reply) == 0);
+	test_check(test_modem_wait_ready(5000) == 0);
+	bench_burst(iterations);
+	bench_bytewise(iterations);
+	bench_bytewise_backlog((iterations / 200) ? (iterations / 200) : 1);
+
+	test_modem_stop();
+	return 0;
+}
@@ -0,0 +1,311 @@
+/*
+ * libwat: Wireless AT commands library
+ *
+ * David Yat Sin <dyatsin@sangoma.com>
+ * Copyright (C) 2011, Sangoma Technologies.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+
+/* Runs a span from the reactor over a socket pair, the test answering from the other end.
+   Checks that received data reaches the handlers, that writes the device refused are
+   resumed once it is writable, that a full read buffer stops and then resumes reading
+   with back-pressure and that a hangup raises WAT_ALARM_DEVICE_FAIL, then times the
+   dispatch of notifications read by the reactor.
+   Usage: wat_reactor_bench [iterations] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "libwat.h"
+#include "wat_internal.h"
+#include "test_utils.h"
+#include "test_modem.h"
+
+#define BURST_LINES 32
+/* 50 bytes, so that a full read buffer ends with a complete line. A partial last line
+   would keep the span from parsing the others */
+#define HOLD_LINE "\r\n+WHOLD: 01234567890123456789012345678901234567\r\n"
+
+static int g_fds[2] = { -1, -1 };
+static char g_modem_in[8192];
+static unsigned g_modem_in_len;
+
+static unsigned g_notify_count;
+static unsigned g_hold_count;
+static int g_hold = 1;
+static int g_answered;
+static wat_bool_t g_answer_success;
+
+static WAT_NOTIFY_FUNC(on_notify_test)
+{
+	g_notify_count++;
+	return 1;
+}
+
+/* Leaves the lines in the read buffer while g_hold is set */
+static WAT_NOTIFY_FUNC(on_notify_hold)
+{
+	if (g_hold) {
+		return 0;
+	}
+	g_hold_count++;
+	return 1;
+}
+
+static int on_cmd_response(uint8_t span_id, char *tokens[], wat_bool_t success, void *obj, char *error)
+{
+	int i;
+
+	for (i = 0; tokens[i]; i++);
+	g_answered++;
+	g_answer_success = success;
+	return i;
+}
+
+/* Answers the commands the span wrote to its end of the socket pair */
+static void modem_serve(void)
+{
+	char *end;
+	ssize_t res;
+
+	res = recv(g_fds[1], &g_modem_in[g_modem_in_len], sizeof(g_modem_in) - g_modem_in_len - 1, MSG_DONTWAIT);
+	if (res > 0) {
+		g_modem_in_len += res;
+	}
+
+	while ((end = memchr(g_modem_in, '\r', g_modem_in_len)) != NULL) {
+		uint32_t len = end - g_modem_in;
+		const char *reply;
+
+		*end = '\0';
+		if (len) {
+			reply = test_modem_reply(g_modem_in);
+			test_check(send(g_fds[1], reply, strlen(reply), 0) == (ssize_t)strlen(reply));
+		}
+		memmove(g_modem_in, end + 1, g_modem_in_len - len - 1);
+		g_modem_in_len -= len + 1;
+	}
+}
+
+static void modem_send(const char *data)
+{
+	test_check(send(g_fds[1], data, strlen(data), 0) == (ssize_t)strlen(data));
+}
+
+static void run(unsigned loops)
+{
+	unsigned i;
+
+	for (i = 0; i < loops; i++) {
+		test_check(wat_reactor_run(1) == WAT_SUCCESS);
+		modem_serve();
+	}
+}
+
+/* Bytes waiting to be read on the span end of the socket pair */
+static int device_pending(void)
+{
+	int pending = 0;
+
+	test_check(ioctl(g_fds[0], FIONREAD, &pending) == 0);
+	return pending;
+}
+
+static wat_span_t *start_span(wat_buffer_policy_t policy)
+{
+	wat_span_config_t config;
+	wat_span_t *span;
+	unsigned elapsed;
+
+	test_check(socketpair(AF_UNIX, SOCK_STREAM, 0, g_fds) == 0);
+	test_check(fcntl(g_fds[0], F_SETFL, O_NONBLOCK) == 0);
+	g_modem_in_len = 0;
+
+	memset(&config, 0, sizeof(config));
+	config.moduletype = WAT_MODULE_TELIT_GC864;
+	config.rx_buffer_policy = policy;
+
+	test_check(test_modem_register() == 0);
+	test_modem_set_fd(g_fds[0]);
+	test_check(test_modem_start(&config, NULL) == 0);
+	test_check(wat_reactor_add_span(TEST_MODEM_SPAN, g_fds[0]) == WAT_SUCCESS);
+
+	span = wat_get_span(TEST_MODEM_SPAN);
+	test_check(span != NULL);
+	/* Until the start up queries are answered, so that nothing comes in between the test data */
+	for (elapsed = 0; (span->state != WAT_SPAN_STATE_RUNNING || span->cmd_busy || wat_cmd_pending(span) == WAT_TRUE) && elapsed < 5000; elapsed++) {
+		run(1);
+	}
+	test_check(span->state == WAT_SPAN_STATE_RUNNING);
+	return span;
+}
+
+static void stop_span(void)
+{
+	test_check(wat_reactor_remove_span(TEST_MODEM_SPAN) == WAT_SUCCESS);
+	test_modem_stop();
+	close(g_fds[0]);
+	if (g_fds[1] >= 0) {
+		close(g_fds[1]);
+	}
+	g_fds[0] = g_fds[1] = -1;
+}
+
+static void test_read(wat_span_t *span)
+{
+	unsigned elapsed;
+
+	test_check(wat_cmd_register(span, "+WTEST", on_notify_test) == WAT_SUCCESS);
+
+	/* The second line is split over two reads */
+	modem_send("\r\n+WTEST: 1\r\n\r\n+WTE");
+	run(5);
+	modem_send("ST: 2\r\n");
+	for (elapsed = 0; g_notify_count < 2 && elapsed < 1000; elapsed++) {
+		run(1);
+	}
+	test_check(g_notify_count == 2);
+}
+
+/* The device takes nothing until the test reads what already fills the socket */
+static void test_write_resume(void)
+{
+	char junk[4096];
+	unsigned filled = 0;
+	unsigned elapsed;
+	ssize_t res;
+
+	memset(junk, 'J', sizeof(junk));
+	while ((res = write(g_fds[0], junk, sizeof(junk))) > 0) {
+		filled += res;
+	}
+	test_check(res < 0 && errno == EAGAIN);
+
+	g_answered = 0;
+	test_check(wat_cmd_req(TEST_MODEM_SPAN, "AT+WRESUME", on_cmd_response, NULL) == WAT_SUCCESS);
+	for (elapsed = 0; wat_span_want_write(TEST_MODEM_SPAN) == WAT_FALSE && elapsed < 1000; elapsed++) {
+		test_check(wat_reactor_run(1) == WAT_SUCCESS);
+	}
+	test_check(wat_span_want_write(TEST_MODEM_SPAN) == WAT_TRUE);
+
+	while (filled) {
+		res = recv(g_fds[1], junk, (filled < sizeof(junk)) ? filled : sizeof(junk), 0);
+		test_check(res > 0);
+		filled -= res;
+	}
+
+	/* Nothing but the reactor writes the command now */
+	for (elapsed = 0; !g_answered && elapsed < 5000; elapsed++) {
+		run(1);
+	}
+	test_check(g_answered == 1 && g_answer_success == WAT_TRUE);
+	test_check(wat_span_want_write(TEST_MODEM_SPAN) == WAT_FALSE);
+}
+
+static void test_backpressure(void)
+{
+	wat_rx_stats_t stats;
+	wat_span_t *span;
+	unsigned lines = (WAT_BUFFER_SZ / (sizeof(HOLD_LINE) - 1)) + 20;
+	unsigned elapsed;
+	unsigned i;
+
+	test_check(!(WAT_BUFFER_SZ % (sizeof(HOLD_LINE) - 1)));
+
+	span = start_span(WAT_BUFFER_POLICY_BACKPRESSURE);
+	test_check(wat_cmd_register(span, "+WHOLD", on_notify_hold) == WAT_SUCCESS);
+
+	for (i = 0; i < lines; i++) {
+		modem_send(HOLD_LINE);
+	}
+	run(20);
+
+	/* The buffer is full of lines the span keeps, the rest stays in the device */
+	test_check(wat_span_get_rx_stats(TEST_MODEM_SPAN, &stats) == WAT_SUCCESS);
+	test_check(stats.refused_count > 0);
+	test_check(device_pending() > 0);
+	test_check(g_hold_count == 0);
+
+	/* Nothing new can be received while the buffer is full, so have the span look at it again */
+	g_hold = 0;
+	span->buffer->new_data = 1;
+	wat_span_run(TEST_MODEM_SPAN);
+	test_check(g_hold_count > 0);
+	for (elapsed = 0; (g_hold_count < lines || device_pending()) && elapsed < 1000; elapsed++) {
+		run(1);
+	}
+	test_check(g_hold_count == lines);
+	test_check(device_pending() == 0);
+
+	stop_span();
+}
+
+static void test_hangup(wat_span_t *span)
+{
+	close(g_fds[1]);
+	g_fds[1] = -1;
+
+	run(5);
+	test_check(span->alarm == WAT_ALARM_DEVICE_FAIL);
+}
+
+static void bench_notify(unsigned iterations)
+{
+	char burst[BURST_LINES * sizeof("\r\n+WTEST: 1\r\n")];
+	uint64_t start;
+	unsigned expected;
+	unsigned i;
+
+	burst[0] = '\0';
+	for (i = 0; i < BURST_LINES; i++) {
+		strcat(burst, "\r\n+WTEST: 1\r\n");
+	}
+
+	expected = g_notify_count + (iterations * BURST_LINES);
+	start = test_time_us();
+	for (i = 0; i < iterations; i++) {
+		modem_send(burst);
+		while (g_notify_count < expected - ((iterations - i - 1) * BURST_LINES)) {
+			test_check(wat_reactor_run(1) == WAT_SUCCESS);
+		}
+	}
+	printf("reactor: %.3f us/notification\n", (double)(test_time_us() - start) / ((double)iterations * BURST_LINES));
+	test_check(g_notify_count == expected);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned iterations = (argc > 1) ? atoi(argv[1]) : 2000;
+	wat_span_t *span;
+
+	span = start_span(WAT_BUFFER_POLICY_DROP);
+	test_read(span);
+	test_write_resume();
+	bench_notify(iterations);
+	test_hangup(span);
+	stop_span();
+
+	test_backpressure();
+	return 0;
+}
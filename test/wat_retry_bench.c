@@ -0,0 +1,558 @@
+/*
+ * libwat: Wireless AT commands library
+ *
+ * David Yat Sin <dyatsin@sangoma.com>
+ * Copyright (C) 2011, Sangoma Technologies.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+
+/* Checks what happens to commands the chip does not answer, on the fake clock of the test
+   modem: read-only queries are sent again in place with a doubling back-off, commands with
+   side effects (ATD) are not, and a write the device fails times the command out right away.
+   Checks that the rest of a write a pipe only partly took is written once the pipe is
+   drained, and that a pipe nobody reads anymore, or a device that takes nothing without
+   an error, drops the data instead of waiting for it.
+   Also checks that commands whose deadline passed or that were cancelled in the queue are
+   dropped without being sent, what wat_cmd_cancel returns once they are not queued and that
+   a batch failing or timing out midway is sent again one command at a time, each handler
+   getting the lines of its own command. Prints how long a lost reply delays the answer.
+   Usage: wat_retry_bench */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libwat.h"
+#include "wat_internal.h"
+#include "test_utils.h"
+#include "test_modem.h"
+
+#define TEST_TIMEOUT 1000
+#define MAX_SENT 32
+#define BATCH_SECTIONS 3
+/* More than PIPE_BUF, so that a pipe with less room takes part of it */
+#define PARTIAL_WRITE_SZ 6000
+
+typedef struct {
+	char cmd[32];
+	uint64_t time;
+} sent_cmd_t;
+
+static sent_cmd_t g_sent[MAX_SENT];
+static unsigned g_sent_count;
+static unsigned g_csq_drops;
+static unsigned g_csq_rssi = 20;
+static unsigned g_atd_drops;
+static unsigned g_batch_drops;
+static int g_batch_error;
+
+typedef struct {
+	int called;
+	wat_bool_t success;
+	wat_bool_t tokens;
+	char error[32];
+} user_reply_t;
+
+typedef struct {
+	int called;
+	wat_bool_t success;
+	int count;
+	char tokens[2][32];
+} section_reply_t;
+
+/* Records the commands of the test and loses the replies it is told to */
+static const char *retry_reply(const char *cmd)
+{
+	if (strncmp(cmd, "AT+CSQ", 6) && strncmp(cmd, "AT+W", 4) && strncmp(cmd, "ATD", 3)) {
+		return NULL;
+	}
+
+	if (g_sent_count < MAX_SENT) {
+		snprintf(g_sent[g_sent_count].cmd, sizeof(g_sent[0].cmd), "%s", cmd);
+		g_sent[g_sent_count].time = test_modem_now();
+		g_sent_count++;
+	}
+
+	if (!strncmp(cmd, "AT+CSQ", 6)) {
+		static char reply[64];
+
+		if (g_csq_drops) {
+			g_csq_drops--;
+			return "";
+		}
+		snprintf(reply, sizeof(reply), "\r\n+CSQ: %u,1\r\n\r\nOK\r\n", g_csq_rssi);
+		return reply;
+	}
+	if (!strcmp(cmd, "AT+WSLOW")) {
+		return "";
+	}
+	/* Sections of the batch, AT+WB2 fails or does not answer as told */
+	if (!strncmp(cmd, "AT+WB", 5)) {
+		static char reply[64];
+
+		if (!strcmp(cmd, "AT+WB2") && g_batch_error) {
+			return "\r\nERROR\r\n";
+		}
+		if (!strcmp(cmd, "AT+WB2") && g_batch_drops) {
+			g_batch_drops--;
+			return "";
+		}
+		snprintf(reply, sizeof(reply), "\r\n+WB%c: %c\r\n\r\nOK\r\n", cmd[5], cmd[5]);
+		return reply;
+	}
+	if (!strncmp(cmd, "ATD", 3) && g_atd_drops) {
+		g_atd_drops--;
+		return "";
+	}
+	return NULL;
+}
+
+static void wait_idle(wat_span_t *span)
+{
+	unsigned elapsed;
+
+	for (elapsed = 0; (span->cmd || span->cmd_busy || wat_cmd_pending(span) == WAT_TRUE) && elapsed < 60000; elapsed++) {
+		test_modem_advance(1);
+	}
+	test_check(!span->cmd && !span->cmd_busy);
+	g_sent_count = 0;
+}
+
+static uint32_t retried(void)
+{
+	wat_cmd_stats_t stats;
+
+	test_check(wat_span_get_cmd_stats(TEST_MODEM_SPAN, &stats) == WAT_SUCCESS);
+	return stats.retried;
+}
+
+static uint32_t dropped(void)
+{
+	wat_cmd_stats_t stats;
+
+	test_check(wat_span_get_cmd_stats(TEST_MODEM_SPAN, &stats) == WAT_SUCCESS);
+	return stats.dropped;
+}
+
+static int was_sent(const char *cmd)
+{
+	unsigned i;
+
+	for (i = 0; i < g_sent_count; i++) {
+		if (!strcmp(g_sent[i].cmd, cmd)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int on_user_reply(uint8_t span_id, char *tokens[], wat_bool_t success, void *obj, char *error)
+{
+	user_reply_t *reply = obj;
+
+	reply->called++;
+	reply->success = success;
+	reply->tokens = tokens[0] ? WAT_TRUE : WAT_FALSE;
+	snprintf(reply->error, sizeof(reply->error), "%s", error ? error : "");
+	return tokens[0] ? 1 : 0;
+}
+
+/* The query is sent again before the command queued behind it */
+static void test_retry_in_place(wat_span_t *span)
+{
+	const wat_sig_info_t *sig_info = wat_span_get_sig_info(TEST_MODEM_SPAN);
+	uint32_t retried_before = retried();
+	unsigned elapsed;
+
+	wait_idle(span);
+	g_csq_rssi = 25;
+	g_csq_drops = 1;
+	test_check(wat_cmd_enqueue_query(span, WAT_CMD_PRIO_NORMAL, "AT+CSQ", wat_response_csq, NULL, TEST_TIMEOUT) == WAT_SUCCESS);
+	test_check(wat_cmd_enqueue_query(span, WAT_CMD_PRIO_NORMAL, "AT+WNEXT", NULL, NULL, TEST_TIMEOUT) == WAT_SUCCESS);
+
+	for (elapsed = 0; sig_info->rssi != 25 && elapsed < 10 * TEST_TIMEOUT; elapsed++) {
+		test_modem_advance(1);
+	}
+	test_check(sig_info->rssi == 25 && sig_info->ber == 1);
+	test_check(retried() == retried_before + 1);
+
+	test_modem_advance(100);
+	test_check(g_sent_count == 3);
+	test_check(!strcmp(g_sent[0].cmd, "AT+CSQ") && !strcmp(g_sent[1].cmd, "AT+CSQ") && !strcmp(g_sent[2].cmd, "AT+WNEXT"));
+	test_check(g_sent[1].time - g_sent[0].time == TEST_TIMEOUT + WAT_CMD_RETRY_BACKOFF);
+
+	printf("lost AT+CSQ reply: answered after %llu ms (timeout %d ms)\n", (unsigned long long)(g_sent[1].time - g_sent[0].time), TEST_TIMEOUT);
+}
+
+static void test_backoff(wat_span_t *span)
+{
+	uint32_t retried_before = retried();
+	unsigned i;
+
+	wait_idle(span);
+	g_csq_drops = WAT_MAX_CMD_RETRIES + 1;
+	test_check(wat_cmd_enqueue_query(span, WAT_CMD_PRIO_NORMAL, "AT+CSQ", wat_response_csq, NULL, TEST_TIMEOUT) == WAT_SUCCESS);
+	test_modem_advance(10 * TEST_TIMEOUT);
+
+	/* Sent once, then once per retry with twice the pause of the previous one, then given up */
+	test_check(g_sent_count == WAT_MAX_CMD_RETRIES + 1);
+	for (i = 1; i < g_sent_count; i++) {
+		test_check(!strcmp(g_sent[i].cmd, "AT+CSQ"));
+		test_check(g_sent[i].time - g_sent[i - 1].time == TEST_TIMEOUT + (WAT_CMD_RETRY_BACKOFF << (i - 1)));
+	}
+	test_check(retried() == retried_before + WAT_MAX_CMD_RETRIES);
+	test_check(!span->cmd);
+	g_csq_drops = 0;
+}
+
+/* Dialing again could place a second call */
+static void test_no_resend(wat_span_t *span)
+{
+	wat_con_event_t con_event;
+	uint32_t retried_before = retried();
+	unsigned dialed = 0;
+	unsigned i;
+
+	wait_idle(span);
+	memset(&con_event, 0, sizeof(con_event));
+	con_event.type = WAT_CALL_TYPE_VOICE;
+	strcpy(con_event.called_num.digits, "5551234");
+
+	g_atd_drops = 1;
+	test_check(wat_con_req(TEST_MODEM_SPAN, 8, &con_event) == WAT_SUCCESS);
+	test_modem_advance(60000);
+
+	for (i = 0; i < g_sent_count; i++) {
+		if (!strncmp(g_sent[i].cmd, "ATD", 3)) {
+			dialed++;
+		}
+	}
+	test_check(dialed == 1);
+	test_check(retried() == retried_before);
+	test_check(!span->cmd);
+}
+
+/* A device that fails the write will not answer, there is no point waiting for the timeout */
+static void test_write_failure(wat_span_t *span)
+{
+	uint32_t retried_before = retried();
+	uint64_t start;
+	int fd;
+
+	wait_idle(span);
+	fd = open("/dev/full", O_WRONLY);
+	test_check(fd >= 0);
+	test_modem_set_fd(fd);
+
+	start = test_modem_now();
+	test_check(wat_cmd_enqueue_query(span, WAT_CMD_PRIO_NORMAL, "AT+CSQ", wat_response_csq, NULL, 10 * TEST_TIMEOUT) == WAT_SUCCESS);
+	while (test_modem_now() - start < 10 * TEST_TIMEOUT && !(retried() == retried_before + WAT_MAX_CMD_RETRIES && !span->cmd)) {
+		test_modem_advance(1);
+	}
+	test_check(retried() == retried_before + WAT_MAX_CMD_RETRIES);
+	test_check(!span->cmd);
+
+	/* Only the back-off pauses, not the timeouts */
+	test_check(test_modem_now() - start < TEST_TIMEOUT);
+
+	test_modem_set_fd(-1);
+	close(fd);
+}
+
+static WAT_RESPONSE_FUNC(on_section_reply)
+{
+	section_reply_t *reply = obj;
+	int i;
+
+	reply->called++;
+	reply->success = success;
+	for (i = 0; tokens[i]; i++) {
+		if (i < 2) {
+			snprintf(reply->tokens[i], sizeof(reply->tokens[i]), "%s", tokens[i]);
+		}
+	}
+	reply->count = i;
+	return i;
+}
+
+/* Queues AT+WB1;+WB2;+WB3, each section answering with one line, and runs until every
+   section was answered. Returns the number of command lines the span wrote */
+static unsigned run_batch(wat_span_t *span, section_reply_t replies[BATCH_SECTIONS])
+{
+	static const char *cmds[BATCH_SECTIONS] = { "+WB1", "+WB2", "+WB3" };
+	wat_cmd_section_t sections[BATCH_SECTIONS];
+	unsigned commands;
+	unsigned elapsed;
+	int i;
+
+	wait_idle(span);
+	memset(replies, 0, BATCH_SECTIONS * sizeof(replies[0]));
+	for (i = 0; i < BATCH_SECTIONS; i++) {
+		sections[i].cmd = cmds[i];
+		sections[i].cb = on_section_reply;
+		sections[i].obj = &replies[i];
+		sections[i].lines = 1;
+	}
+
+	commands = test_modem_commands();
+	test_check(wat_cmd_enqueue_batch(span, sections, BATCH_SECTIONS, TEST_TIMEOUT) == WAT_SUCCESS);
+	for (elapsed = 0; !replies[BATCH_SECTIONS - 1].called && elapsed < 10 * TEST_TIMEOUT; elapsed++) {
+		test_modem_advance(1);
+	}
+	for (i = 0; i < BATCH_SECTIONS; i++) {
+		test_check(replies[i].called == 1);
+	}
+	return test_modem_commands() - commands;
+}
+
+/* Each section gets its own line followed by the final result */
+static void check_section(section_reply_t *reply, int section)
+{
+	char line[32];
+
+	snprintf(line, sizeof(line), "+WB%d: %d", section + 1, section + 1);
+	test_check(reply->success == WAT_TRUE);
+	test_check(reply->count == 2);
+	test_check(!strcmp(reply->tokens[0], line) && !strcmp(reply->tokens[1], "OK"));
+}
+
+static void test_batch(wat_span_t *span)
+{
+	section_reply_t replies[BATCH_SECTIONS];
+	int i;
+
+	test_check(run_batch(span, replies) == 1);
+	for (i = 0; i < BATCH_SECTIONS; i++) {
+		check_section(&replies[i], i);
+	}
+}
+
+static void test_batch_error(wat_span_t *span)
+{
+	section_reply_t replies[BATCH_SECTIONS];
+
+	g_batch_error = 1;
+	/* The batch, then every command of it on its own */
+	test_check(run_batch(span, replies) == 1 + BATCH_SECTIONS);
+	g_batch_error = 0;
+
+	check_section(&replies[0], 0);
+	test_check(replies[1].success == WAT_FALSE);
+	test_check(replies[1].count == 1 && !strcmp(replies[1].tokens[0], "ERROR"));
+	check_section(&replies[2], 2);
+}
+
+static void test_batch_timeout(wat_span_t *span)
+{
+	section_reply_t replies[BATCH_SECTIONS];
+	uint32_t retried_before = retried();
+	int i;
+
+	/* Not sent again as a batch, the chip may have executed some of it */
+	g_batch_drops = 1;
+	test_check(run_batch(span, replies) == 1 + BATCH_SECTIONS);
+	test_check(!g_batch_drops);
+	test_check(retried() == retried_before);
+
+	for (i = 0; i < BATCH_SECTIONS; i++) {
+		check_section(&replies[i], i);
+	}
+}
+
+/* The command is still queued behind one the chip does not answer when its deadline passes */
+/* The pipe has room for one page when the span writes, then the test drains it */
+static void test_partial_write(wat_span_t *span)
+{
+	uint8_t data[PARTIAL_WRITE_SZ];
+	uint8_t received[PARTIAL_WRITE_SZ];
+	uint8_t junk[4096];
+	const uint8_t *pending;
+	wat_size_t pending_len;
+	unsigned filled = 0;
+	unsigned received_len = 0;
+	unsigned elapsed;
+	ssize_t res;
+	int fds[2];
+	unsigned i;
+
+	wait_idle(span);
+	test_check(pipe(fds) == 0);
+	test_check(fcntl(fds[1], F_SETFL, O_NONBLOCK) == 0);
+	test_check(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+
+	memset(junk, 'J', sizeof(junk));
+	while ((res = write(fds[1], junk, sizeof(junk))) > 0) {
+		filled += res;
+	}
+	test_check(res < 0 && errno == EAGAIN);
+	test_check(read(fds[0], junk, sizeof(junk)) == sizeof(junk));
+	filled -= sizeof(junk);
+
+	for (i = 0; i < sizeof(data); i++) {
+		data[i] = (uint8_t)(i * 7);
+	}
+	test_modem_set_fd(fds[1]);
+	test_check(wat_span_write(span, data, sizeof(data)) == sizeof(data));
+	test_check(wat_span_want_write(TEST_MODEM_SPAN) == WAT_TRUE);
+	test_check(wat_buffer_view(span->tx_buffer, &pending, &pending_len) == WAT_SUCCESS);
+	test_check(pending_len > 0 && pending_len < sizeof(data));
+
+	while (filled) {
+		res = read(fds[0], junk, (filled < sizeof(junk)) ? filled : sizeof(junk));
+		test_check(res > 0);
+		filled -= res;
+	}
+
+	/* Resumed where the device stopped, nothing lost or written twice */
+	for (elapsed = 0; received_len < sizeof(data) && elapsed < 1000; elapsed++) {
+		wat_span_process_write(TEST_MODEM_SPAN);
+		res = read(fds[0], &received[received_len], sizeof(received) - received_len);
+		if (res > 0) {
+			received_len += res;
+		}
+	}
+	test_check(received_len == sizeof(data));
+	test_check(!memcmp(received, data, sizeof(data)));
+	test_check(read(fds[0], junk, sizeof(junk)) < 0 && errno == EAGAIN);
+	test_check(wat_span_want_write(TEST_MODEM_SPAN) == WAT_FALSE);
+
+	/* Nothing will ever be read, the write fails instead of being retried forever */
+	close(fds[0]);
+	signal(SIGPIPE, SIG_IGN);
+	test_check(wat_span_write(span, data, sizeof(data)) == sizeof(data));
+	test_check(wat_span_want_write(TEST_MODEM_SPAN) == WAT_FALSE);
+	test_check(wat_buffer_view(span->tx_buffer, &pending, &pending_len) != WAT_SUCCESS);
+	signal(SIGPIPE, SIG_DFL);
+
+	test_modem_set_fd(-1);
+	close(fds[1]);
+
+	test_modem_refuse_writes(1);
+	test_check(wat_span_write(span, data, sizeof(data)) == sizeof(data));
+	test_check(wat_span_want_write(TEST_MODEM_SPAN) == WAT_FALSE);
+	test_check(wat_buffer_view(span->tx_buffer, &pending, &pending_len) != WAT_SUCCESS);
+	test_modem_refuse_writes(0);
+}
+
+static void test_deadline(wat_span_t *span)
+{
+	user_reply_t late;
+	uint32_t dropped_before = dropped();
+	unsigned elapsed;
+
+	wait_idle(span);
+	memset(&late, 0, sizeof(late));
+	test_check(wat_cmd_enqueue(span, "AT+WSLOW", NULL, NULL, TEST_TIMEOUT) == WAT_SUCCESS);
+	test_check(wat_cmd_req_deadline(TEST_MODEM_SPAN, "AT+WLATE", on_user_reply, &late, TEST_TIMEOUT / 2, NULL) == WAT_SUCCESS);
+
+	for (elapsed = 0; !late.called && elapsed < 10 * TEST_TIMEOUT; elapsed++) {
+		test_modem_advance(1);
+	}
+	test_check(late.called == 1 && late.success == WAT_FALSE);
+	test_check(late.tokens == WAT_FALSE);
+	test_check(!strcmp(late.error, "deadline expired"));
+	test_check(was_sent("AT+WSLOW") && !was_sent("AT+WLATE"));
+	test_check(dropped() == dropped_before + 1);
+}
+
+static void test_cancel(wat_span_t *span)
+{
+	user_reply_t queued, done;
+	wat_cmd_handle_t slow_handle, queued_handle, done_handle;
+	uint32_t dropped_before = dropped();
+	unsigned elapsed;
+
+	wait_idle(span);
+	memset(&queued, 0, sizeof(queued));
+	memset(&done, 0, sizeof(done));
+	test_check(wat_cmd_enqueue_deadline(span, "AT+WSLOW", NULL, NULL, TEST_TIMEOUT, 0, &slow_handle) == WAT_SUCCESS);
+	test_check(wat_cmd_req_deadline(TEST_MODEM_SPAN, "AT+WCANCEL", on_user_reply, &queued, 0, &queued_handle) == WAT_SUCCESS);
+	test_check(slow_handle != WAT_CMD_HANDLE_INVALID && queued_handle != WAT_CMD_HANDLE_INVALID && slow_handle != queued_handle);
+
+	for (elapsed = 0; !span->cmd && elapsed < TEST_TIMEOUT; elapsed++) {
+		test_modem_advance(1);
+	}
+	test_check(span->cmd && !strcmp(span->cmd->cmd, "AT+WSLOW"));
+
+	/* Too late for the one the chip is executing */
+	test_check(wat_cmd_cancel(TEST_MODEM_SPAN, slow_handle) == WAT_EBUSY);
+
+	/* The queued one is only dropped when the span gets to it */
+	test_check(wat_cmd_cancel(TEST_MODEM_SPAN, queued_handle) == WAT_SUCCESS);
+	test_check(!queued.called);
+
+	for (elapsed = 0; !queued.called && elapsed < 10 * TEST_TIMEOUT; elapsed++) {
+		test_modem_advance(1);
+	}
+	test_check(queued.called == 1 && queued.success == WAT_FALSE);
+	test_check(queued.tokens == WAT_FALSE);
+	test_check(!strcmp(queued.error, "cancelled"));
+	test_check(!was_sent("AT+WCANCEL"));
+	test_check(dropped() == dropped_before + 1);
+
+	/* Neither is known once completed */
+	test_check(wat_cmd_cancel(TEST_MODEM_SPAN, slow_handle) == WAT_FAIL);
+	test_check(wat_cmd_cancel(TEST_MODEM_SPAN, queued_handle) == WAT_FAIL);
+
+	wait_idle(span);
+	test_check(wat_cmd_req_deadline(TEST_MODEM_SPAN, "AT+WDONE", on_user_reply, &done, TEST_TIMEOUT, &done_handle) == WAT_SUCCESS);
+	for (elapsed = 0; !done.called && elapsed < 10 * TEST_TIMEOUT; elapsed++) {
+		test_modem_advance(1);
+	}
+	test_check(done.called == 1 && done.success == WAT_TRUE);
+	/* Still active for the command interval, but answered */
+	test_check(span->cmd && span->cmd->handle == done_handle);
+	test_check(wat_cmd_cancel(TEST_MODEM_SPAN, done_handle) == WAT_FAIL);
+	test_check(queued.called == 1);
+}
+
+int main(int argc, char *argv[])
+{
+	wat_span_config_t config;
+	wat_span_t *span;
+
+	memset(&config, 0, sizeof(config));
+	config.moduletype = WAT_MODULE_TELIT_GC864;
+	config.timeout_command = TEST_TIMEOUT;
+	config.signal_poll_interval = 3600 * 1000;
+
+	test_modem_set_fake_clock();
+	test_check(test_modem_start(&config, retry_reply) == 0);
+	test_check(test_modem_wait_ready(10000) == 0);
+
+	span = wat_get_span(TEST_MODEM_SPAN);
+	test_check(span != NULL);
+
+	test_retry_in_place(span);
+	test_backoff(span);
+	test_no_resend(span);
+	test_write_failure(span);
+	test_partial_write(span);
+	test_deadline(span);
+	test_cancel(span);
+	test_batch(span);
+	test_batch_error(span);
+	test_batch_timeout(span);
+
+	test_modem_stop();
+	return 0;
+}
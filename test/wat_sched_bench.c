@@ -0,0 +1,421 @@
+/*
+ * libwat: Wireless AT commands library
+ *
+ * David Yat Sin <dyatsin@sangoma.com>
+ * Copyright (C) 2011, Sangoma Technologies.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contributors:
+ *
+ */
+
+/* Checks that scheduler timers expire in order, to the millisecond, that cancelled
+   timers never run, that stale timer ids are refused and that timers with the same
+   slack expire together, on a clock driven by the test, then times arming, cancelling
+   and running many timers. Also checks on the real clock that the wakeup fd of a span
+   becomes readable when a command is queued or a timer is due, and that running the span
+   drains it.
+   Usage: wat_sched_bench [timers] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+
+#include "libwat.h"
+#include "wat_internal.h"
+#include "test_utils.h"
+#include "test_modem.h"
+
+#define ORDER_TIMERS 1000
+#define MAX_TIMEOUT 5000
+#define WAKEUP_TIMER 50
+
+typedef struct {
+	uint64_t expires;
+	wat_timer_id_t id;
+	wat_bool_t cancelled;
+	unsigned fired;
+} sched_entry_t;
+
+static uint64_t g_now;
+static uint64_t g_last_expires;
+static unsigned g_fired;
+static unsigned g_out_of_order;
+static uint32_t g_seed = 1;
+
+static uint64_t test_clock(void)
+{
+	return g_now;
+}
+
+/* Same sequence on every run */
+static uint32_t test_rand(void)
+{
+	g_seed = (g_seed * 1103515245) + 12345;
+	return (g_seed >> 16) & 0x7fff;
+}
+
+static void on_timer(void *data)
+{
+	sched_entry_t *entry = data;
+
+	if (entry->expires > g_now || entry->expires < g_last_expires) {
+		g_out_of_order++;
+	}
+	g_last_expires = entry->expires;
+	entry->fired++;
+	g_fired++;
+}
+
+static void on_bench_timer(void *data)
+{
+	g_fired++;
+}
+
+static void test_order(void)
+{
+	static sched_entry_t entries[ORDER_TIMERS];
+	wat_sched_t *sched = NULL;
+	unsigned cancelled = 0;
+	int32_t timeto;
+	unsigned i;
+
+	g_now = 1000;
+	g_last_expires = 0;
+	g_fired = 0;
+	g_out_of_order = 0;
+	test_check(wat_sched_create(&sched, "order") == WAT_SUCCESS);
+
+	for (i = 0; i < ORDER_TIMERS; i++) {
+		int ms = 1 + (test_rand() % MAX_TIMEOUT);
+
+		memset(&entries[i], 0, sizeof(entries[i]));
+		entries[i].expires = g_now + ms;
+		test_check(wat_sched_timer(sched, "order", ms, on_timer, &entries[i], &entries[i].id) == WAT_SUCCESS);
+	}
+
+	/* Cancel from everywhere in the heap, not only the top */
+	for (i = 0; i < ORDER_TIMERS; i += 3) {
+		test_check(wat_sched_cancel_timer(sched, entries[i].id) == WAT_SUCCESS);
+		entries[i].cancelled = WAT_TRUE;
+		cancelled++;
+	}
+
+	while (g_fired < ORDER_TIMERS - cancelled) {
+		test_check(wat_sched_get_time_to_next_timer(sched, &timeto) == WAT_SUCCESS);
+		test_check(timeto > 0 && timeto <= MAX_TIMEOUT);
+
+		/* Sometimes land right on the next expiration, sometimes skip a few */
+		g_now += (test_rand() & 1) ? timeto : 1 + (test_rand() % (2 * timeto));
+		test_check(wat_sched_run(sched) == WAT_SUCCESS);
+	}
+
+	test_check(wat_sched_get_time_to_next_timer(sched, &timeto) == WAT_SUCCESS);
+	test_check(timeto == -1);
+	test_check(g_out_of_order == 0);
+	for (i = 0; i < ORDER_TIMERS; i++) {
+		test_check(entries[i].fired == (entries[i].cancelled == WAT_TRUE ? 0 : 1));
+	}
+
+	test_check(wat_sched_destroy(&sched) == WAT_SUCCESS);
+}
+
+/* Timers follow the installed clock to the millisecond */
+static void test_clock_distances(void)
+{
+	sched_entry_t entry;
+	wat_sched_t *sched = NULL;
+	int32_t timeto;
+
+	g_now = 5000;
+	g_fired = 0;
+	g_last_expires = 0;
+	g_out_of_order = 0;
+	test_check(wat_sched_time_ms() == 5000);
+	test_check(wat_sched_create(&sched, "clock") == WAT_SUCCESS);
+
+	memset(&entry, 0, sizeof(entry));
+	entry.expires = g_now + 250;
+	test_check(wat_sched_timer(sched, "clock", 250, on_timer, &entry, &entry.id) == WAT_SUCCESS);
+
+	test_check(wat_sched_get_time_to_next_timer(sched, &timeto) == WAT_SUCCESS);
+	test_check(timeto == 250);
+
+	g_now += 249;
+	test_check(wat_sched_get_time_to_next_timer(sched, &timeto) == WAT_SUCCESS);
+	test_check(timeto == 1);
+	wat_sched_run(sched);
+	test_check(entry.fired == 0);
+
+	g_now += 1;
+	test_check(wat_sched_get_time_to_next_timer(sched, &timeto) == WAT_SUCCESS);
+	test_check(timeto == 0);
+	wat_sched_run(sched);
+	test_check(entry.fired == 1);
+
+	/* A long stall runs the late timers once, not once per missed period */
+	entry.expires = g_now + 10;
+	test_check(wat_sched_timer(sched, "clock", 10, on_timer, &entry, &entry.id) == WAT_SUCCESS);
+	g_now += 3600 * 1000;
+	wat_sched_run(sched);
+	test_check(entry.fired == 2);
+	test_check(g_out_of_order == 0);
+
+	test_check(wat_sched_destroy(&sched) == WAT_SUCCESS);
+}
+
+/* Ids of timers that expired or were cancelled must not reach the timer that reused their slot */
+static void test_stale_ids(void)
+{
+	static sched_entry_t entries[3 * ORDER_TIMERS];
+	sched_entry_t first, reused;
+	wat_sched_t *sched = NULL;
+	unsigned i;
+
+	g_now = 1000;
+	g_fired = 0;
+	g_last_expires = 0;
+	g_out_of_order = 0;
+	test_check(wat_sched_create(&sched, "ids") == WAT_SUCCESS);
+
+	memset(&first, 0, sizeof(first));
+	memset(&reused, 0, sizeof(reused));
+
+	/* The only free slot is the one just released, so the new timer gets it */
+	first.expires = g_now + 10;
+	test_check(wat_sched_timer(sched, "ids", 10, on_timer, &first, &first.id) == WAT_SUCCESS);
+	test_check(wat_sched_cancel_timer(sched, first.id) == WAT_SUCCESS);
+	test_check(wat_sched_cancel_timer(sched, first.id) != WAT_SUCCESS);
+
+	reused.expires = g_now + 20;
+	test_check(wat_sched_timer(sched, "ids", 20, on_timer, &reused, &reused.id) == WAT_SUCCESS);
+	test_check(reused.id != first.id);
+	test_check(wat_sched_cancel_timer(sched, first.id) != WAT_SUCCESS);
+
+	g_now += 20;
+	wat_sched_run(sched);
+	test_check(first.fired == 0 && reused.fired == 1);
+	test_check(wat_sched_cancel_timer(sched, reused.id) != WAT_SUCCESS);
+
+	/* Ids stay valid while the pool grows */
+	for (i = 0; i < wat_array_len(entries); i++) {
+		memset(&entries[i], 0, sizeof(entries[i]));
+		entries[i].expires = g_now + 100 + i;
+		test_check(wat_sched_timer(sched, "ids", 100 + i, on_timer, &entries[i], &entries[i].id) == WAT_SUCCESS);
+	}
+	for (i = 0; i < wat_array_len(entries); i += 2) {
+		test_check(wat_sched_cancel_timer(sched, entries[i].id) == WAT_SUCCESS);
+		entries[i].cancelled = WAT_TRUE;
+	}
+
+	/* Timers sharing the same data go away together, from anywhere in the heap */
+	for (i = 0; i < 10; i++) {
+		test_check(wat_sched_timer(sched, "ids", 50 + (i * 500), on_timer, &first, NULL) == WAT_SUCCESS);
+	}
+	test_check(wat_sched_cancel_timers_by_data(sched, &first) == WAT_SUCCESS);
+
+	g_now += 100 + wat_array_len(entries);
+	wat_sched_run(sched);
+	test_check(first.fired == 0);
+	test_check(g_out_of_order == 0);
+	for (i = 0; i < wat_array_len(entries); i++) {
+		test_check(entries[i].fired == (entries[i].cancelled == WAT_TRUE ? 0 : 1));
+	}
+
+	test_check(wat_sched_destroy(&sched) == WAT_SUCCESS);
+}
+
+/* Timers armed with the same slack expire together, even from different schedules */
+static void test_slack(void)
+{
+	sched_entry_t first, second, exact;
+	wat_sched_t *sched_a = NULL;
+	wat_sched_t *sched_b = NULL;
+	int32_t timeto_a, timeto_b;
+
+	g_now = 1003;
+	g_fired = 0;
+	g_last_expires = 0;
+	g_out_of_order = 0;
+	test_check(wat_sched_create(&sched_a, "slack_a") == WAT_SUCCESS);
+	test_check(wat_sched_create(&sched_b, "slack_b") == WAT_SUCCESS);
+
+	memset(&first, 0, sizeof(first));
+	memset(&second, 0, sizeof(second));
+	memset(&exact, 0, sizeof(exact));
+
+	/* Both round up to 1150 */
+	first.expires = 1150;
+	second.expires = 1150;
+	test_check(wat_sched_timer_slack(sched_a, "slack", 100, 50, on_timer, &first, NULL) == WAT_SUCCESS);
+	g_now += 20;
+	test_check(wat_sched_timer_slack(sched_b, "slack", 100, 50, on_timer, &second, NULL) == WAT_SUCCESS);
+
+	/* No slack is the exact expiration */
+	exact.expires = g_now + 100;
+	test_check(wat_sched_timer_slack(sched_b, "exact", 100, 0, on_timer, &exact, NULL) == WAT_SUCCESS);
+
+	test_check(wat_sched_get_time_to_next_timer(sched_a, &timeto_a) == WAT_SUCCESS);
+	test_check(wat_sched_get_time_to_next_timer(sched_b, &timeto_b) == WAT_SUCCESS);
+	test_check(timeto_a == 1150 - (int32_t)g_now);
+	test_check(timeto_b == 100);
+
+	g_now = exact.expires;
+	wat_sched_run(sched_b);
+	test_check(exact.fired == 1 && second.fired == 0);
+
+	g_now = 1149;
+	wat_sched_run(sched_a);
+	wat_sched_run(sched_b);
+	test_check(first.fired == 0 && second.fired == 0);
+
+	g_now = 1150;
+	wat_sched_run(sched_a);
+	wat_sched_run(sched_b);
+	test_check(first.fired == 1 && second.fired == 1);
+	test_check(g_out_of_order == 0);
+
+	test_check(wat_sched_destroy(&sched_a) == WAT_SUCCESS);
+	test_check(wat_sched_destroy(&sched_b) == WAT_SUCCESS);
+}
+
+static void bench_sched(unsigned timers)
+{
+	wat_timer_id_t *ids;
+	wat_sched_t *sched = NULL;
+	uint64_t start, armed, cancelled;
+	unsigned i;
+
+	ids = malloc(timers * sizeof(*ids));
+	test_check(ids != NULL);
+
+	g_now = 1000;
+	g_fired = 0;
+	test_check(wat_sched_create(&sched, "bench") == WAT_SUCCESS);
+
+	start = test_time_us();
+	for (i = 0; i < timers; i++) {
+		test_check(wat_sched_timer(sched, "bench", 1 + (test_rand() % MAX_TIMEOUT), on_bench_timer, NULL, &ids[i]) == WAT_SUCCESS);
+	}
+	armed = test_time_us();
+	for (i = 0; i < timers; i += 2) {
+		wat_sched_cancel_timer(sched, ids[i]);
+	}
+	cancelled = test_time_us();
+	g_now += MAX_TIMEOUT;
+	wat_sched_run(sched);
+
+	printf("%u timers: arm %.3f us, cancel %.3f us, run %.3f us per timer\n", timers,
+			(double)(armed - start) / timers,
+			(double)(cancelled - armed) / ((timers + 1) / 2),
+			(double)(test_time_us() - cancelled) / (timers / 2));
+	test_check(g_fired == timers / 2);
+
+	test_check(wat_sched_destroy(&sched) == WAT_SUCCESS);
+	free(ids);
+}
+
+/* Whether fd becomes readable within timeout_ms */
+static int fd_readable(int fd, int timeout_ms)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, timeout_ms) == 1 && (pfd.revents & POLLIN);
+}
+
+static int on_wakeup_response(uint8_t span_id, char *tokens[], wat_bool_t success, void *obj, char *error)
+{
+	g_fired++;
+	return 0;
+}
+
+static void test_wakeup_fd(void)
+{
+	wat_span_config_t config;
+	wat_span_t *span;
+	uint64_t start;
+	unsigned elapsed;
+	int fd;
+
+	memset(&config, 0, sizeof(config));
+	config.moduletype = WAT_MODULE_TELIT_GC864;
+	config.signal_poll_interval = 3600 * 1000;
+
+	test_check(test_modem_start(&config, NULL) == 0);
+	test_check(test_modem_wait_ready(5000) == 0);
+	span = wat_get_span(TEST_MODEM_SPAN);
+	test_check(span != NULL);
+	for (elapsed = 0; (span->cmd || span->cmd_busy || wat_cmd_pending(span) == WAT_TRUE) && elapsed < 5000; elapsed++) {
+		test_modem_advance(1);
+	}
+
+	fd = wat_span_get_wakeup_fd(TEST_MODEM_SPAN);
+	test_check(fd >= 0);
+	wat_span_run(TEST_MODEM_SPAN);
+	test_check(!fd_readable(fd, 0));
+
+	/* A queued command wakes the span up, sending it drains the fd */
+	g_fired = 0;
+	test_check(wat_cmd_req(TEST_MODEM_SPAN, "AT+WWAKE", on_wakeup_response, NULL) == WAT_SUCCESS);
+	test_check(fd_readable(fd, 0));
+	wat_span_run(TEST_MODEM_SPAN);
+	test_check(span->cmd != NULL);
+	test_check(!fd_readable(fd, 0));
+	for (elapsed = 0; !g_fired && elapsed < 5000; elapsed++) {
+		test_modem_advance(1);
+	}
+	test_check(g_fired == 1);
+	for (elapsed = 0; (span->cmd || span->cmd_busy) && elapsed < 5000; elapsed++) {
+		test_modem_advance(1);
+	}
+	wat_span_run(TEST_MODEM_SPAN);
+	test_check(!fd_readable(fd, 0));
+
+	/* A timer wakes the span up once it is due, not before */
+	g_fired = 0;
+	start = test_time_us();
+	test_check(wat_sched_timer(span->sched, "wakeup", WAKEUP_TIMER, on_bench_timer, NULL, NULL) == WAT_SUCCESS);
+	test_check(!fd_readable(fd, 0));
+	test_check(fd_readable(fd, 5000));
+	test_check(test_time_us() - start >= (WAKEUP_TIMER - 1) * 1000);
+	test_check(g_fired == 0);
+	wat_span_run(TEST_MODEM_SPAN);
+	test_check(g_fired == 1);
+	test_check(!fd_readable(fd, 0));
+
+	test_modem_stop();
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned timers = (argc > 1) ? atoi(argv[1]) : 100000;
+
+	test_check(test_modem_register() == 0);
+	wat_sched_set_clock(test_clock);
+
+	test_order();
+	test_clock_distances();
+	test_stale_ids();
+	test_slack();
+	bench_sched(timers);
+
+	wat_sched_set_clock(NULL);
+	test_wakeup_fd();
+	return 0;
+}